@@ -1,6 +1,7 @@
 #include "app.h"
 #include "edit/songops.h"
-#include "file/chromawriter.h"
+#include <algorithm>
+#include <cstdio>
 #include <stdexcept>
 #include <glad/glad.h>
 
@@ -10,11 +11,31 @@ using namespace ui;
 
 void cAudioCallback(void * userdata, uint8_t *stream, int len);
 
+const int MIDI_TOUCH_ID = 0x10000; // + channel * 128 + note
+// audio clock older than this many buffers isn't used for jam timing
+const int STALE_CLOCK_BUFFERS = 4;
+
+// per-user directory for files that aren't chosen by the user
+static file::Path userDataPath()
+{
+    char *prefPath = SDL_GetPrefPath("chromatracker", "chromatracker");
+    if (!prefPath) {
+        cout << "Can't get user data directory: " <<SDL_GetError()<< "\n";
+        return file::Path();
+    }
+    file::Path path = std::filesystem::u8path(prefPath);
+    SDL_free(prefPath);
+    return path;
+}
+
 App::App(SDL_Window *window)
     : window(window)
+    , timerFrequency(SDL_GetPerformanceFrequency())
     , eventKeyboard(this)
     , eventsEdit(this)
     , sampleEdit(this)
+    , journal(userDataPath() / "recovery", &undoer)
+    , master(OUT_FRAME_RATE, MAX_TICK_FRAMES)
 {
     // TODO
     settings.bookmarks.push_back("D:\\Google Drive\\mods");
@@ -27,18 +48,41 @@ App::App(SDL_Window *window)
     spec.samples = 128;
     spec.callback = &cAudioCallback; // runs in a separate thread!
     spec.userdata = this;
-    audioDevice = SDL_OpenAudioDevice(NULL, 0, &spec, NULL, 0);
+    SDL_AudioSpec obtained;
+    // 16 bit devices are quantized (and dithered) by MasterStage, SDL
+    // converts anything else from float
+    audioDevice = SDL_OpenAudioDevice(NULL, 0, &spec, &obtained,
+                                      SDL_AUDIO_ALLOW_FORMAT_CHANGE);
+    if (audioDevice && obtained.format != spec.format
+            && obtained.format != AUDIO_S16SYS) {
+        SDL_CloseAudioDevice(audioDevice);
+        audioDevice = SDL_OpenAudioDevice(NULL, 0, &spec, &obtained, 0);
+    }
     if (!audioDevice) {
         throw std::runtime_error(string("Can't open audio device: ")
             + SDL_GetError());
     }
+    audioBufferFrames = obtained.samples;
+    if (obtained.format == AUDIO_S16SYS)
+        int16Buffer.resize(audioBufferFrames * NUM_CHANNELS);
+
+    setRenderAhead(settings.renderAhead);
+    master.setLimiter(settings.limiter);
+    master.setDither(settings.dither);
+
+    midiInput = std::make_unique<play::MidiInput>(
+        [this](const play::MidiNote &note) { midiNote(note); });
 }
 
 App::~App()
 {
+    midiInput.reset(); // stop MIDI thread
     // stop callbacks
     SDL_PauseAudioDevice(audioDevice, 1);
     SDL_CloseAudioDevice(audioDevice);
+    renderAhead.reset(); // stop render thread
+    if (saveThread.joinable())
+        saveThread.join();
 }
 
 void App::main(const vector<string> args)
@@ -57,8 +101,16 @@ void App::main(const vector<string> args)
     }
 
     undoer.reset(&song);
+    if (journal.recover(&song))
+        cout << "Recovered song from the last session\n";
+    undoer.setObserver(&journal);
+    journal.checkpoint(&song);
     eventsEdit.resetCursor(true);
-    player.setCursor(Cursor(&song));
+    {
+        std::unique_lock playerLock(player.mu);
+        player.setCursor(Cursor(&song));
+        flushRenderAhead();
+    }
 
     int winW, winH;
     SDL_GetWindowSize(window, &winW, &winH);
@@ -88,6 +140,11 @@ void App::main(const vector<string> args)
             case SDL_KEYDOWN:
                 keyDown(event.key);
                 break;
+            case SDL_TEXTINPUT:
+                if (browser) {
+                    browser->textInput(event.text);
+                }
+                break;
             case SDL_KEYUP:
                 if (!browser) {
                     if (tab == Tab::Events) {
@@ -131,13 +188,20 @@ void App::main(const vector<string> args)
                 break;
             }
         }
+        recordMidi();
+        updateRenderAhead();
+        prefetcher.update(eventsEdit.cursor(),
+                          eventKeyboard.selected.sample.lock());
+        updateSongLoad();
+        journal.update(&song);
 
         glDisable(GL_SCISSOR_TEST);
         glClear(GL_COLOR_BUFFER_BIT);
         glEnable(GL_SCISSOR_TEST);
 
         float lineHeight = FONT_DEFAULT.lineHeight;
-        songEdit.draw(this, {winR(TL), winR(TR, {-160, lineHeight})}, &song);
+        songEdit.draw(this, {winR(TL), winR(TR, {-480, lineHeight})}, &song);
+        drawStatus({winR(TR, {-480, 0}), winR(TR, {-160, lineHeight})});
         Rect mainR {winR(TL, {0, lineHeight}), winR(BR, {-160, -100})};
         if (browser) {
             browser->draw(mainR);
@@ -182,6 +246,137 @@ void App::resizeWindow(int w, int h)
     glLoadIdentity();
 }
 
+void App::drawStatus(Rect rect)
+{
+    scissorRect(rect);
+    char text[64];
+    if (songLoader) {
+        // can only cancel before the song is replaced
+        snprintf(text, sizeof(text), songLoader->taken() ?
+                 "Loading waves %d%%" : "Loading %d%% (Esc)",
+                 (int)(songLoader->progress() * 100));
+        drawText(text, rect(TL), C_WHITE);
+        return;
+    } else if (saving) {
+        drawText("Saving...", rect(TL), C_WHITE);
+        return;
+    }
+    uint32_t lost = player.jam.numOverflows();
+    if (lost) {
+        snprintf(text, sizeof(text), "Jam %.1fms (%u lost)",
+                 jamLatency.load(), lost);
+    } else {
+        snprintf(text, sizeof(text), "Jam %.1fms", jamLatency.load());
+    }
+    drawText(text, rect(TL), C_WHITE);
+
+    // overload governor: quality drops and dropped voices
+    auto &governor = player.governor;
+    int load = (int)(governor.load() * 100);
+    uint32_t qualityDrops = governor.numQualityDrops();
+    uint32_t voicesDropped = governor.numVoicesDropped();
+    if (qualityDrops || voicesDropped) {
+        snprintf(text, sizeof(text), "CPU %d%% (q%u v%u)",
+                 load, qualityDrops, voicesDropped);
+    } else {
+        snprintf(text, sizeof(text), "CPU %d%%", load);
+    }
+    drawText(text, rect(TL) + glm::vec2(160, 0), C_WHITE);
+}
+
+void App::updateSongLoad()
+{
+    if (!songLoader)
+        return;
+    if (auto loaded = songLoader->takeSong()) {
+        {
+            std::unique_lock playerLock(player.mu);
+            player.stop();
+            flushRenderAhead();
+        }
+        {
+            std::unique_lock lock(song.mu);
+            song.clear();
+            song.samples = std::move(loaded->samples);
+            song.tracks = std::move(loaded->tracks);
+            song.sections = std::move(loaded->sections);
+            song.volume = loaded->volume;
+        }
+        undoer.reset(&song);
+        // changes would apply to the old song. resumes when waves are loaded
+        journal.suspend();
+        // next save must write the whole file
+        if (saveThread.joinable())
+            saveThread.join();
+        saveState = file::chroma::SaveState();
+        eventsEdit.resetCursor(true);
+        eventKeyboard.reset();
+    }
+    if (songLoader->finished()) {
+        string error = songLoader->error();
+        if (!error.empty())
+            cout << "Error loading song: " <<error<< "\n";
+        if (journal.suspended())
+            journal.checkpoint(&song);
+        songLoader.reset();
+    }
+}
+
+void App::saveSong(file::Path path, bool compact)
+{
+    if (saving) {
+        cout << "Already saving\n";
+        return;
+    }
+    if (saveThread.joinable())
+        saveThread.join();
+
+    // snapshot on the UI thread, the only thread that modifies the song
+    // saveState is only used by the save thread until it finishes
+    auto writer = std::make_shared<file::chroma::Writer>(
+        &song, path, &saveState, compact);
+    saving = true;
+    saveThread = std::thread([this, writer]() {
+        writer->encode();
+        writer->save(); // errors are reported by the writer
+        saving = false;
+    });
+}
+
+void App::setRenderAhead(bool enable)
+{
+    if (!enable) {
+        // the player is ahead of the output, play what was rendered first.
+        // removed by updateRenderAhead()
+        if (renderAhead)
+            renderAhead->finish();
+        return;
+    }
+    frames aheadFrames = settings.renderAheadMs * OUT_FRAME_RATE / 1000;
+    auto newRenderAhead = std::make_unique<play::RenderAhead>(&player,
+        OUT_FRAME_RATE, aheadFrames, MAX_TICK_FRAMES);
+    SDL_LockAudioDevice(audioDevice);
+    renderAhead.swap(newRenderAhead);
+    SDL_UnlockAudioDevice(audioDevice);
+    // old render thread stops here, outside the audio lock
+}
+
+void App::updateRenderAhead()
+{
+    if (renderAhead && renderAhead->done()) {
+        // the callback renders the song now
+        SDL_LockAudioDevice(audioDevice);
+        renderAhead.reset();
+        SDL_UnlockAudioDevice(audioDevice);
+    }
+}
+
+void App::flushRenderAhead()
+{
+    if (renderAhead)
+        renderAhead->flush();
+}
+
 void App::scissorRect(Rect rect) const
 {
     glScissor(rect.min.x - winR.min.x, winR.max.y - rect.max.y,
@@ -202,6 +397,15 @@ void App::keyDown(const SDL_KeyboardEvent &e)
             undoer.redo();
         }
         break;
+    case SDLK_ESCAPE:
+        // after the song is replaced, the old one is gone and the new one
+        // needs its waves
+        if (songLoader && !songLoader->taken() && !browser) {
+            songLoader.reset(); // cancel
+            cout << "Loading cancelled\n";
+            return;
+        }
+        break;
     /* Tabs */
     case SDLK_F2:
         tab = Tab::Events;
@@ -209,6 +413,22 @@ void App::keyDown(const SDL_KeyboardEvent &e)
     case SDLK_F3:
         tab = Tab::Sample;
         break;
+    case SDLK_F9:
+        settings.renderAhead = !settings.renderAhead;
+        setRenderAhead(settings.renderAhead);
+        break;
+    case SDLK_F10:
+        settings.limiter = !settings.limiter;
+        SDL_LockAudioDevice(audioDevice);
+        master.setLimiter(settings.limiter);
+        SDL_UnlockAudioDevice(audioDevice);
+        break;
+    case SDLK_F11:
+        settings.dither = !settings.dither;
+        SDL_LockAudioDevice(audioDevice);
+        master.setDither(settings.dither);
+        SDL_UnlockAudioDevice(audioDevice);
+        break;
     /* Sample select */
     case SDLK_KP_PLUS:
         if (ctrl) {
@@ -231,7 +451,13 @@ void App::keyDown(const SDL_KeyboardEvent &e)
                         numSamples = song.samples.size();
                     }
                     shared_ptr<Sample> newSample(new Sample);
-                    loader->loadSample(newSample);
+                    try {
+                        loader->loadSample(newSample);
+                    } catch (std::exception &e) {
+                        cout << "Error loading sample: " <<e.what()<< "\n";
+                        browser.reset();
+                        return;
+                    }
                     undoer.doOp(edit::ops::AddSample(numSamples, newSample));
                     eventKeyboard.selected.sample = newSample;
 
@@ -268,6 +494,11 @@ void App::keyDown(const SDL_KeyboardEvent &e)
                         browser.reset();
                         return;
                     }
+                    if (songLoader && songLoader->taken()) {
+                        cout << "Still loading waves\n";
+                        browser.reset();
+                        return;
+                    }
                     unique_ptr<file::ModuleLoader> loader(
                         file::moduleLoaderForPath(path));
                     if (!loader) {
@@ -275,18 +506,9 @@ void App::keyDown(const SDL_KeyboardEvent &e)
                         browser.reset();
                         return;
                     }
-                    {
-                        std::unique_lock playerLock(player.mu);
-                        player.stop();
-                    }
-                    {
-                        std::unique_lock lock(song.mu);
-                        song.clear();
-                        loader->loadSong(&song);
-                    }
-                    undoer.reset(&song);
-                    eventsEdit.resetCursor(true);
-                    eventKeyboard.reset();
+                    // replaces (cancels) any load in progress
+                    songLoader = std::make_unique<file::AsyncLoader>(
+                        loader.release());
 
                     // call at the end to prevent access violation!
                     browser.reset();
@@ -295,19 +517,16 @@ void App::keyDown(const SDL_KeyboardEvent &e)
         break;
     case SDLK_s:
         if (ctrl) {
-            SDL_RWops *stream = SDL_RWFromFile("out.chroma", "w");
-            if (!stream) {
-                cout << "Error opening stream: " <<SDL_GetError()<< "\n";
-                break;
-            }
-            file::chroma::Writer writer(stream);
-            writer.writeSong(&song);
+            // shift: compact, rewriting the whole file
+            saveSong("out.chroma", e.keysym.mod & KMOD_SHIFT);
         }
         break;
     }
 
     if (browser) {
+        // typing filters the browser (key up isn't sent to eventKeyboard either)
         browser->keyDown(e);
+        return;
     } else if (tab == Tab::Events) {
         eventsEdit.keyDown(e);
     }
@@ -339,9 +558,10 @@ std::shared_ptr<ui::Touch> App::captureTouch(const Rect &r) {
 
 bool App::jamEvent(play::JamEvent jam, uint32_t timestamp)
 {
+    jam.inputTime = eventTime(timestamp);
+    jam.frame = calcJamFrame(jam.inputTime);
+    player.jam.queueJamEvent(jam); // doesn't need lock
     std::unique_lock playerLock(player.mu);
-    jam.event.time = calcTickDelay(timestamp);
-    player.jam.queueJamEvent(jam);
     return (bool)player.cursor().section.lock();
 }
 
@@ -350,15 +570,78 @@ bool App::jamEvent(const SDL_KeyboardEvent &e, const Event &event)
     return jamEvent({event, -e.keysym.scancode}, e.timestamp);
 }
 
-ticks App::calcTickDelay(uint32_t timestamp)
+void App::midiNote(const play::MidiNote &note)
 {
-    if (audioCallbackTime > timestamp) {
-        timestamp = 0;
+    play::JamEvent jam;
+    jam.touchId = MIDI_TOUCH_ID + note.channel * 128 + note.note;
+    if (note.velocity != 0) {
+        std::unique_lock lock(midiMu);
+        jam.event = midiSelected;
+        jam.event.pitch = glm::clamp(note.note, MIN_PITCH, MAX_PITCH);
+        jam.event.velocity = note.velocity / 127.0f;
     } else {
-        timestamp -= audioCallbackTime;
+        jam.event.special = Event::Special::FadeOut;
+    }
+    jam.inputTime = note.time;
+    jam.frame = calcJamFrame(jam.inputTime);
+    player.jam.queueJamEvent(jam);
+
+    // writing to the song must happen on the UI thread
+    std::unique_lock lock(midiMu);
+    midiRecords.push_back({jam.event, jam.frame});
+}
+
+void App::recordMidi()
+{
+    vector<MidiRecord> records;
+    {
+        std::unique_lock lock(midiMu);
+        midiSelected = eventKeyboard.selected;
+        records.swap(midiRecords);
+    }
+    for (auto &record : records) {
+        // already played, now record it where it was heard, independent of
+        // the frame rate
+        Cursor cursor;
+        {
+            std::unique_lock playerLock(player.mu);
+            cursor = player.cursorAt(record.frame);
+        }
+        eventKeyboard.recordJam((bool)cursor.section.lock(), record.event,
+                                cursor);
     }
-    float ticksPerSecond = player.currentTempo() * TICKS_PER_BEAT / 60.0;
-    return timestamp / 1000.0 * ticksPerSecond;
+}
+
+uint64_t App::eventTime(uint32_t timestamp) const
+{
+    // event timestamps only have millisecond resolution, so measure the age
+    // of the event and subtract from the high resolution timer
+    uint64_t now = SDL_GetPerformanceCounter();
+    uint32_t ms = SDL_GetTicks();
+    uint32_t age = (ms > timestamp) ? (ms - timestamp) : 0;
+    return now - (uint64_t)age * timerFrequency / 1000;
+}
+
+int64_t App::calcJamFrame(uint64_t time)
+{
+    play::ClockPoint clock = audioClock.read();
+    // keep the same offset from the callback that the input had, so latency is
+    // constant instead of jittering with the callback period.
+    // leave room for one buffer, plus one tick which may be rendered ahead
+    frames lead = audioBufferFrames + OUT_FRAME_RATE * 60
+        / (player.currentTempo() * TICKS_PER_BEAT);
+    // the clock is unset before the first callback, and stale if the device
+    // stopped calling back
+    if (clock.time == 0)
+        return clock.frame + lead;
+    int64_t delta = (int64_t)(time - clock.time) * OUT_FRAME_RATE
+        / (int64_t)timerFrequency;
+    if (delta > audioBufferFrames * STALE_CLOCK_BUFFERS)
+        return clock.frame + lead;
+    // input between callbacks should be within one buffer of the clock
+    delta = std::clamp(delta, (int64_t)-audioBufferFrames,
+                       (int64_t)audioBufferFrames);
+    return clock.frame + lead + delta;
 }
 
 void cAudioCallback(void * userdata, uint8_t *stream, int len)
@@ -368,13 +651,34 @@ void cAudioCallback(void * userdata, uint8_t *stream, int len)
 
 void App::audioCallback(uint8_t *stream, int len)
 {
-    audioCallbackTime = SDL_GetTicks();
-    std::unique_lock lock(player.mu);
+    uint64_t callbackTime = SDL_GetPerformanceCounter();
+    play::disableDenormals(); // SDL may recreate the thread
 
-    float *sampleStream = (float *)stream;
-    int numSamples = len / sizeof(float);
+    // 16 bit output is mixed here first
+    bool int16Output = !int16Buffer.empty();
+    float *sampleStream = int16Output ? int16Buffer.data() : (float *)stream;
+    int numSamples = len / (int16Output ? sizeof(int16_t) : sizeof(float));
     frames numFrames = numSamples / NUM_CHANNELS;
 
+    // with render ahead, the song comes from the ring and only jam is
+    // rendered here, so jam events still play with short latency
+    std::unique_lock<std::mutex> lock;
+    bool ahead = renderAhead && renderAhead->read(sampleStream, numFrames);
+    if (!ahead) {
+        lock = std::unique_lock(player.mu);
+        for (int i = 0; i < numSamples; i++) {
+            sampleStream[i] = 0;
+        }
+    }
+
+    // output frame at the start of this buffer (tick buffer may be ahead,
+    // limiter delays output)
+    play::ClockPoint clock {
+        player.framePos() - (tickBufferLen - tickBufferPos) / NUM_CHANNELS
+            - master.latency(),
+        callbackTime};
+    audioClock.publish(clock);
+
     int writePos = 0;
 
     do {
@@ -385,29 +689,39 @@ void App::audioCallback(uint8_t *stream, int len)
                 writeLen = numSamples - writePos;
             }
             for (int i = 0; i < writeLen; i++) {
-                sampleStream[writePos++] = tickBuffer[tickBufferPos++];
+                sampleStream[writePos++] += tickBuffer[tickBufferPos++];
             }
         }
 
         if (writePos >= numSamples)
             break;
 
-        tickBufferLen = player.processTick(tickBuffer, MAX_TICK_FRAMES,
-                                           OUT_FRAME_RATE) * NUM_CHANNELS;
+        if (ahead) {
+            tickBufferLen = player.processJamTick(tickBuffer, MAX_TICK_FRAMES,
+                                                  OUT_FRAME_RATE);
+        } else {
+            tickBufferLen = player.processTick(tickBuffer, MAX_TICK_FRAMES,
+                                               OUT_FRAME_RATE);
+        }
+        tickBufferLen *= NUM_CHANNELS;
         tickBufferPos = 0;
     } while (tickBufferLen != 0);
 
-    while (writePos < numSamples) {
-        sampleStream[writePos++] = 0;
+    if (player.jam.lastEventFrame >= 0) {
+        // estimate when the frame reaches the speaker: this buffer starts
+        // playing after the previous one
+        int64_t outFrames = player.jam.lastEventFrame - clock.frame
+            + audioBufferFrames;
+        uint64_t outTime = clock.time
+            + outFrames * (int64_t)timerFrequency / OUT_FRAME_RATE;
+        jamLatency = (int64_t)(outTime - player.jam.lastEventInputTime)
+            * 1000.0f / timerFrequency;
+        player.jam.lastEventFrame = -1;
     }
 
-    // clip!!
-    for (int i = 0; i < numSamples; i++) {
-        if (sampleStream[i] > 1.0f)
-            sampleStream[i] = 1.0f;
-        else if (sampleStream[i] < -1.0f)
-            sampleStream[i] = -1.0f;
-    }
+    master.process(sampleStream, numFrames);
+    if (int16Output)
+        master.toInt16(sampleStream, (int16_t *)stream, numSamples);
 }
 
 } // namespace
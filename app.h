@@ -2,7 +2,18 @@
 #include <common.h>
 
 #include "edit/undoer.hpp"
+#include "file/asyncloader.h"
+#include "file/chromawriter.h"
+#include "file/dirscanner.h"
+#include "file/journal.h"
+#include "file/libraryindex.h"
+#include "play/frameclock.h"
+#include "play/masterstage.h"
+#include "play/midiinput.h"
+#include "play/preview.h"
+#include "play/renderahead.h"
 #include "play/songplay.h"
+#include "play/waveprefetch.h"
 #include "ui/panels/browser.h"
 #include "ui/panels/eventkeyboard.h"
 #include "ui/panels/eventsedit.h"
@@ -11,6 +22,8 @@
 #include "ui/settings.h"
 #include "ui/ui.h"
 #include <atomic>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <SDL2/SDL.h>
 
@@ -37,13 +50,21 @@ public:
     // return if playing
     bool jamEvent(play::JamEvent jam, uint32_t timestamp);
     bool jamEvent(const SDL_KeyboardEvent &e, const Event &jam);
+    // drop song audio rendered ahead, after stopping or moving playback or
+    // replacing the song (player mutex locked)
+    void flushRenderAhead();
 
     edit::Undoer<Song *> undoer;
     Song song;
     play::SongPlay player;
+    play::WavePrefetcher prefetcher {&player};
     ui::panels::EventKeyboard eventKeyboard;
     ui::panels::EventsEdit eventsEdit;
     ui::Settings settings;
+    // for Browser, outlive it
+    file::LibraryIndex library {"library.index"};
+    file::DirectoryScanner dirScanner {&library};
+    play::Preview preview {OUT_FRAME_RATE, MAX_TICK_FRAMES};
 
 private:
     enum class Tab
@@ -51,22 +72,49 @@ private:
         Events, Sample
     };
 
+    // a MIDI event which was played, to be recorded on the UI thread
+    struct MidiRecord
+    {
+        Event event;
+        int64_t frame; // output frame where it was played
+    };
+
     void resizeWindow(int w, int h);
 
     void keyDown(const SDL_KeyboardEvent &e);
+    void midiNote(const play::MidiNote &note); // called on MIDI thread
+    void recordMidi(); // write events played since the last frame
+
+    void drawStatus(ui::Rect rect);
+    void updateSongLoad(); // swap in the loaded song when ready
+    // in the background. appends changes since the last save unless compact
+    void saveSong(file::Path path, bool compact);
+    void setRenderAhead(bool enable);
+    // remove render ahead once it's disabled and its audio has played
+    void updateRenderAhead();
 
     std::shared_ptr<ui::Touch> findTouch(int id);
 
-    ticks calcTickDelay(uint32_t timestamp); // player must be locked
+    // convert SDL event timestamp to high resolution timer
+    uint64_t eventTime(uint32_t timestamp) const;
+    int64_t calcJamFrame(uint64_t time);
 
     SDL_Window *window;
     ui::Rect winR {{0, 0}, {0, 0}};
     SDL_AudioDeviceID audioDevice;
+    frames audioBufferFrames;
+    vector<float> int16Buffer; // float mix, if the device is 16 bit
+    const uint64_t timerFrequency;
 
     Tab tab {Tab::Events};
     ui::panels::SongEdit songEdit;
     ui::panels::SampleEdit sampleEdit;
     unique_ptr<ui::panels::Browser> browser;
+    unique_ptr<file::AsyncLoader> songLoader; // null if not loading
+    std::thread saveThread;
+    std::atomic<bool> saving {false};
+    file::chroma::SaveState saveState;
+    file::Journal journal;
 
     std::unordered_map<int, shared_ptr<ui::Touch>> uncapturedTouches;
     std::unordered_map<int, shared_ptr<ui::Touch>> capturedTouches;
@@ -74,7 +122,15 @@ private:
     float tickBuffer[MAX_TICK_FRAMES * NUM_CHANNELS];
     int tickBufferLen {0}; // in SAMPLES (not frames!)
     int tickBufferPos {0};
-    std::atomic<uint32_t> audioCallbackTime {0};
+    play::FrameClock audioClock;
+    play::MasterStage master;
+    unique_ptr<play::RenderAhead> renderAhead; // null if disabled
+
+    unique_ptr<play::MidiInput> midiInput;
+    std::mutex midiMu; // protects midiSelected and midiRecords
+    Event midiSelected; // copy of eventKeyboard.selected for MIDI thread
+    vector<MidiRecord> midiRecords;
+    std::atomic<float> jamLatency {0}; // input to output, in milliseconds
 };
 
 } // namespace
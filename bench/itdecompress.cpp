@@ -0,0 +1,176 @@
+// measures ITDecompress throughput on generated samples, and checks that they
+// decode to the original values
+#include <common.h>
+
+#include <file/itdecompress.hpp>
+#include <chrono>
+#include <cmath>
+#include <random>
+
+using namespace chromatracker;
+using namespace chromatracker::file;
+
+const frames BENCH_FRAMES = 4000000;
+const int BENCH_REPEATS = 5;
+
+// writes bit fields least significant bit first, like ITBitReader reads them
+class BitWriter
+{
+public:
+    void write(uint32_t value, int numBits)
+    {
+        bits |= (uint64_t)(value & ((1u << numBits) - 1)) << count;
+        count += numBits;
+        while (count >= 8) {
+            data.push_back(bits & 0xff);
+            bits >>= 8;
+            count -= 8;
+        }
+    }
+
+    const vector<uint8_t> & finish()
+    {
+        if (count)
+            data.push_back(bits & 0xff);
+        bits = 0;
+        count = 0;
+        return data;
+    }
+
+private:
+    vector<uint8_t> data;
+    uint64_t bits {0};
+    int count {0};
+};
+
+// whether delta can be stored directly at a width without looking like a
+// width change
+template<typename Params>
+bool fitsWidth(int delta, int width)
+{
+    if (width >= Params::defaultWidth)
+        return true;
+    int topBit = 1 << (width - 1);
+    if (delta < -topBit || delta >= topBit)
+        return false;
+    int v = delta & ((1 << width) - 1);
+    if (width <= 6)
+        return v != topBit;
+    return v < topBit + Params::lowerB || v > topBit + Params::upperB;
+}
+
+// IT214 / IT215 compression, always switching to the smallest width so all
+// three width modes are used
+template<typename Params>
+vector<uint8_t> compress(const vector<int> &values, bool it215)
+{
+    using sample_t = typename Params::sample_t;
+    const size_t blockFrames = 0x8000 / sizeof(sample_t);
+
+    vector<uint8_t> out;
+    for (size_t start = 0; start < values.size(); start += blockFrames) {
+        size_t length = std::min(values.size() - start, blockFrames);
+        BitWriter bits;
+        int width = Params::defaultWidth;
+        sample_t mem1 = 0, mem2 = 0;
+        for (size_t i = start; i < start + length; i++) {
+            sample_t target = it215 ? (sample_t)(values[i] - mem2)
+                                    : (sample_t)values[i];
+            int delta = (sample_t)(target - mem1);
+
+            int newWidth = 1;
+            while (!fitsWidth<Params>(delta, newWidth))
+                newWidth++;
+            if (newWidth != width) {
+                int topBit = 1 << (width - 1);
+                int change = newWidth < width ? newWidth - 1 : newWidth - 2;
+                if (width <= 6) {
+                    bits.write(topBit, width);
+                    bits.write(change, Params::fetchA);
+                } else if (width < Params::defaultWidth) {
+                    bits.write(topBit + Params::lowerB + change, width);
+                } else {
+                    bits.write(topBit | (newWidth - 1), width);
+                }
+                width = newWidth;
+            }
+            if (width == Params::defaultWidth)
+                bits.write(delta, width - 1); // top bit clear
+            else
+                bits.write(delta, width);
+
+            mem1 += delta;
+            mem2 += mem1;
+        }
+        const vector<uint8_t> &block = bits.finish();
+        if (block.size() > UINT16_MAX)
+            throw std::runtime_error("Block too large");
+        out.push_back(block.size() & 0xff);
+        out.push_back(block.size() >> 8);
+        out.insert(out.end(), block.begin(), block.end());
+    }
+    return out;
+}
+
+// a sweeping sine with bursts of noise, so the widths vary
+template<typename Params>
+vector<int> generate(frames numFrames)
+{
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> noise(-0.01, 0.01);
+    vector<int> values(numFrames);
+    double phase = 0;
+    for (frames i = 0; i < numFrames; i++) {
+        phase += 0.01 + 0.002 * std::sin(i * 1e-4);
+        double v = std::sin(phase) * 0.3 * (1 + std::sin(i * 3e-5));
+        if (i % 50000 < 20000)
+            v += noise(rng);
+        values[i] = (int)std::lround(v * Params::maxVal);
+    }
+    return values;
+}
+
+template<typename Params>
+bool bench(const char *name, bool it215)
+{
+    vector<int> values = generate<Params>(BENCH_FRAMES);
+    vector<uint8_t> compressed = compress<Params>(values, it215);
+
+    vector<vector<float>> channels(1);
+    std::chrono::duration<double> best {0};
+    for (int r = 0; r < BENCH_REPEATS; r++) {
+        channels[0].clear();
+        ByteReader reader(compressed.data(), compressed.size());
+        auto startTime = std::chrono::steady_clock::now();
+        ITDecompress<Params>(reader, channels, BENCH_FRAMES, 1, it215)
+            .decompress();
+        std::chrono::duration<double> time =
+            std::chrono::steady_clock::now() - startTime;
+        if (r == 0 || time < best)
+            best = time;
+    }
+
+    for (frames i = 0; i < BENCH_FRAMES; i++) {
+        if (channels[0][i] != (float)values[i] / Params::maxVal) {
+            cout << name << (it215 ? " IT215" : " IT214")
+                 << ": wrong value at frame " << i << "\n";
+            return false;
+        }
+    }
+    double megabytes = (double)BENCH_FRAMES * sizeof(typename Params::sample_t)
+        / 1e6;
+    cout << name << (it215 ? " IT215: " : " IT214: ")
+         << (megabytes / best.count()) << " MB/s (compressed to "
+         << (100.0 * compressed.size() / (megabytes * 1e6)) << "%)\n";
+    return true;
+}
+
+int main(int, char **)
+{
+    bool ok = true;
+    for (bool it215 : {false, true}) {
+        ok &= bench<IT8BitParams>("8-bit", it215);
+        ok &= bench<IT16BitParams>("16-bit", it215);
+    }
+    return ok ? 0 : 1;
+}
@@ -18,7 +18,15 @@ public:
     virtual void undoIt(T target) = 0;
 };
 
-using SongOp = Operation<Song *>;
+class OpWriter;
+
+class SongOp : public Operation<Song *>
+{
+public:
+    // write the arguments for the journal (see opstream.h).
+    // called before doIt
+    virtual void write(OpWriter &out) const = 0;
+};
 
 // utils for operations:
 
@@ -38,6 +46,7 @@ public:
     {
         std::unique_lock lock(obj->mu);
         std::swap(value, objectValue());
+        obj->dirty = true;
         return value != objectValue();
     }
 
@@ -0,0 +1,288 @@
+#include "opstream.h"
+#include <file/wavecodec.h>
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+
+namespace chromatracker::edit {
+
+const uint16_t NO_INDEX = 0xFFFF;
+
+OpWriter::OpWriter(const Song *song, vector<uint8_t> &buffer)
+    : song(song)
+    , out(buffer)
+{}
+
+template<typename T>
+uint16_t OpWriter::index(const vector<shared_ptr<T>> &objects, const T *object)
+{
+    auto it = std::find_if(objects.begin(), objects.end(),
+        [&](const shared_ptr<T> &o) { return o.get() == object; });
+    return it == objects.end() ? NO_INDEX : it - objects.begin();
+}
+
+void OpWriter::type(OpType type)
+{
+    out.u8((uint8_t)type);
+}
+
+void OpWriter::f32(float v)
+{
+    out.leFloat(v);
+}
+
+void OpWriter::i32(int32_t v)
+{
+    out.le32(v);
+}
+
+void OpWriter::boolean(bool v)
+{
+    out.u8(v);
+}
+
+void OpWriter::sample(const shared_ptr<Sample> &sample)
+{
+    std::shared_lock songLock(song->mu);
+    out.le16(index(song->samples, sample.get()));
+}
+
+void OpWriter::track(const shared_ptr<Track> &track)
+{
+    std::shared_lock songLock(song->mu);
+    out.le16(index(song->tracks, track.get()));
+}
+
+void OpWriter::section(const shared_ptr<Section> &section)
+{
+    std::shared_lock songLock(song->mu);
+    out.le16(index(song->sections, section.get()));
+}
+
+void OpWriter::event(const Event &event)
+{
+    out.le32(event.time);
+    sample(event.sample.lockDeleted());
+    out.le32(event.offset);
+    out.le32(event.pitch);
+    out.leFloat(event.velocity);
+    out.u8((uint8_t)event.special);
+}
+
+void OpWriter::trackCursor(const TrackCursor &tcur)
+{
+    section(tcur.cursor.section.lockDeleted());
+    out.le32(tcur.cursor.time);
+    out.le32(tcur.track);
+}
+
+void OpWriter::newSample(const shared_ptr<Sample> &sample)
+{
+    std::shared_lock lock(sample->mu);
+    out.string16(sample->name);
+    f32(sample->color.r);
+    f32(sample->color.g);
+    f32(sample->color.b);
+    out.le32(sample->frameRate);
+    out.u8((uint8_t)sample->interpolationMode);
+    out.u8((uint8_t)sample->loopMode);
+    out.le32(sample->loopStart);
+    out.le32(sample->loopEnd);
+    f32(sample->volume);
+    f32(sample->tune);
+    out.u8((uint8_t)sample->newNoteAction);
+    f32(sample->fadeOut);
+    _waves.push_back(sample->wave);
+}
+
+void OpWriter::newTrack(const Track &track)
+{
+    std::shared_lock lock(track.mu);
+    boolean(track.mute);
+    f32(track.volume);
+    f32(track.pan);
+}
+
+void OpWriter::newSection(const Section &section)
+{
+    std::shared_lock lock(section.mu);
+    out.le32(section.length);
+    out.string16(section.title);
+    out.le32(section.tempo);
+    out.le32(section.meter);
+    this->section(section.next.lockDeleted());
+    out.le32(section.trackEvents.size());
+    for (auto &events : section.trackEvents) {
+        out.le32(events.size());
+        for (auto &e : events)
+            event(e);
+    }
+}
+
+void writeWave(const Wave &wave, vector<uint8_t> &buffer)
+{
+    file::ByteWriter out(buffer);
+
+    out.le32(wave.length());
+    out.le16(wave.numChannels());
+    size_t formatPos = out.tell();
+    out.u8(0);
+    buffer[formatPos] = (uint8_t)file::chroma::encodeWave(wave, buffer);
+}
+
+OpReader::OpReader(Song *song, file::ByteReader reader)
+    : song(song)
+    , in(reader)
+{}
+
+template<typename T>
+shared_ptr<T> OpReader::object(const vector<shared_ptr<T>> &objects,
+                               bool optional)
+{
+    uint16_t index = in.le16();
+    if (index == NO_INDEX && optional)
+        return nullptr;
+    std::shared_lock songLock(song->mu);
+    if (index >= objects.size())
+        throw std::runtime_error("Invalid object reference");
+    return objects[index];
+}
+
+template<typename T>
+int OpReader::insertIndex(const vector<shared_ptr<T>> &objects)
+{
+    int32_t index = i32();
+    std::shared_lock songLock(song->mu);
+    if (index < 0 || index > objects.size())
+        throw std::runtime_error("Invalid object index");
+    return index;
+}
+
+OpType OpReader::type()
+{
+    return (OpType)in.u8();
+}
+
+float OpReader::f32()
+{
+    return in.leFloat();
+}
+
+int32_t OpReader::i32()
+{
+    return (int32_t)in.le32();
+}
+
+bool OpReader::boolean()
+{
+    return in.u8();
+}
+
+shared_ptr<Sample> OpReader::sample()
+{
+    return object(song->samples);
+}
+
+shared_ptr<Track> OpReader::track()
+{
+    return object(song->tracks);
+}
+
+shared_ptr<Section> OpReader::section()
+{
+    return object(song->sections);
+}
+
+int OpReader::sampleIndex()
+{
+    return insertIndex(song->samples);
+}
+
+int OpReader::trackIndex()
+{
+    return insertIndex(song->tracks);
+}
+
+int OpReader::sectionIndex()
+{
+    return insertIndex(song->sections);
+}
+
+Event OpReader::event()
+{
+    Event event;
+    event.time = i32();
+    event.sample = object(song->samples, true);
+    event.offset = i32();
+    event.pitch = i32();
+    event.velocity = f32();
+    event.special = (Event::Special)in.u8();
+    return event;
+}
+
+TrackCursor OpReader::trackCursor()
+{
+    auto section = this->section();
+    ticks time = i32();
+    TrackCursor tcur {Cursor(song, section, time)};
+    tcur.track = i32();
+    std::shared_lock sectionLock(section->mu);
+    if (tcur.track < 0 || tcur.track >= section->trackEvents.size())
+        throw std::runtime_error("Invalid cursor");
+    return tcur;
+}
+
+shared_ptr<Sample> OpReader::newSample()
+{
+    shared_ptr<Sample> sample(new Sample);
+    sample->name = in.string16();
+    sample->color.r = f32();
+    sample->color.g = f32();
+    sample->color.b = f32();
+    sample->frameRate = i32();
+    sample->interpolationMode = (Sample::InterpolationMode)in.u8();
+    sample->loopMode = (Sample::LoopMode)in.u8();
+    sample->loopStart = i32();
+    sample->loopEnd = i32();
+    sample->volume = f32();
+    sample->tune = f32();
+    sample->newNoteAction = (Sample::NewNoteAction)in.u8();
+    sample->fadeOut = f32();
+
+    uint32_t numFrames = in.le32();
+    uint16_t numChannels = in.le16();
+    auto format = (file::chroma::WaveFormat)in.u8();
+    if (!file::chroma::decodeWave(in, format, numFrames, numChannels,
+                                  sample->wave.edit()))
+        throw std::runtime_error("Unrecognized wave format");
+    return sample;
+}
+
+shared_ptr<Track> OpReader::newTrack()
+{
+    shared_ptr<Track> track(new Track);
+    track->mute = boolean();
+    track->volume = f32();
+    track->pan = f32();
+    return track;
+}
+
+shared_ptr<Section> OpReader::newSection()
+{
+    shared_ptr<Section> section(new Section);
+    section->length = i32();
+    section->title = in.string16();
+    section->tempo = i32();
+    section->meter = i32();
+    section->next = object(song->sections, true);
+    uint32_t numTracks = in.le32();
+    for (uint32_t t = 0; t < numTracks; t++) {
+        auto &events = section->trackEvents.emplace_back();
+        uint32_t numEvents = in.le32();
+        for (uint32_t e = 0; e < numEvents; e++)
+            events.push_back(event());
+    }
+    return section;
+}
+
+} // namespace
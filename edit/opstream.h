@@ -0,0 +1,115 @@
+#pragma once
+#include <common.h>
+
+#include <cursor.h>
+#include <event.h>
+#include <song.h>
+#include <file/bytereader.h>
+#include <file/bytewriter.h>
+
+namespace chromatracker::edit {
+
+// identifies an operation in the journal. values are stored in files!
+enum class OpType : uint8_t
+{
+    SetSongVolume = 0,
+    AddTrack = 1,
+    DeleteTrack = 2,
+    SetTrackVolume = 3,
+    SetTrackPan = 4,
+    SetTrackMute = 5,
+    SetTrackSolo = 6,
+    ClearCell = 7,
+    WriteCell = 8,
+    MergeEvent = 9,
+    AddSection = 10,
+    DeleteSection = 11,
+    SetSectionTempo = 12,
+    SetSectionMeter = 13,
+    SliceSection = 14,
+    AddSample = 15,
+    DeleteSample = 16,
+    SetSampleVolume = 17,
+    SetSampleTune = 18,
+    SetSampleFadeOut = 19,
+};
+
+// serializes the arguments of an operation before it is performed.
+// existing objects are referenced by their index in the song, new objects are
+// stored completely
+class OpWriter
+{
+public:
+    OpWriter(const Song *song, vector<uint8_t> &buffer);
+
+    // waves are encoded later by the journal thread (they are immutable)
+    const vector<Wave> & waves() const { return _waves; }
+
+    void type(OpType type);
+    void f32(float v);
+    void i32(int32_t v);
+    void boolean(bool v);
+    void sample(const shared_ptr<Sample> &sample);
+    void track(const shared_ptr<Track> &track);
+    void section(const shared_ptr<Section> &section);
+    void event(const Event &event);
+    void trackCursor(const TrackCursor &tcur);
+
+    // wave is added to waves(), so this must be the last value of the op
+    void newSample(const shared_ptr<Sample> &sample);
+    void newTrack(const Track &track);
+    void newSection(const Section &section);
+
+private:
+    // NO_INDEX if not found
+    template<typename T>
+    uint16_t index(const vector<shared_ptr<T>> &objects, const T *object);
+
+    const Song *song;
+    file::ByteWriter out;
+    vector<Wave> _waves;
+};
+
+// encode a wave from OpWriter::waves(), after the operation data
+void writeWave(const Wave &wave, vector<uint8_t> &out);
+
+// reads operation arguments written by OpWriter, resolving references in the
+// song. throws std::runtime_error for invalid data
+class OpReader
+{
+public:
+    // waves start after the operation data
+    OpReader(Song *song, file::ByteReader reader);
+
+    OpType type();
+    float f32();
+    int32_t i32();
+    bool boolean();
+    // existing objects (never null)
+    shared_ptr<Sample> sample();
+    shared_ptr<Track> track();
+    shared_ptr<Section> section();
+    // positions to insert new objects
+    int sampleIndex();
+    int trackIndex();
+    int sectionIndex();
+    Event event();
+    TrackCursor trackCursor();
+
+    shared_ptr<Sample> newSample(); // also reads the wave
+    shared_ptr<Track> newTrack();
+    shared_ptr<Section> newSection();
+
+private:
+    // null for NO_INDEX if optional
+    template<typename T>
+    shared_ptr<T> object(const vector<shared_ptr<T>> &objects,
+                         bool optional = false);
+    template<typename T>
+    int insertIndex(const vector<shared_ptr<T>> &objects);
+
+    Song *song;
+    file::ByteReader in;
+};
+
+} // namespace
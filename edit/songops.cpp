@@ -1,5 +1,6 @@
 #include "songops.h"
 #include <algorithm>
+#include <stdexcept>
 
 namespace chromatracker::edit::ops {
 
@@ -14,6 +15,9 @@ For deleting an object:
 If the deleted flag is set too early, links could be broken if they are accessed
 elsewhere.
 
+Set the dirty flag of every object that is modified (in doIt and undoIt), so it
+is included in the next incremental save.
+
 For adding/undeleting an object:
 - Lock song
 - Clear deleted flag
@@ -21,6 +25,89 @@ For adding/undeleting an object:
 - Restore all links to the object
 */
 
+unique_ptr<SongOp> readOp(OpReader &in)
+{
+    // arguments must be read in order, not as function arguments
+    switch (in.type()) {
+    case OpType::SetSongVolume:
+        return std::make_unique<SetSongVolume>(in.f32());
+    case OpType::AddTrack: {
+        int index = in.trackIndex();
+        return std::make_unique<AddTrack>(index, in.newTrack());
+    }
+    case OpType::DeleteTrack:
+        return std::make_unique<DeleteTrack>(in.track());
+    case OpType::SetTrackVolume: {
+        auto track = in.track();
+        return std::make_unique<SetTrackVolume>(track, in.f32());
+    }
+    case OpType::SetTrackPan: {
+        auto track = in.track();
+        return std::make_unique<SetTrackPan>(track, in.f32());
+    }
+    case OpType::SetTrackMute: {
+        auto track = in.track();
+        return std::make_unique<SetTrackMute>(track, in.boolean());
+    }
+    case OpType::SetTrackSolo: {
+        auto track = in.track();
+        return std::make_unique<SetTrackSolo>(track, in.boolean());
+    }
+    case OpType::ClearCell: {
+        TrackCursor tcur = in.trackCursor();
+        return std::make_unique<ClearCell>(tcur, in.i32());
+    }
+    case OpType::WriteCell: {
+        TrackCursor tcur = in.trackCursor();
+        ticks size = in.i32();
+        return std::make_unique<WriteCell>(tcur, size, in.event());
+    }
+    case OpType::MergeEvent: {
+        TrackCursor tcur = in.trackCursor();
+        Event event = in.event();
+        return std::make_unique<MergeEvent>(tcur, event,
+                                            (Event::Mask)in.i32());
+    }
+    case OpType::AddSection: {
+        int index = in.sectionIndex();
+        return std::make_unique<AddSection>(index, in.newSection());
+    }
+    case OpType::DeleteSection:
+        return std::make_unique<DeleteSection>(in.section());
+    case OpType::SetSectionTempo: {
+        auto section = in.section();
+        return std::make_unique<SetSectionTempo>(section, in.i32());
+    }
+    case OpType::SetSectionMeter: {
+        auto section = in.section();
+        return std::make_unique<SetSectionMeter>(section, in.i32());
+    }
+    case OpType::SliceSection: {
+        auto section = in.section();
+        return std::make_unique<SliceSection>(section, in.i32());
+    }
+    case OpType::AddSample: {
+        int index = in.sampleIndex();
+        return std::make_unique<AddSample>(index, in.newSample());
+    }
+    case OpType::DeleteSample:
+        return std::make_unique<DeleteSample>(in.sample());
+    case OpType::SetSampleVolume: {
+        auto sample = in.sample();
+        return std::make_unique<SetSampleVolume>(sample, in.f32());
+    }
+    case OpType::SetSampleTune: {
+        auto sample = in.sample();
+        return std::make_unique<SetSampleTune>(sample, in.f32());
+    }
+    case OpType::SetSampleFadeOut: {
+        auto sample = in.sample();
+        return std::make_unique<SetSampleFadeOut>(sample, in.f32());
+    }
+    }
+    throw std::runtime_error("Unknown operation");
+}
+
 SetSongVolume::SetSongVolume(float volume)
     : volume(volume)
 {}
@@ -37,6 +124,12 @@ void SetSongVolume::undoIt(Song *song)
     doIt(song);
 }
 
+void SetSongVolume::write(OpWriter &out) const
+{
+    out.type(OpType::SetSongVolume);
+    out.f32(volume);
+}
+
 AddTrack::AddTrack(int index, shared_ptr<Track> track)
     : index(index)
     , track(track)
@@ -52,6 +145,7 @@ bool AddTrack::doIt(Song *song)
         std::unique_lock sectionLock(section->mu);
         section->trackEvents.insert(section->trackEvents.begin() + index,
                                     vector<Event>());
+        section->dirty = true;
     }
 
     return true;
@@ -64,12 +158,20 @@ void AddTrack::undoIt(Song *song)
     for (auto &section : song->sections) {
         std::unique_lock sectionLock(section->mu);
         section->trackEvents.erase(section->trackEvents.begin() + index);
+        section->dirty = true;
     }
 
     song->tracks.erase(song->tracks.begin() + index);
     track->deleted = true;
 }
 
+void AddTrack::write(OpWriter &out) const
+{
+    out.type(OpType::AddTrack);
+    out.i32(index);
+    out.newTrack(*track);
+}
+
 DeleteTrack::DeleteTrack(shared_ptr<Track> track)
     : track(track)
 {}
@@ -90,6 +192,7 @@ bool DeleteTrack::doIt(Song *song)
         std::unique_lock sectionLock(section->mu);
         clearedEvents.push_back(section->trackEvents[index]);
         section->trackEvents.erase(section->trackEvents.begin() + index);
+        section->dirty = true;
     }
 
     song->tracks.erase(song->tracks.begin() + index);
@@ -110,28 +213,56 @@ void DeleteTrack::undoIt(Song *song)
         std::unique_lock sectionLock(section->mu);
         section->trackEvents.insert(section->trackEvents.begin() + index,
                                     clearedEvents[i]);
+        section->dirty = true;
     }
     clearedEvents.clear();
 }
 
+void DeleteTrack::write(OpWriter &out) const
+{
+    out.type(OpType::DeleteTrack);
+    out.track(track);
+}
+
 SetTrackVolume::SetTrackVolume(shared_ptr<Track> track, float volume)
     : SetObjectValue(track, volume)
 {}
 
 float & SetTrackVolume::objectValue() { return obj->volume; }
 
+void SetTrackVolume::write(OpWriter &out) const
+{
+    out.type(OpType::SetTrackVolume);
+    out.track(obj);
+    out.f32(value);
+}
+
 SetTrackPan::SetTrackPan(shared_ptr<Track> track, float pan)
     : SetObjectValue(track, pan)
 {}
 
 float & SetTrackPan::objectValue() { return obj->pan; }
 
+void SetTrackPan::write(OpWriter &out) const
+{
+    out.type(OpType::SetTrackPan);
+    out.track(obj);
+    out.f32(value);
+}
+
 SetTrackMute::SetTrackMute(shared_ptr<Track> track, bool mute)
     : SetObjectValue(track, mute)
 {}
 
 bool & SetTrackMute::objectValue() { return obj->mute; }
 
+void SetTrackMute::write(OpWriter &out) const
+{
+    out.type(OpType::SetTrackMute);
+    out.track(obj);
+    out.boolean(value);
+}
+
 SetTrackSolo::SetTrackSolo(shared_ptr<Track> track, bool solo)
     : track(track)
     , solo(solo)
@@ -145,6 +276,7 @@ bool SetTrackSolo::doIt(Song *song)
         std::unique_lock trackLock(t->mu);
         trackMute.push_back(t->mute);
         t->mute = (solo && t != track);
+        t->dirty = true;
     }
     return true;
 }
@@ -156,10 +288,18 @@ void SetTrackSolo::undoIt(Song *song)
         auto &t = song->tracks[i];
         std::unique_lock trackLock(t->mu);
         t->mute = trackMute[i];
+        t->dirty = true;
     }
     trackMute.clear();
 }
 
+void SetTrackSolo::write(OpWriter &out) const
+{
+    out.type(OpType::SetTrackSolo);
+    out.track(track);
+    out.boolean(solo);
+}
+
 ClearCell::ClearCell(TrackCursor tcur, ticks size)
     : tcur(tcur)
     , size(size)
@@ -175,6 +315,7 @@ bool ClearCell::doIt(Song *song)
     auto endIt = endCur.findEvent();
     clearedEvents = vector<Event>(startIt, endIt);
     tcur.events().erase(startIt, endIt);
+    section->dirty = true;
     return !clearedEvents.empty();
 }
 
@@ -184,6 +325,14 @@ void ClearCell::undoIt(Song *song)
     auto insertIt = tcur.findEvent();
     tcur.events().insert(insertIt, clearedEvents.begin(), clearedEvents.end());
     clearedEvents.clear();
+    section->dirty = true;
+}
+
+void ClearCell::write(OpWriter &out) const
+{
+    out.type(OpType::ClearCell);
+    out.trackCursor(tcur);
+    out.i32(size);
 }
 
 WriteCell::WriteCell(TrackCursor tcur, ticks size, Event event)
@@ -212,6 +361,14 @@ void WriteCell::undoIt(Song *song)
     ClearCell::undoIt(song);
 }
 
+void WriteCell::write(OpWriter &out) const
+{
+    out.type(OpType::WriteCell);
+    out.trackCursor(tcur);
+    out.i32(size);
+    out.event(event);
+}
+
 MergeEvent::MergeEvent(TrackCursor tcur, Event event, Event::Mask mask)
     : tcur(tcur)
     , mask(mask)
@@ -236,6 +393,7 @@ bool MergeEvent::doIt(Song *song)
             tcur.events().erase(it);
         }
     }
+    section->dirty = true;
     return true;
 }
 
@@ -252,6 +410,15 @@ void MergeEvent::undoIt(Song *song)
         tcur.events().erase(it);
     }
     prevEvent = Event();
+    section->dirty = true;
+}
+
+void MergeEvent::write(OpWriter &out) const
+{
+    out.type(OpType::MergeEvent);
+    out.trackCursor(tcur);
+    out.event(event);
+    out.i32(mask);
 }
 
 AddSection::AddSection(int index, shared_ptr<Section> section)
@@ -271,8 +438,10 @@ bool AddSection::doIt(Song *song)
     }
     if (index != 0) {
         if (song->sections[index - 1]->next.lockDeleted() ==
-                section->next.lockDeleted())
+                section->next.lockDeleted()) {
             song->sections[index - 1]->next = section;
+            song->sections[index - 1]->dirty = true;
+        }
     }
 
     return true;
@@ -285,6 +454,7 @@ void AddSection::undoIt(Song *song)
     if (index != 0) {
         if (song->sections[index - 1]->next.lockDeleted() == section) {
             song->sections[index - 1]->next = section->next;
+            song->sections[index - 1]->dirty = true;
         }
     }
 
@@ -292,6 +462,13 @@ void AddSection::undoIt(Song *song)
     section->deleted = true;
 }
 
+void AddSection::write(OpWriter &out) const
+{
+    out.type(OpType::AddSection);
+    out.i32(index);
+    out.newSection(*section);
+}
+
 DeleteSection::DeleteSection(shared_ptr<Section> section)
     : section(section)
 {}
@@ -311,6 +488,7 @@ bool DeleteSection::doIt(Song *song)
         if (other->next.lockDeleted() == section) {
             prevLinks.push_back(other);
             other->next = section->next;
+            other->dirty = true;
         }
     }
 
@@ -332,22 +510,43 @@ void DeleteSection::undoIt(Song *song)
     for (auto &link : prevLinks) {
         std::unique_lock linkLock(link->mu);
         link->next = section;
+        link->dirty = true;
     }
     prevLinks.clear();
 }
 
+void DeleteSection::write(OpWriter &out) const
+{
+    out.type(OpType::DeleteSection);
+    out.section(section);
+}
+
 SetSectionTempo::SetSectionTempo(shared_ptr<Section> section, int tempo)
     : SetObjectValue(section, tempo)
 {}
 
 int & SetSectionTempo::objectValue() { return obj->tempo; }
 
+void SetSectionTempo::write(OpWriter &out) const
+{
+    out.type(OpType::SetSectionTempo);
+    out.section(obj);
+    out.i32(value);
+}
+
 SetSectionMeter::SetSectionMeter(shared_ptr<Section> section, int meter)
     : SetObjectValue(section, meter)
 {}
 
 int & SetSectionMeter::objectValue() { return obj->meter; }
 
+void SetSectionMeter::write(OpWriter &out) const
+{
+    out.type(OpType::SetSectionMeter);
+    out.section(obj);
+    out.i32(value);
+}
+
 SliceSection::SliceSection(shared_ptr<Section> section, ticks pos)
     : section(section)
     , pos(pos)
@@ -362,6 +561,7 @@ bool SliceSection::doIt(Song *song)
     section->length = pos;
     secondHalf->next = section->next;
     section->next = secondHalf;
+    section->dirty = true;
 
     int numTracks = section->trackEvents.size();
     secondHalf->trackEvents.reserve(numTracks);
@@ -392,6 +592,7 @@ void SliceSection::undoIt(Song *song)
     std::unique_lock secondLock(secondHalf->mu);
     section->length += secondHalf->length;
     section->next = secondHalf->next;
+    section->dirty = true;
 
     for (int t = 0; t < section->trackEvents.size(); t++) {
         auto &srcEvents = secondHalf->trackEvents[t];
@@ -411,6 +612,13 @@ void SliceSection::undoIt(Song *song)
     secondHalf->deleted = true;
 }
 
+void SliceSection::write(OpWriter &out) const
+{
+    out.type(OpType::SliceSection);
+    out.section(section);
+    out.i32(pos);
+}
+
 AddSample::AddSample(int index, shared_ptr<Sample> sample)
     : index(index)
     , sample(sample)
@@ -431,6 +639,13 @@ void AddSample::undoIt(Song *song)
     sample->deleted = true;
 }
 
+void AddSample::write(OpWriter &out) const
+{
+    out.type(OpType::AddSample);
+    out.i32(index);
+    out.newSample(sample);
+}
+
 DeleteSample::DeleteSample(shared_ptr<Sample> sample)
     : sample(sample)
 {}
@@ -448,6 +663,7 @@ bool DeleteSample::doIt(Song *song)
                 if (events[e].sample.lockDeleted() == sample) {
                     sampleEvents.push_back({section, t, e});
                     events[e].sample.reset();
+                    section->dirty = true;
                 }
             }
         }
@@ -470,25 +686,53 @@ void DeleteSample::undoIt(Song *song)
         std::unique_lock sectionLock(eventRef.section->mu);
         eventRef.section->trackEvents[eventRef.track][eventRef.index].sample
             = sample;
+        eventRef.section->dirty = true;
     }
 }
 
+void DeleteSample::write(OpWriter &out) const
+{
+    out.type(OpType::DeleteSample);
+    out.sample(sample);
+}
+
 SetSampleVolume::SetSampleVolume(shared_ptr<Sample> sample, float volume)
     : SetObjectValue(sample, volume)
 {}
 
 float & SetSampleVolume::objectValue() { return obj->volume; }
 
+void SetSampleVolume::write(OpWriter &out) const
+{
+    out.type(OpType::SetSampleVolume);
+    out.sample(obj);
+    out.f32(value);
+}
+
 SetSampleTune::SetSampleTune(shared_ptr<Sample> sample, float tune)
     : SetObjectValue(sample, tune)
 {}
 
 float & SetSampleTune::objectValue() { return obj->tune; }
 
+void SetSampleTune::write(OpWriter &out) const
+{
+    out.type(OpType::SetSampleTune);
+    out.sample(obj);
+    out.f32(value);
+}
+
 SetSampleFadeOut::SetSampleFadeOut(shared_ptr<Sample> sample, float fadeOut)
     : SetObjectValue(sample, fadeOut)
 {}
 
 float & SetSampleFadeOut::objectValue() { return obj->fadeOut; }
 
+void SetSampleFadeOut::write(OpWriter &out) const
+{
+    out.type(OpType::SetSampleFadeOut);
+    out.sample(obj);
+    out.f32(value);
+}
+
 } // namespace
@@ -2,18 +2,24 @@
 #include <common.h>
 
 #include "operation.h"
+#include "opstream.h"
 #include <cursor.h>
 #include <event.h>
 #include <units.h>
 
 namespace chromatracker::edit::ops {
 
+// construct an operation from the journal, before performing it.
+// throws std::runtime_error for invalid data
+unique_ptr<SongOp> readOp(OpReader &in);
+
 class SetSongVolume : public SongOp
 {
 public:
     SetSongVolume(float volume);
     bool doIt(Song *song) override;
     void undoIt(Song *song) override;
+    void write(OpWriter &out) const override;
 protected:
     float volume;
 };
@@ -24,6 +30,7 @@ public:
     AddTrack(int index, shared_ptr<Track> track);
     bool doIt(Song *song) override;
     void undoIt(Song *song) override;
+    void write(OpWriter &out) const override;
 protected:
     int index;
     shared_ptr<Track> track;
@@ -35,6 +42,7 @@ public:
     DeleteTrack(shared_ptr<Track> track);
     bool doIt(Song *song) override;
     void undoIt(Song *song) override;
+    void write(OpWriter &out) const override;
 protected:
     shared_ptr<Track> track;
 private:
@@ -46,6 +54,7 @@ class SetTrackVolume : public SetObjectValue<Track, float>
 {
 public:
     SetTrackVolume(shared_ptr<Track> track, float volume);
+    void write(OpWriter &out) const override;
 private:
     float & objectValue() override;
 };
@@ -54,6 +63,7 @@ class SetTrackPan : public SetObjectValue<Track, float>
 {
 public:
     SetTrackPan(shared_ptr<Track> track, float pan);
+    void write(OpWriter &out) const override;
 private:
     float & objectValue() override;
 };
@@ -62,6 +72,7 @@ class SetTrackMute : public SetObjectValue<Track, bool>
 {
 public:
     SetTrackMute(shared_ptr<Track> track, bool mute);
+    void write(OpWriter &out) const override;
 private:
     bool & objectValue() override;
 };
@@ -72,6 +83,7 @@ public:
     SetTrackSolo(shared_ptr<Track> track, bool solo);
     bool doIt(Song *song) override;
     void undoIt(Song *song) override;
+    void write(OpWriter &out) const override;
 protected:
     shared_ptr<Track> track;
     bool solo;
@@ -84,6 +96,7 @@ public:
     ClearCell(TrackCursor tcur, ticks size);
     bool doIt(Song *song) override;
     void undoIt(Song *song) override;
+    void write(OpWriter &out) const override;
 protected:
     TrackCursor tcur;
     ticks size;
@@ -98,6 +111,7 @@ public:
     WriteCell(TrackCursor tcur, ticks size, Event event);
     bool doIt(Song *song) override;
     void undoIt(Song *song) override;
+    void write(OpWriter &out) const override;
 protected:
     Event event;
 };
@@ -108,6 +122,7 @@ public:
     MergeEvent(TrackCursor tcur, Event event, Event::Mask mask);
     bool doIt(Song *song) override;
     void undoIt(Song *song) override;
+    void write(OpWriter &out) const override;
 protected:
     TrackCursor tcur;
     Event event;
@@ -123,6 +138,7 @@ public:
     AddSection(int index, shared_ptr<Section> section);
     bool doIt(Song *song) override;
     void undoIt(Song *song) override;
+    void write(OpWriter &out) const override;
 protected:
     int index;
     shared_ptr<Section> section;
@@ -134,6 +150,7 @@ public:
     DeleteSection(shared_ptr<Section> section);
     bool doIt(Song *song) override;
     void undoIt(Song *song) override;
+    void write(OpWriter &out) const override;
 protected:
     shared_ptr<Section> section;
 private:
@@ -145,6 +162,7 @@ class SetSectionTempo : public SetObjectValue<Section, int>
 {
 public:
     SetSectionTempo(shared_ptr<Section> section, int tempo);
+    void write(OpWriter &out) const override;
 private:
     int & objectValue() override;
 };
@@ -153,6 +171,7 @@ class SetSectionMeter : public SetObjectValue<Section, int>
 {
 public:
     SetSectionMeter(shared_ptr<Section> section, int meter);
+    void write(OpWriter &out) const override;
 private:
     int & objectValue() override;
 };
@@ -163,6 +182,7 @@ public:
     SliceSection(shared_ptr<Section> section, ticks pos);
     bool doIt(Song *song) override;
     void undoIt(Song *song) override;
+    void write(OpWriter &out) const override;
 protected:
     shared_ptr<Section> section;
     ticks pos;
@@ -174,6 +194,7 @@ public:
     AddSample(int index, shared_ptr<Sample> sample);
     bool doIt(Song *song) override;
     void undoIt(Song *song) override;
+    void write(OpWriter &out) const override;
 protected:
     int index;
     shared_ptr<Sample> sample;
@@ -185,6 +206,7 @@ public:
     DeleteSample(shared_ptr<Sample> sample);
     bool doIt(Song *song) override;
     void undoIt(Song *song) override;
+    void write(OpWriter &out) const override;
 protected:
     shared_ptr<Sample> sample;
 private:
@@ -196,6 +218,7 @@ class SetSampleVolume : public SetObjectValue<Sample, float>
 {
 public:
     SetSampleVolume(shared_ptr<Sample> sample, float volume);
+    void write(OpWriter &out) const override;
 private:
     float & objectValue() override;
 };
@@ -204,6 +227,7 @@ class SetSampleTune : public SetObjectValue<Sample, float>
 {
 public:
     SetSampleTune(shared_ptr<Sample> sample, float tune);
+    void write(OpWriter &out) const override;
 private:
     float & objectValue() override;
 };
@@ -212,6 +236,7 @@ class SetSampleFadeOut : public SetObjectValue<Sample, float>
 {
 public:
     SetSampleFadeOut(shared_ptr<Sample> sample, float fadeOut);
+    void write(OpWriter &out) const override;
 private:
     float & objectValue() override;
 };
@@ -2,9 +2,24 @@
 #include <common.h>
 
 #include "edit/operation.h"
+#include <typeinfo>
 
 namespace chromatracker::edit {
 
+// notified of every change made through an Undoer, before it happens.
+// performing the same calls on another Undoer reproduces the changes
+template <typename TargetT>
+class UndoObserver
+{
+public:
+    virtual ~UndoObserver() = default;
+    virtual void doOp(TargetT target, const Operation<TargetT> &op,
+                      bool continuous) = 0;
+    virtual void endContinuous() = 0;
+    virtual void undo() = 0;
+    virtual void redo() = 0;
+};
+
 template <typename TargetT>
 class Undoer
 {
@@ -14,6 +29,18 @@ private:
     vector<unique_ptr<Operation<TargetT>>> redoStack;
     // should either be back of undo stack or null
     Operation<TargetT> *continuousOp {nullptr};
+    UndoObserver<TargetT> *observer {nullptr};
+
+    bool pushOp(unique_ptr<Operation<TargetT>> op)
+    {
+        continuousOp = nullptr;
+        if (op->doIt(target)) {
+            undoStack.push_back(std::move(op));
+            redoStack.clear();
+            return true;
+        }
+        return false;
+    }
 
 public:
     void reset(TargetT target)
@@ -24,46 +51,74 @@ public:
         continuousOp = nullptr;
     }
 
+    // null to remove
+    void setObserver(UndoObserver<TargetT> *observer)
+    {
+        this->observer = observer;
+    }
+
+    size_t undoSize() const { return undoStack.size(); }
+    size_t redoSize() const { return redoStack.size(); }
+    // a continuous op may be replaced by the next one
+    bool continuing() const { return continuousOp != nullptr; }
+
     // op is by value not by reference for move semantics since operations are
     // typically constructed in place
     // (I think??? is there a better way to do this? TODO)
     template<typename OpT>
     bool doOp(OpT op)
     {
-        continuousOp = nullptr;
         // remember that there will be less to copy/move before doIt is called
         // than after
-        auto uniqueOp = std::make_unique<OpT>(std::move(op));
-        if (uniqueOp->doIt(target)) {
-            undoStack.push_back(std::move(uniqueOp));
-            redoStack.clear();
-            return true;
-        }
-        return false;
+        return doOp(unique_ptr<Operation<TargetT>>(
+            std::make_unique<OpT>(std::move(op))));
     }
 
     template<typename OpT>
     void doOp(OpT op, bool continuous)
+    {
+        doOp(unique_ptr<Operation<TargetT>>(
+            std::make_unique<OpT>(std::move(op))), continuous);
+    }
+
+    bool doOp(unique_ptr<Operation<TargetT>> op)
+    {
+        if (observer)
+            observer->doOp(target, *op, false);
+        return pushOp(std::move(op));
+    }
+
+    // a continuous op replaces the previous op if it has the same type
+    void doOp(unique_ptr<Operation<TargetT>> op, bool continuous)
     {
         if (!continuous) {
             doOp(std::move(op));
-        } else if (auto prevOp = dynamic_cast<OpT*>(continuousOp)) {
-            prevOp->undoIt(target);
-            *prevOp = op;
-            prevOp->doIt(target);
+            return;
+        }
+        if (observer)
+            observer->doOp(target, *op, true);
+        if (continuousOp && typeid(*continuousOp) == typeid(*op)) {
+            continuousOp->undoIt(target);
+            op->doIt(target);
+            continuousOp = op.get();
+            undoStack.back() = std::move(op);
         } else {
-            if (doOp(std::move(op)))
+            if (pushOp(std::move(op)))
                 continuousOp = undoStack.back().get();
         }
     }
 
     void endContinuous()
     {
+        if (observer)
+            observer->endContinuous();
         continuousOp = nullptr;
     }
 
     void undo()
     {
+        if (observer)
+            observer->undo();
         if (!undoStack.empty()) {
             undoStack.back()->undoIt(target);
             redoStack.push_back(std::move(undoStack.back()));
@@ -76,6 +131,8 @@ public:
 
     void redo()
     {
+        if (observer)
+            observer->redo();
         if (!redoStack.empty()) {
             redoStack.back()->doIt(target);
             undoStack.push_back(std::move(redoStack.back()));
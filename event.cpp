@@ -20,8 +20,10 @@ Event Event::masked(Mask mask) const
 
 void Event::merge(const Event &other)
 {
-    if (auto sampleP = other.sample.lock())
+    if (auto sampleP = other.sample.lock()) {
         sample = sampleP;
+        offset = other.offset;
+    }
     if (other.pitch != NO_PITCH)
         pitch = other.pitch;
     if (other.velocity != NO_VELOCITY)
@@ -32,8 +34,10 @@ void Event::merge(const Event &other)
 
 void Event::merge(const Event &other, Mask mask)
 {
-    if (mask & SAMPLE)
+    if (mask & SAMPLE) {
         sample = other.sample;
+        offset = other.offset;
+    }
     if (mask & PITCH)
         pitch = other.pitch;
     if (mask & VELOCITY)
@@ -33,6 +33,7 @@ struct Event
     int pitch {NO_PITCH};
     float velocity {NO_VELOCITY};
     Special special {Special::None};
+    frames offset {0}; // where the sample starts playing, part of SAMPLE
 
     bool empty() const;
     Event masked(Mask mask) const;
@@ -0,0 +1,73 @@
+#include "asyncloader.h"
+#include <exception>
+
+namespace chromatracker::file {
+
+AsyncLoader::AsyncLoader(ModuleLoader *loader)
+    : loader(loader)
+    , song(new Song)
+{
+    thread = std::thread(&AsyncLoader::run, this);
+}
+
+AsyncLoader::~AsyncLoader()
+{
+    _progress.cancelled = true;
+    thread.join();
+}
+
+float AsyncLoader::progress() const
+{
+    return _progress.fraction;
+}
+
+unique_ptr<Song> AsyncLoader::takeSong()
+{
+    if (!structureLoaded)
+        return nullptr;
+    std::unique_lock lock(mu);
+    if (song)
+        _taken = true;
+    return std::move(song);
+}
+
+bool AsyncLoader::taken() const
+{
+    return _taken;
+}
+
+bool AsyncLoader::finished() const
+{
+    return _finished;
+}
+
+string AsyncLoader::error() const
+{
+    std::unique_lock lock(mu);
+    return _error;
+}
+
+void AsyncLoader::run()
+{
+    try {
+        vector<shared_ptr<Sample>> samples;
+        {
+            // nobody else can access the song until structureLoaded is set
+            Song *loadSong = song.get();
+            loader->loadStructure(loadSong, &_progress);
+            // song may be taken (and modified) while waves load
+            samples = loadSong->samples;
+        }
+        structureLoaded = true;
+        loader->loadWaves(samples, &_progress);
+    } catch (LoadCancelled &) {
+        std::unique_lock lock(mu);
+        _error = "Cancelled";
+    } catch (std::exception &e) {
+        std::unique_lock lock(mu);
+        _error = e.what();
+    }
+    _finished = true;
+}
+
+} // namespace
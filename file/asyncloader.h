@@ -0,0 +1,45 @@
+#pragma once
+#include <common.h>
+
+#include "types.h"
+#include <song.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+namespace chromatracker::file {
+
+// loads a module into a separate Song on a background thread. the song is
+// available as soon as its structure is loaded, waves continue loading into
+// its samples afterwards
+class AsyncLoader : noncopyable
+{
+public:
+    AsyncLoader(ModuleLoader *loader); // takes ownership, starts loading
+    ~AsyncLoader(); // cancels and waits for the thread
+
+    float progress() const;
+    // return null if the structure isn't loaded yet, or already taken
+    unique_ptr<Song> takeSong();
+    // once taken, cancelling would leave the song without some waves
+    bool taken() const;
+    bool finished() const; // including waves, or failed / cancelled
+    string error() const; // empty if no error (check after finished)
+
+private:
+    void run();
+
+    unique_ptr<ModuleLoader> loader;
+    LoadProgress _progress;
+
+    mutable std::mutex mu; // protects song and _error
+    unique_ptr<Song> song;
+    string _error;
+    std::atomic<bool> structureLoaded {false};
+    bool _taken {false}; // UI thread
+    std::atomic<bool> _finished {false};
+
+    std::thread thread;
+};
+
+} // namespace
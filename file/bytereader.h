@@ -0,0 +1,134 @@
+#pragma once
+#include <common.h>
+
+#include <cstring>
+#include <stdexcept>
+
+namespace chromatracker::file {
+
+// bounds-checked little-endian reader over a block of memory
+// throws std::runtime_error when reading past the end
+class ByteReader
+{
+public:
+    ByteReader() = default;
+    ByteReader(const uint8_t *data, size_t size);
+
+    size_t size() const;
+    size_t tell() const;
+    void seek(size_t pos);
+    void skip(size_t count);
+
+    // pointer to the next count bytes, then skip them
+    const uint8_t * bytes(size_t count);
+
+    uint8_t u8();
+    uint16_t le16();
+    uint32_t le32();
+    uint64_t le64();
+    float leFloat();
+    uint32_t varint(); // LEB128, up to 5 bytes
+    string string16(); // 16-bit length followed by chars
+
+private:
+    void check(size_t count) const;
+
+    const uint8_t *data {nullptr};
+    size_t _size {0};
+    size_t pos {0};
+};
+
+inline ByteReader::ByteReader(const uint8_t *data, size_t size)
+    : data(data)
+    , _size(size)
+{}
+
+inline size_t ByteReader::size() const
+{
+    return _size;
+}
+
+inline size_t ByteReader::tell() const
+{
+    return pos;
+}
+
+inline void ByteReader::check(size_t count) const
+{
+    if (count > _size - pos)
+        throw std::runtime_error("Unexpected end of file");
+}
+
+inline void ByteReader::seek(size_t newPos)
+{
+    if (newPos > _size)
+        throw std::runtime_error("Invalid offset");
+    pos = newPos;
+}
+
+inline void ByteReader::skip(size_t count)
+{
+    check(count);
+    pos += count;
+}
+
+inline const uint8_t * ByteReader::bytes(size_t count)
+{
+    check(count);
+    const uint8_t *p = data + pos;
+    pos += count;
+    return p;
+}
+
+inline uint8_t ByteReader::u8()
+{
+    check(1);
+    return data[pos++];
+}
+
+inline uint16_t ByteReader::le16()
+{
+    const uint8_t *p = bytes(2);
+    return p[0] | (p[1] << 8);
+}
+
+inline uint32_t ByteReader::le32()
+{
+    const uint8_t *p = bytes(4);
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+inline uint64_t ByteReader::le64()
+{
+    uint64_t lo = le32();
+    return lo | ((uint64_t)le32() << 32);
+}
+
+inline float ByteReader::leFloat()
+{
+    uint32_t i = le32();
+    float f;
+    std::memcpy(&f, &i, sizeof(f));
+    return f;
+}
+
+inline uint32_t ByteReader::varint()
+{
+    uint32_t v = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        uint8_t b = u8();
+        v |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return v;
+    }
+    throw std::runtime_error("Invalid varint");
+}
+
+inline string ByteReader::string16()
+{
+    uint16_t size = le16();
+    const uint8_t *p = bytes(size);
+    return string((const char *)p, size);
+}
+
+} // namespace
@@ -0,0 +1,91 @@
+#pragma once
+#include <common.h>
+
+#include <cstring>
+
+namespace chromatracker::file {
+
+// little-endian writer appending to a memory buffer
+class ByteWriter
+{
+public:
+    ByteWriter(vector<uint8_t> &out);
+
+    size_t tell() const;
+
+    void bytes(const void *data, size_t count);
+    void u8(uint8_t v);
+    void le16(uint16_t v);
+    void le32(uint32_t v);
+    void le64(uint64_t v);
+    void leFloat(float f);
+    void varint(uint32_t v); // LEB128, 7 bits per byte
+    void string16(string s); // 16-bit length followed by chars, truncated
+
+private:
+    vector<uint8_t> &out;
+};
+
+inline ByteWriter::ByteWriter(vector<uint8_t> &out)
+    : out(out)
+{}
+
+inline size_t ByteWriter::tell() const
+{
+    return out.size();
+}
+
+inline void ByteWriter::bytes(const void *data, size_t count)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    out.insert(out.end(), p, p + count);
+}
+
+inline void ByteWriter::u8(uint8_t v)
+{
+    out.push_back(v);
+}
+
+inline void ByteWriter::le16(uint16_t v)
+{
+    out.push_back((uint8_t)v);
+    out.push_back((uint8_t)(v >> 8));
+}
+
+inline void ByteWriter::le32(uint32_t v)
+{
+    for (int b = 0; b < 4; b++)
+        out.push_back((uint8_t)(v >> (b * 8)));
+}
+
+inline void ByteWriter::le64(uint64_t v)
+{
+    le32((uint32_t)v);
+    le32((uint32_t)(v >> 32));
+}
+
+inline void ByteWriter::leFloat(float f)
+{
+    uint32_t i;
+    std::memcpy(&i, &f, sizeof(i));
+    le32(i);
+}
+
+inline void ByteWriter::varint(uint32_t v)
+{
+    while (v >= 0x80) {
+        out.push_back((uint8_t)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((uint8_t)v);
+}
+
+inline void ByteWriter::string16(string s)
+{
+    if (s.size() > 65535)
+        s = s.substr(0, 65535);
+    le16(s.size());
+    bytes(s.data(), s.size());
+}
+
+} // namespace
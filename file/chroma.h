@@ -15,9 +15,14 @@ enum class ObjectType
     Events = 5,
 };
 
+// see wavecodec.h
 enum class WaveFormat
 {
     Float = 0,
+    Int8 = 1,
+    Int16 = 2,
+    Rice8 = 3,
+    Rice16 = 4,
 };
 
 // sample flags
@@ -28,4 +33,31 @@ const uint8_t NEW_NOTE_ACTION_FLAG = 4;
 // track flags
 const uint8_t MUTE_FLAG = 0;
 
+// events (version 3+), for each track:
+// varint number of events, then if there are any:
+//   varint palette size (max 255), palette of velocities (floats)
+//   then columns, each with a value for every event that has the field:
+//   u8 field mask, varint time delta from the previous event (zigzag),
+//   varint sample index, varint pitch delta from the previous pitch (zigzag),
+//   u8 palette index, float velocity (not in palette), u8 special,
+//   varint sample start offset (version 4+)
+const uint8_t EVENT_SAMPLE = 1<<0;
+const uint8_t EVENT_PITCH = 1<<1;
+const uint8_t EVENT_VELOCITY = 1<<2; // palette index
+const uint8_t EVENT_VELOCITY_RAW = 1<<3;
+const uint8_t EVENT_SPECIAL = 1<<4;
+const uint8_t EVENT_OFFSET = 1<<5;
+const size_t MAX_VELOCITY_PALETTE = 255;
+
+// signed to unsigned, small magnitudes stay small
+inline uint32_t zigzag(int32_t v)
+{
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+inline int32_t unzigzag(uint32_t u)
+{
+    return (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+}
+
 } // namespace
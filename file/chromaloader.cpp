@@ -1,77 +1,81 @@
 #include "chromaloader.h"
+#include "wavecodec.h"
+#include <parallel.h>
 #include <version.h>
+#include <cstdint>
 #include <cstring>
+#include <mutex>
 #include <stdexcept>
+#include <unordered_set>
+#include <SDL2/SDL_endian.h>
 
 namespace chromatracker::file::chroma {
 
+const size_t EVENT_SIZE = 12;
+const int DEFAULT_TEMPO = 125; // same as SongPlay
+#if defined(_WIN32) || SDL_BYTEORDER != SDL_LIL_ENDIAN
+// a mapped file can't be replaced when saving on Windows
+const bool MAP_WAVES = false;
+#else
+const bool MAP_WAVES = true;
+#endif
+
 struct TypeCount
 {
     ObjectType type;
     uint16_t count;
 };
 
-Loader::Loader(SDL_RWops *stream)
-    : stream(stream)
+Loader::Loader(MappedFile *file)
+    : file(file)
+    , reader(file->data(), file->size())
 {
     loadHeader();
 }
 
-Loader::~Loader()
-{
-    SDL_RWclose(stream);
-}
-
 void Loader::loadHeader()
 {
-    char signature[4];
-    SDL_RWread(stream, signature, 1, 4);
-    if (std::memcmp(signature, MAGIC, 4)) {
+    if (reader.size() < 4 || std::memcmp(reader.bytes(4), MAGIC, 4)) {
         throw std::runtime_error("Unrecognized format");
     }
 
-    SDL_RWseek(stream, 2, RW_SEEK_CUR); // skip created version
-    uint16_t compatibleVersion = SDL_ReadLE16(stream);
+    createdVersion = reader.le16();
+    uint16_t compatibleVersion = reader.le16();
     if (compatibleVersion > VERSION) {
         throw std::runtime_error(
             "This file requires a newer version of chromatracker");
     }
+    if (createdVersion >= 2) {
+        // directory may be anywhere after incremental saves
+        reader.seek(reader.le32());
+    }
 
-    uint16_t numTypes = SDL_ReadLE16(stream);
-    SDL_RWseek(stream, 2, RW_SEEK_CUR);
+    uint16_t numTypes = reader.le16();
+    reader.skip(2);
     vector<TypeCount> typeCounts;
     typeCounts.reserve(numTypes);
     for (int i = 0; i < numTypes; i++) {
         TypeCount &tc = typeCounts.emplace_back();
-        tc.type = (ObjectType)SDL_ReadU8(stream);
-        SDL_RWseek(stream, 1, RW_SEEK_CUR);
-        tc.count = SDL_ReadLE16(stream);
+        tc.type = (ObjectType)reader.u8();
+        reader.skip(1);
+        tc.count = reader.le16();
     }
 
     for (auto &tc : typeCounts) {
         vector<uint32_t> &offsetsVec = objectOffsets[tc.type];
         offsetsVec.reserve(tc.count);
         for (int i = 0; i < tc.count; i++)
-            offsetsVec.push_back(SDL_ReadLE32(stream));
+            offsetsVec.push_back(reader.le32());
     }
 }
 
-float Loader::readFloat()
-{
-    uint32_t i = SDL_ReadLE32(stream);
-    return *(float *)&i;
-}
-
-string Loader::readString()
+void Loader::loadSong(Song *song)
 {
-    uint16_t size = SDL_ReadLE16(stream);
-    unique_ptr<char[]> buffer(new char[size + 1]);
-    SDL_RWread(stream, buffer.get(), 1, size);
-    buffer[size] = 0;
-    return buffer.get();
+    loadStructure(song, nullptr);
+    loadWaves(song->samples, nullptr);
 }
 
-void Loader::loadSong(Song *song)
+void Loader::loadStructure(Song *song, LoadProgress *progress)
 {
     this->song = song;
 
@@ -84,11 +88,6 @@ void Loader::loadSong(Song *song)
     for (uint32_t offset : sampleOffsets)
         loadSample(offset, song->samples.emplace_back(new Sample));
 
-    auto &waveOffsets = objectOffsets[ObjectType::Wave];
-    int numWaves = glm::min(waveOffsets.size(), sampleOffsets.size());
-    for (int i = 0; i < numWaves; i++)
-        loadWave(waveOffsets[i], song->samples[i]->channels);
-
     auto &trackOffsets = objectOffsets[ObjectType::Track];
     song->tracks.reserve(trackOffsets.size());
     for (uint32_t offset : trackOffsets)
@@ -102,10 +101,48 @@ void Loader::loadSong(Song *song)
     for (int i = 0; i < sectionOffsets.size(); i++)
         loadSection(sectionOffsets[i], song->sections[i]);
 
+    // all objects exist now, so waves and events can be decoded
+    // independently. each job only writes to its own sample / section
     auto &eventsOffsets = objectOffsets[ObjectType::Events];
-    int numEventses = glm::min(sectionOffsets.size(), eventsOffsets.size());
-    for (int i = 0; i < numEventses; i++)
+    size_t numEventses = glm::min(sectionOffsets.size(), eventsOffsets.size());
+    numJobs = numEventses + glm::min(objectOffsets[ObjectType::Wave].size(),
+                                     sampleOffsets.size());
+    jobsDone = 0;
+    parallelFor(numEventses, [&](size_t i) {
+        checkCancelled(progress);
         loadEvents(eventsOffsets[i], song->sections[i]->trackEvents);
+        jobDone(progress);
+    });
+}
+
+void Loader::loadWaves(const vector<shared_ptr<Sample>> &samples,
+                       LoadProgress *progress)
+{
+    auto &waveOffsets = objectOffsets[ObjectType::Wave];
+    size_t numWaves = glm::min(waveOffsets.size(), samples.size());
+    parallelFor(numWaves, [&](size_t i) {
+        checkCancelled(progress);
+        if (samples[i]) {
+            Wave wave = loadWave(waveOffsets[i]);
+            // song may already be playing
+            std::unique_lock lock(samples[i]->mu);
+            std::swap(samples[i]->wave, wave);
+        }
+        jobDone(progress);
+    });
+}
+
+void Loader::checkCancelled(LoadProgress *progress) const
+{
+    if (progress && progress->cancelled)
+        throw LoadCancelled();
+}
+
+void Loader::jobDone(LoadProgress *progress)
+{
+    size_t done = ++jobsDone;
+    if (progress && numJobs)
+        progress->fraction = (float)done / numJobs;
 }
 
 vector<string> Loader::listSamples()
@@ -115,8 +152,8 @@ vector<string> Loader::listSamples()
     auto &sampleOffsets = objectOffsets[ObjectType::Sample];
     sampleNames.reserve(sampleOffsets.size());
     for (uint32_t offset : sampleOffsets) {
-        SDL_RWseek(stream, offset, RW_SEEK_SET);
-        sampleNames.push_back(readString());
+        reader.seek(offset);
+        sampleNames.push_back(reader.string16());
     }
 
     return sampleNames;
@@ -128,92 +165,211 @@ void Loader::loadSample(int index, shared_ptr<Sample> sample)
     if (index < 0 || index >= sampleOffsets.size())
         return;
     loadSample(sampleOffsets[index], sample);
+    auto &waveOffsets = objectOffsets[ObjectType::Wave];
+    if (index < waveOffsets.size())
+        sample->wave = loadWave(waveOffsets[index]);
+}
+
+FileInfo Loader::loadInfo()
+{
+    FileInfo info;
+    info.sampleNames = listSamples();
+    info.numChannels = objectOffsets[ObjectType::Track].size();
+
+    // only sections, for the title and length
+    Song infoSong;
+    song = &infoSong;
+    auto &sectionOffsets = objectOffsets[ObjectType::Section];
+    for (int i = 0; i < sectionOffsets.size(); i++)
+        infoSong.sections.emplace_back(new Section);
+    for (int i = 0; i < sectionOffsets.size(); i++)
+        loadSection(sectionOffsets[i], infoSong.sections[i]);
+    song = nullptr;
+    if (infoSong.sections.empty())
+        return info;
+
+    info.title = infoSong.sections[0]->title;
+    int tempo = DEFAULT_TEMPO;
+    std::unordered_set<const Section *> played;
+    for (auto section = infoSong.sections[0]; section && tempo > 0;
+            section = section->next.lock()) {
+        if (!played.insert(section.get()).second)
+            break; // repeats
+        if (section->tempo != Section::NO_TEMPO)
+            tempo = section->tempo;
+        info.seconds += (float)section->length / TICKS_PER_BEAT * 60 / tempo;
+    }
+    return info;
 }
 
 void Loader::loadSongInfo(uint32_t offset, Song *song)
 {
-    SDL_RWseek(stream, offset, RW_SEEK_SET);
-    song->volume = readFloat();
+    reader.seek(offset);
+    song->volume = reader.leFloat();
 }
 
 void Loader::loadSample(uint32_t offset, shared_ptr<Sample> sample)
 {
-    SDL_RWseek(stream, offset, RW_SEEK_SET);
-    sample->name = readString();
-    sample->color.r = SDL_ReadU8(stream) / 255.0f;
-    sample->color.g = SDL_ReadU8(stream) / 255.0f;
-    sample->color.b = SDL_ReadU8(stream) / 255.0f;
+    reader.seek(offset);
+    sample->name = reader.string16();
+    sample->color.r = reader.u8() / 255.0f;
+    sample->color.g = reader.u8() / 255.0f;
+    sample->color.b = reader.u8() / 255.0f;
 
-    uint8_t flags = SDL_ReadU8(stream);
+    uint8_t flags = reader.u8();
     sample->interpolationMode =
         (Sample::InterpolationMode)((flags >> INTERPOLATION_MODE_FLAG) & 0x3);
     sample->loopMode = (Sample::LoopMode)((flags >> LOOP_MODE_FLAG) & 0x3);
     sample->newNoteAction =
         (Sample::NewNoteAction)((flags >> NEW_NOTE_ACTION_FLAG) & 0x3);
 
-    sample->frameRate = SDL_ReadLE32(stream);
-    sample->loopStart = SDL_ReadLE32(stream);
-    sample->loopEnd = SDL_ReadLE32(stream);
-    sample->volume = readFloat();
-    sample->tune = readFloat();
-    sample->fadeOut = readFloat();
+    sample->frameRate = reader.le32();
+    sample->loopStart = reader.le32();
+    sample->loopEnd = reader.le32();
+    sample->volume = reader.leFloat();
+    sample->tune = reader.leFloat();
+    sample->fadeOut = reader.leFloat();
+}
+
+ByteReader Loader::readerAt(uint32_t offset) const
+{
+    ByteReader r(file->data(), file->size());
+    r.seek(offset);
+    return r;
 }
 
-void Loader::loadWave(uint32_t offset, vector<vector<float>> &wave)
+Wave Loader::loadWave(uint32_t offset) const
 {
-    SDL_RWseek(stream, offset, RW_SEEK_SET);
-    uint32_t numFrames = SDL_ReadLE32(stream);
-    uint16_t numChannels = SDL_ReadLE16(stream);
-    WaveFormat format = (WaveFormat)SDL_ReadU8(stream);
-    SDL_RWseek(stream, 1, RW_SEEK_CUR);
-    if (format != WaveFormat::Float)
-        return; // unrecognized format
-    
-    wave.resize(numChannels);
-    for (auto &channel : wave) {
-        channel.resize(numFrames);
-        // TODO endianess
-        SDL_RWread(stream, channel.data(), sizeof(float), numFrames);
+    ByteReader reader = readerAt(offset);
+    uint32_t numFrames = reader.le32();
+    uint16_t numChannels = reader.le16();
+    WaveFormat format = (WaveFormat)reader.u8();
+    reader.skip(1);
+
+    size_t size = (size_t)numFrames * numChannels * sizeof(float);
+    if (MAP_WAVES && format == WaveFormat::Float && size >= MAPPED_WAVE_BYTES
+            && numFrames <= INT32_MAX) {
+        auto data = (const float *)reader.bytes(size);
+        // files written before waves were aligned are decoded instead
+        if ((uintptr_t)data % alignof(float) == 0)
+            return Wave(file, data, numChannels, numFrames);
+        reader.seek(reader.tell() - size);
     }
+
+    vector<vector<float>> wave;
+    if (!decodeWave(reader, format, numFrames, numChannels, wave))
+        wave.clear(); // unrecognized format
+    return Wave(std::move(wave));
 }
 
 void Loader::loadTrack(uint32_t offset, shared_ptr<Track> track)
 {
-    SDL_RWseek(stream, offset, RW_SEEK_SET);
-    track->volume = readFloat();
-    track->pan = readFloat();
-    uint8_t flags = SDL_ReadU8(stream);
+    reader.seek(offset);
+    track->volume = reader.leFloat();
+    track->pan = reader.leFloat();
+    uint8_t flags = reader.u8();
     track->mute = (flags>>MUTE_FLAG) & 0x1;
 }
 
 void Loader::loadSection(uint32_t offset, shared_ptr<Section> section)
 {
-    SDL_RWseek(stream, offset, RW_SEEK_SET);
-    section->title = readString();
-    section->length = SDL_ReadLE32(stream);
-    section->tempo = (int16_t)SDL_ReadLE16(stream);
-    section->meter = (int16_t)SDL_ReadLE16(stream);
-    uint16_t nextIndex = SDL_ReadLE16(stream);
+    reader.seek(offset);
+    section->title = reader.string16();
+    section->length = reader.le32();
+    section->tempo = (int16_t)reader.le16();
+    section->meter = (int16_t)reader.le16();
+    uint16_t nextIndex = reader.le16();
     if (nextIndex < song->sections.size())
         section->next = song->sections[nextIndex];
 }
 
-void Loader::loadEvents(uint32_t offset, vector<vector<Event>> &trackEvents)
+void Loader::loadEvents(uint32_t offset,
+                        vector<vector<Event>> &trackEvents) const
 {
-    SDL_RWseek(stream, offset, RW_SEEK_SET);
+    ByteReader reader = readerAt(offset);
     trackEvents.resize(song->tracks.size());
     for (auto &events : trackEvents) {
-        uint32_t numEvents = SDL_ReadLE32(stream);
-        events.reserve(numEvents);
-        for (int i = 0; i < numEvents; i++) {
-            Event &event = events.emplace_back();
-            event.time = SDL_ReadLE32(stream);
-            uint16_t sampleIndex = SDL_ReadLE16(stream);
+        if (createdVersion >= 3)
+            loadColumnEvents(reader, events);
+        else
+            loadFixedEvents(reader, events);
+    }
+}
+
+void Loader::loadFixedEvents(ByteReader &reader, vector<Event> &events) const
+{
+    uint32_t numEvents = reader.le32();
+    // checks bounds once for all events
+    size_t recordsSize = (size_t)numEvents * EVENT_SIZE;
+    ByteReader records(reader.bytes(recordsSize), recordsSize);
+    events.reserve(numEvents);
+    for (int i = 0; i < numEvents; i++) {
+        Event &event = events.emplace_back();
+        event.time = records.le32();
+        uint16_t sampleIndex = records.le16();
+        if (sampleIndex < song->samples.size())
+            event.sample = song->samples[sampleIndex];
+        event.pitch = (int8_t)records.u8();
+        event.special = (Event::Special)records.u8();
+        event.velocity = records.leFloat();
+    }
+}
+
+void Loader::loadColumnEvents(ByteReader &reader, vector<Event> &events) const
+{
+    uint32_t numEvents = reader.varint();
+    if (numEvents == 0)
+        return;
+    uint32_t paletteSize = reader.varint();
+    if (paletteSize > MAX_VELOCITY_PALETTE)
+        throw std::runtime_error("Invalid velocity palette");
+    float palette[MAX_VELOCITY_PALETTE];
+    for (uint32_t i = 0; i < paletteSize; i++)
+        palette[i] = reader.leFloat();
+
+    // every event has at least a mask and a time, so this can't be too large
+    const uint8_t *masks = reader.bytes(numEvents);
+    events.resize(numEvents);
+    // each column in one pass
+    ticks time = 0;
+    for (auto &event : events) {
+        time += unzigzag(reader.varint());
+        event.time = time;
+    }
+    for (uint32_t i = 0; i < numEvents; i++) {
+        if (masks[i] & EVENT_SAMPLE) {
+            uint32_t sampleIndex = reader.varint();
             if (sampleIndex < song->samples.size())
-                event.sample = song->samples[sampleIndex];
-            event.pitch = (int8_t)SDL_ReadU8(stream);
-            event.special = (Event::Special)SDL_ReadU8(stream);
-            event.velocity = readFloat();
+                events[i].sample = song->samples[sampleIndex];
+        }
+    }
+    int pitch = 0;
+    for (uint32_t i = 0; i < numEvents; i++) {
+        if (masks[i] & EVENT_PITCH) {
+            pitch += unzigzag(reader.varint());
+            events[i].pitch = pitch;
+        }
+    }
+    for (uint32_t i = 0; i < numEvents; i++) {
+        if (masks[i] & EVENT_VELOCITY) {
+            uint8_t index = reader.u8();
+            if (index >= paletteSize)
+                throw std::runtime_error("Invalid velocity index");
+            events[i].velocity = palette[index];
+        }
+    }
+    for (uint32_t i = 0; i < numEvents; i++) {
+        if (masks[i] & EVENT_VELOCITY_RAW)
+            events[i].velocity = reader.leFloat();
+    }
+    for (uint32_t i = 0; i < numEvents; i++) {
+        if (masks[i] & EVENT_SPECIAL)
+            events[i].special = (Event::Special)reader.u8();
+    }
+    if (createdVersion >= 4) {
+        for (uint32_t i = 0; i < numEvents; i++) {
+            if (masks[i] & EVENT_OFFSET)
+                events[i].offset = reader.varint();
         }
     }
 }
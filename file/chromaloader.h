@@ -1,41 +1,58 @@
 #pragma once
 #include <common.h>
 
+#include "bytereader.h"
 #include "chroma.h"
+#include "mappedfile.h"
 #include "types.h"
 #include <song.h>
+#include <atomic>
 #include <unordered_map>
-#include <SDL2/SDL_rwops.h>
 
 namespace chromatracker::file::chroma {
 
 class Loader : public ModuleLoader
 {
 public:
-    Loader(SDL_RWops *stream);
-    ~Loader();
+    Loader(MappedFile *file); // takes ownership
 
     void loadSong(Song *song) override;
     vector<string> listSamples() override;
     void loadSample(int index, shared_ptr<Sample> sample) override;
+    FileInfo loadInfo() override;
+    void loadStructure(Song *song, LoadProgress *progress) override;
+    void loadWaves(const vector<shared_ptr<Sample>> &samples,
+                   LoadProgress *progress) override;
 
 private:
-    float readFloat();
-    string readString();
-
     void loadHeader();
+    void checkCancelled(LoadProgress *progress) const; // throws
+    void jobDone(LoadProgress *progress); // thread safe
 
     void loadSongInfo(uint32_t offset, Song *song);
     void loadSample(uint32_t offset, shared_ptr<Sample> sample);
-    void loadWave(uint32_t offset, vector<vector<float>> &wave);
+    // independent of the member reader, safe to call in parallel
+    ByteReader readerAt(uint32_t offset) const;
+    // large Float waves are views of the file (see MAPPED_WAVE_BYTES)
+    Wave loadWave(uint32_t offset) const;
     void loadTrack(uint32_t offset, shared_ptr<Track> track);
     void loadSection(uint32_t offset, shared_ptr<Section> section);
-    void loadEvents(uint32_t offset, vector<vector<Event>> &trackEvents);
+    void loadEvents(uint32_t offset,
+                    vector<vector<Event>> &trackEvents) const;
+    // before version 3, 12 bytes per event
+    void loadFixedEvents(ByteReader &reader, vector<Event> &events) const;
+    void loadColumnEvents(ByteReader &reader, vector<Event> &events) const;
 
     std::unordered_map<ObjectType, vector<uint32_t>> objectOffsets;
 
-    SDL_RWops *stream;
+    shared_ptr<const MappedFile> file; // also owned by mapped waves
+    ByteReader reader; // over the whole file
+    uint16_t createdVersion;
     Song *song;
+
+    // waves and events, for progress
+    size_t numJobs {0};
+    std::atomic<size_t> jobsDone {0};
 };
 
 } // namespace
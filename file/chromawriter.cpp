@@ -1,193 +1,513 @@
 #include "chromawriter.h"
+#include "wavecodec.h"
+#include <parallel.h>
 #include <version.h>
-#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <iterator>
+#include <mutex>
+#include <system_error>
+#include <SDL2/SDL_rwops.h>
 
 namespace chromatracker::file::chroma {
 
+const uint16_t NO_INDEX = 0xFFFF;
+// version 2 moved the directory after a pointer to it, version 3 changed the
+// events encoding, version 4 added sample offsets to events
+const uint16_t COMPATIBLE_VERSION = 4;
+const uint32_t DIRECTORY_OFFSET_POS = 8;
+const uint32_t HEADER_SIZE = 12;
+// waves start at a multiple of this, so Float data can be mapped
+const uint32_t WAVE_ALIGNMENT = 4;
+
 template<typename T>
-int findIndex(const vector<T> v, T item) {
-    if (item == nullptr)
-        return -1;
-    auto it = std::find(v.begin(), v.end(), item);
-    if (it == v.end()) {
-        return -1;
-    } else {
-        return it - v.begin();
-    }
+uint16_t findIndex(const std::unordered_map<const T *, uint16_t> &indices,
+                   const shared_ptr<T> &item)
+{
+    auto it = indices.find(item.get());
+    return it == indices.end() ? NO_INDEX : it->second;
 }
 
-Writer::Writer(SDL_RWops *stream)
-    : stream(stream)
-{}
+template<typename T>
+bool sameOrder(const vector<std::weak_ptr<const T>> &saved,
+               const vector<shared_ptr<const T>> &current)
+{
+    if (saved.size() != current.size())
+        return false;
+    for (int i = 0; i < current.size(); i++) {
+        if (saved[i].lock() != current[i])
+            return false;
+    }
+    return true;
+}
 
-Writer::~Writer()
+const SaveState::Record * findRecord(const SaveState &state,
+                                     const SongObject *object)
 {
-    SDL_RWclose(stream);
+    auto it = state.records.find(object);
+    if (it == state.records.end() || it->second.object.lock().get() != object)
+        return nullptr;
+    return &it->second;
 }
 
-void Writer::writeSong(const Song *song)
+Writer::Writer(const Song *song, Path path, SaveState *state, bool compact)
+    : path(path)
+    , state(state)
 {
-    this->song = song;
-    std::shared_lock songLock(song->mu);
+    vector<bool> sampleDirty, trackDirty, sectionDirty;
+    {
+        std::shared_lock songLock(song->mu);
+        volume = song->volume;
+        samples.assign(song->samples.begin(), song->samples.end());
+        for (auto &sample : song->samples) {
+            std::shared_lock sampleLock(sample->mu);
+            waves.push_back(sample->wave);
+        }
+        tracks.assign(song->tracks.begin(), song->tracks.end());
+        sections.assign(song->sections.begin(), song->sections.end());
 
-    SDL_RWwrite(stream, MAGIC, 1, 4);
-    SDL_WriteLE16(stream, VERSION);
-    SDL_WriteLE16(stream, 0); // compatible version
+        // changes after this point will be saved next time. other snapshots
+        // (without a state) don't affect incremental saves
+        if (state) {
+            for (auto &sample : song->samples)
+                sampleDirty.push_back(sample->dirty.exchange(false));
+            for (auto &track : song->tracks)
+                trackDirty.push_back(track->dirty.exchange(false));
+            for (auto &section : song->sections)
+                sectionDirty.push_back(section->dirty.exchange(false));
+        }
+    }
 
-    // object directory
-    int numObjects = 0;
-    SDL_WriteLE16(stream, 6); // num types
-    SDL_WriteLE16(stream, 0);
-    numObjects += writeObjectType(ObjectType::Song, 1);
-    numObjects += writeObjectType(ObjectType::Sample, song->samples.size());
-    numObjects += writeObjectType(ObjectType::Track, song->tracks.size());
-    numObjects += writeObjectType(ObjectType::Section, song->sections.size());
-    // largest objects at the end
-    numObjects += writeObjectType(ObjectType::Events, song->sections.size());
-    numObjects += writeObjectType(ObjectType::Wave, song->samples.size());
+    for (int i = 0; i < samples.size(); i++)
+        sampleIndices[samples[i].get()] = i;
+    for (int i = 0; i < sections.size(); i++)
+        sectionIndices[sections[i].get()] = i;
 
-    uint32_t objectOffsetsOffset = SDL_RWtell(stream);
-    SDL_RWseek(stream, 4 * numObjects, RW_SEEK_CUR);
-    vector<uint32_t> objectOffsets;
-    objectOffsets.reserve(numObjects);
+    // directory order: song, samples, tracks, sections, events, waves
+    samplesStart = 1;
+    tracksStart = samplesStart + samples.size();
+    sectionsStart = tracksStart + tracks.size();
+    eventsStart = sectionsStart + sections.size();
+    wavesStart = eventsStart + sections.size();
+    size_t count = wavesStart + samples.size();
+    objects.resize(count);
+    changed.assign(count, true);
+    offsets.assign(count, 0);
 
-    objectOffsets.push_back(writeSongInfo(song));
-    for (auto &sample : song->samples)
-        objectOffsets.push_back(writeSample(sample));
-    for (auto &track : song->tracks)
-        objectOffsets.push_back(writeTrack(track));
-    for (auto &section : song->sections)
-        objectOffsets.push_back(writeSection(section));
-    for (auto &section : song->sections) {
-        std::shared_lock sectionLock(section->mu);
-        objectOffsets.push_back(writeEvents(section->trackEvents));
+    append = state && state->valid && !compact && state->path == path;
+    if (append) {
+        // file was replaced by something else
+        std::error_code ec;
+        if (std::filesystem::file_size(path, ec) != state->fileSize || ec)
+            append = false;
     }
-    for (auto &sample : song->samples) {
-        std::shared_lock sampleLock(sample->mu);
-        objectOffsets.push_back(writeWave(sample->channels));
+    if (append)
+        findUnchanged(sampleDirty, trackDirty, sectionDirty);
+
+    // the song may change before encode() is called. waves were copied,
+    // copy everything else that will be encoded for a consistent file
+    sampleCopies.resize(samples.size());
+    for (int i = 0; i < samples.size(); i++) {
+        if (changed[samplesStart + i]) {
+            std::shared_lock lock(samples[i]->mu);
+            sampleCopies[i] = std::make_unique<Sample>(*samples[i]);
+        }
+    }
+    trackCopies.resize(tracks.size());
+    for (int i = 0; i < tracks.size(); i++) {
+        if (changed[tracksStart + i]) {
+            std::shared_lock lock(tracks[i]->mu);
+            trackCopies[i] = std::make_unique<Track>(*tracks[i]);
+        }
     }
+    sectionCopies.resize(sections.size());
+    for (int i = 0; i < sections.size(); i++) {
+        if (changed[sectionsStart + i] || changed[eventsStart + i]) {
+            std::shared_lock lock(sections[i]->mu);
+            sectionCopies[i] = std::make_unique<Section>(*sections[i]);
+        }
+    }
+}
 
-    SDL_RWseek(stream, objectOffsetsOffset, RW_SEEK_SET);
-    // TODO endianess
-    SDL_RWwrite(stream, objectOffsets.data(),
-                sizeof(uint32_t), objectOffsets.size());
+void Writer::findUnchanged(const vector<bool> &sampleDirty,
+                           const vector<bool> &trackDirty,
+                           const vector<bool> &sectionDirty)
+{
+    // events and sections store references as indices
+    bool samplesMoved = !sameOrder(state->sampleOrder, samples);
+    bool sectionsMoved = !sameOrder(state->sectionOrder, sections);
+
+    for (int i = 0; i < samples.size(); i++) {
+        if (auto record = findRecord(*state, samples[i].get())) {
+            if (record->wave.shares(waves[i])) {
+                changed[wavesStart + i] = false;
+                offsets[wavesStart + i] = record->dataOffset;
+            }
+            if (!sampleDirty[i]) {
+                changed[samplesStart + i] = false;
+                offsets[samplesStart + i] = record->offset;
+            }
+        }
+    }
+    for (int i = 0; i < tracks.size(); i++) {
+        auto record = findRecord(*state, tracks[i].get());
+        if (record && !trackDirty[i]) {
+            changed[tracksStart + i] = false;
+            offsets[tracksStart + i] = record->offset;
+        }
+    }
+    for (int i = 0; i < sections.size(); i++) {
+        auto record = findRecord(*state, sections[i].get());
+        if (!record || sectionDirty[i])
+            continue;
+        if (!sectionsMoved) {
+            changed[sectionsStart + i] = false;
+            offsets[sectionsStart + i] = record->offset;
+        }
+        if (!samplesMoved) {
+            changed[eventsStart + i] = false;
+            offsets[eventsStart + i] = record->dataOffset;
+        }
+    }
 }
 
-void Writer::writeFloat(float f)
+void Writer::encode()
 {
-    SDL_WriteLE32(stream, *(uint32_t *)&f);
+    // largest objects first for better balancing (waves, then events)
+    vector<size_t> jobs;
+    for (size_t i = objects.size(); i-- > 0;) {
+        if (changed[i])
+            jobs.push_back(i);
+    }
+    parallelFor(jobs.size(), [&](size_t job) {
+        encodeObject(jobs[job]);
+    });
 }
 
-void Writer::writeString(string s)
+void Writer::encodeObject(size_t i)
 {
-    if (s.size() > 65535)
-        s = s.substr(0, 65535);
-    SDL_WriteLE16(stream, s.size());
-    SDL_RWwrite(stream, s.c_str(), 1, s.size());
+    vector<uint8_t> &buffer = objects[i];
+    if (i >= wavesStart) {
+        encodeWave(waves[i - wavesStart], buffer);
+        return;
+    }
+    ByteWriter out(buffer);
+    if (i >= eventsStart) {
+        encodeEvents(*sectionCopies[i - eventsStart], out);
+    } else if (i >= sectionsStart) {
+        encodeSection(*sectionCopies[i - sectionsStart], out);
+    } else if (i >= tracksStart) {
+        encodeTrack(*trackCopies[i - tracksStart], out);
+    } else if (i >= samplesStart) {
+        encodeSample(*sampleCopies[i - samplesStart], out);
+    } else {
+        encodeSongInfo(out);
+    }
 }
 
-uint16_t Writer::writeObjectType(ObjectType type, uint16_t count)
+bool Writer::save()
 {
-    SDL_WriteLE16(stream, (uint16_t)type);
-    SDL_WriteLE16(stream, count);
-    return count;
+    uint64_t fileSize = 0;
+    bool ok = append ? writeAppend(&fileSize) : writeFull(&fileSize);
+    if (state) {
+        if (ok)
+            updateState(fileSize);
+        else
+            state->valid = false; // unknown file contents
+    }
+    return ok;
 }
 
-uint32_t Writer::writeSongInfo(const Song *song)
+uint32_t Writer::placeObjects(uint32_t offset)
 {
-    uint32_t offset = SDL_RWtell(stream);
-    writeFloat(song->volume);
+    for (int i = 0; i < objects.size(); i++) {
+        if (changed[i]) {
+            if (i >= wavesStart)
+                offset = (offset + WAVE_ALIGNMENT - 1) & ~(WAVE_ALIGNMENT - 1);
+            offsets[i] = offset;
+            offset += objects[i].size();
+        }
+    }
     return offset;
 }
 
-uint32_t Writer::writeSample(shared_ptr<const Sample> sample)
+uint32_t Writer::directorySize() const
 {
-    uint32_t offset = SDL_RWtell(stream);
-    std::shared_lock lock(sample->mu);
+    return 4 + 4 * 6 + 4 * objects.size();
+}
 
-    writeString(sample->name);
-    SDL_WriteU8(stream, sample->color.r * 255);
-    SDL_WriteU8(stream, sample->color.g * 255);
-    SDL_WriteU8(stream, sample->color.b * 255);
-    uint8_t flags =
-        (uint8_t)sample->interpolationMode << INTERPOLATION_MODE_FLAG
-        | (uint8_t)sample->loopMode << LOOP_MODE_FLAG
-        | (uint8_t)sample->newNoteAction << NEW_NOTE_ACTION_FLAG;
-    SDL_WriteU8(stream, flags);
-    SDL_WriteLE32(stream, sample->frameRate);
-    SDL_WriteLE32(stream, sample->loopStart);
-    SDL_WriteLE32(stream, sample->loopEnd);
-    writeFloat(sample->volume);
-    writeFloat(sample->tune);
-    writeFloat(sample->fadeOut);
+void Writer::encodeDirectory(ByteWriter &out) const
+{
+    std::pair<ObjectType, size_t> types[] {
+        {ObjectType::Song, 1},
+        {ObjectType::Sample, samples.size()},
+        {ObjectType::Track, tracks.size()},
+        {ObjectType::Section, sections.size()},
+        // largest objects at the end
+        {ObjectType::Events, sections.size()},
+        {ObjectType::Wave, samples.size()},
+    };
+    static_assert(std::size(types) == 6); // see directorySize()
+    out.le16(std::size(types));
+    out.le16(0);
+    for (auto &type : types) {
+        out.le16((uint16_t)type.first);
+        out.le16(type.second);
+    }
+    for (uint32_t offset : offsets)
+        out.le32(offset);
+}
 
-    return offset;
+bool Writer::writeObjects(SDL_RWops *stream, uint32_t offset) const
+{
+    const uint8_t padding[WAVE_ALIGNMENT] = {};
+    for (int i = 0; i < objects.size(); i++) {
+        if (!changed[i])
+            continue;
+        size_t paddingSize = offsets[i] - offset;
+        if (paddingSize && SDL_RWwrite(stream, padding, 1, paddingSize)
+                != paddingSize)
+            return false;
+        if (SDL_RWwrite(stream, objects[i].data(), 1, objects[i].size())
+                != objects[i].size())
+            return false;
+        offset = offsets[i] + objects[i].size();
+    }
+    return true;
 }
 
-uint32_t Writer::writeWave(const vector<vector<float>> &wave)
+bool Writer::writeFull(uint64_t *fileSize)
 {
-    uint32_t offset = SDL_RWtell(stream);
+    *fileSize = placeObjects(HEADER_SIZE + directorySize());
 
-    if (wave.empty()){
-        SDL_WriteLE32(stream, 0);
-        SDL_WriteLE16(stream, 0);
-        SDL_WriteLE16(stream, (uint16_t)WaveFormat::Float);
-        return offset;
+    vector<uint8_t> header;
+    ByteWriter out(header);
+    out.bytes(MAGIC, 4);
+    out.le16(VERSION);
+    out.le16(COMPATIBLE_VERSION);
+    out.le32(HEADER_SIZE); // directory follows
+    encodeDirectory(out);
+
+    Path tempPath = path;
+    tempPath += ".tmp";
+    SDL_RWops *stream = SDL_RWFromFile(tempPath.string().c_str(), "wb");
+    if (!stream) {
+        cout << "Error opening stream: " <<SDL_GetError()<< "\n";
+        return false;
     }
-    SDL_WriteLE32(stream, wave[0].size());
-    SDL_WriteLE16(stream, wave.size());
-    SDL_WriteLE16(stream, (uint16_t)WaveFormat::Float);
-    for (auto &channel : wave) {
-        // TODO endianess
-        SDL_RWwrite(stream, channel.data(), sizeof(float), channel.size());
+    bool ok = SDL_RWwrite(stream, header.data(), 1, header.size())
+        == header.size();
+    ok = ok && writeObjects(stream, header.size());
+    if (SDL_RWclose(stream) != 0)
+        ok = false;
+    if (!ok) {
+        cout << "Error writing file: " <<SDL_GetError()<< "\n";
+        std::error_code ec;
+        std::filesystem::remove(tempPath, ec);
+        return false;
     }
 
-    return offset;
+    std::error_code ec;
+    std::filesystem::rename(tempPath, path, ec); // replaces existing
+    if (ec) {
+        cout << "Error replacing file: " <<ec.message()<< "\n";
+        return false;
+    }
+    return true;
 }
 
-uint32_t Writer::writeTrack(shared_ptr<const Track> track)
+bool Writer::writeAppend(uint64_t *fileSize)
 {
-    uint32_t offset = SDL_RWtell(stream);
-    std::shared_lock lock(track->mu);
+    uint32_t directoryOffset = placeObjects(state->fileSize);
+    vector<uint8_t> directory;
+    ByteWriter out(directory);
+    encodeDirectory(out);
+    *fileSize = directoryOffset + directory.size();
 
-    writeFloat(track->volume);
-    writeFloat(track->pan);
-    SDL_WriteU8(stream, track->mute ? (1<<MUTE_FLAG) : 0);
+    SDL_RWops *stream = SDL_RWFromFile(path.string().c_str(), "r+b");
+    if (!stream) {
+        cout << "Error opening stream: " <<SDL_GetError()<< "\n";
+        return false;
+    }
+    bool ok = SDL_RWseek(stream, state->fileSize, RW_SEEK_SET) >= 0;
+    ok = ok && writeObjects(stream, state->fileSize);
+    ok = ok && SDL_RWwrite(stream, directory.data(), 1, directory.size())
+        == directory.size();
+    // the old directory is used until this point
+    ok = ok && SDL_RWseek(stream, DIRECTORY_OFFSET_POS, RW_SEEK_SET) >= 0;
+    ok = ok && SDL_WriteLE32(stream, directoryOffset) == 1;
+    if (SDL_RWclose(stream) != 0)
+        ok = false;
+    if (!ok) {
+        cout << "Error writing file: " <<SDL_GetError()<< "\n";
+        return false;
+    }
+    return true;
+}
 
-    return offset;
+void Writer::updateState(uint64_t fileSize)
+{
+    state->valid = true;
+    state->path = path;
+    state->fileSize = fileSize;
+    // rebuilt to forget deleted objects
+    state->records.clear();
+    state->sampleOrder.assign(samples.begin(), samples.end());
+    state->sectionOrder.assign(sections.begin(), sections.end());
+    for (int i = 0; i < samples.size(); i++) {
+        state->records[samples[i].get()] = {samples[i],
+            offsets[samplesStart + i], offsets[wavesStart + i], waves[i]};
+    }
+    for (int i = 0; i < tracks.size(); i++) {
+        state->records[tracks[i].get()] = {tracks[i],
+            offsets[tracksStart + i], 0};
+    }
+    for (int i = 0; i < sections.size(); i++) {
+        state->records[sections[i].get()] = {sections[i],
+            offsets[sectionsStart + i], offsets[eventsStart + i]};
+    }
 }
 
-uint32_t Writer::writeSection(shared_ptr<const Section> section)
+void Writer::encodeSongInfo(ByteWriter &out)
 {
-    uint32_t offset = SDL_RWtell(stream);
-    std::shared_lock lock(section->mu);
+    out.leFloat(volume);
+}
 
-    writeString(section->title);
-    SDL_WriteLE32(stream, section->length);
-    SDL_WriteLE16(stream, section->tempo);
-    SDL_WriteLE16(stream, section->meter);
-    SDL_WriteLE16(stream, findIndex(song->sections, section->next.lock()));
+void Writer::encodeSample(const Sample &sample, ByteWriter &out)
+{
+    std::shared_lock lock(sample.mu);
 
-    return offset;
+    out.string16(sample.name);
+    out.u8(sample.color.r * 255);
+    out.u8(sample.color.g * 255);
+    out.u8(sample.color.b * 255);
+    uint8_t flags =
+        (uint8_t)sample.interpolationMode << INTERPOLATION_MODE_FLAG
+        | (uint8_t)sample.loopMode << LOOP_MODE_FLAG
+        | (uint8_t)sample.newNoteAction << NEW_NOTE_ACTION_FLAG;
+    out.u8(flags);
+    out.le32(sample.frameRate);
+    out.le32(sample.loopStart);
+    out.le32(sample.loopEnd);
+    out.leFloat(sample.volume);
+    out.leFloat(sample.tune);
+    out.leFloat(sample.fadeOut);
+}
+
+void Writer::encodeWave(const Wave &wave, vector<uint8_t> &buffer)
+{
+    ByteWriter out(buffer);
+
+    if (wave.numChannels() == 0) {
+        out.le32(0);
+        out.le16(0);
+        out.le16((uint16_t)WaveFormat::Float);
+        return;
+    }
+    out.le32(wave.length());
+    out.le16(wave.numChannels());
+    size_t formatPos = out.tell();
+    out.le16(0);
+    WaveFormat format = chroma::encodeWave(wave, buffer);
+    buffer[formatPos] = (uint8_t)format;
+}
+
+void Writer::encodeTrack(const Track &track, ByteWriter &out)
+{
+    std::shared_lock lock(track.mu);
+
+    out.leFloat(track.volume);
+    out.leFloat(track.pan);
+    out.u8(track.mute ? (1<<MUTE_FLAG) : 0);
+}
+
+void Writer::encodeSection(const Section &section, ByteWriter &out)
+{
+    std::shared_lock lock(section.mu);
+
+    out.string16(section.title);
+    out.le32(section.length);
+    out.le16(section.tempo);
+    out.le16(section.meter);
+    // lockDeleted doesn't modify the pointer, other threads may be reading it
+    out.le16(findIndex(sectionIndices, section.next.lockDeleted()));
 }
 
-uint32_t Writer::writeEvents(const vector<vector<Event>> &trackEvents)
+void Writer::encodeEvents(const Section &section, ByteWriter &out)
 {
-    uint32_t offset = SDL_RWtell(stream);
+    std::shared_lock lock(section.mu);
 
-    for (auto &events : trackEvents) {
-        SDL_WriteLE32(stream, events.size());
+    // see chroma.h
+    vector<uint8_t> masks, times, sampleColumn, pitches, velocities,
+        rawVelocities, specials, offsets;
+    vector<float> palette;
+    std::unordered_map<uint32_t, uint8_t> paletteIndices; // by float bits
+    for (auto &events : section.trackEvents) {
+        out.varint(events.size());
+        if (events.empty())
+            continue;
+        for (auto column : {&masks, &times, &sampleColumn, &pitches,
+                            &velocities, &rawVelocities, &specials, &offsets})
+            column->clear();
+        palette.clear();
+        paletteIndices.clear();
+        ByteWriter timesOut(times), samplesOut(sampleColumn),
+            pitchesOut(pitches), rawOut(rawVelocities), offsetsOut(offsets);
+
+        ticks prevTime = 0;
+        int prevPitch = 0;
         for (auto &event : events) {
-            SDL_WriteLE32(stream, event.time);
-            int sampleIndex = findIndex(song->samples, event.sample.lock());
-            SDL_WriteLE16(stream, sampleIndex);
-            SDL_WriteU8(stream, event.pitch);
-            SDL_WriteU8(stream, (uint8_t)event.special);
-            writeFloat(event.velocity);
+            uint8_t mask = 0;
+            timesOut.varint(zigzag(event.time - prevTime));
+            prevTime = event.time;
+            // deleted samples aren't in the snapshot
+            uint16_t sampleIndex = findIndex(sampleIndices,
+                                             event.sample.lockDeleted());
+            if (sampleIndex != NO_INDEX) {
+                mask |= EVENT_SAMPLE;
+                samplesOut.varint(sampleIndex);
+                if (event.offset > 0) {
+                    mask |= EVENT_OFFSET;
+                    offsetsOut.varint(event.offset);
+                }
+            }
+            if (event.pitch != Event::NO_PITCH) {
+                mask |= EVENT_PITCH;
+                pitchesOut.varint(zigzag(event.pitch - prevPitch));
+                prevPitch = event.pitch;
+            }
+            if (event.velocity != Event::NO_VELOCITY) {
+                // most songs only use a few velocities (volume column, MIDI)
+                uint32_t bits;
+                std::memcpy(&bits, &event.velocity, sizeof(bits));
+                auto it = paletteIndices.find(bits);
+                if (it == paletteIndices.end()
+                        && palette.size() < MAX_VELOCITY_PALETTE) {
+                    it = paletteIndices.emplace(bits, palette.size()).first;
+                    palette.push_back(event.velocity);
+                }
+                if (it != paletteIndices.end()) {
+                    mask |= EVENT_VELOCITY;
+                    velocities.push_back(it->second);
+                } else {
+                    mask |= EVENT_VELOCITY_RAW;
+                    rawOut.leFloat(event.velocity);
+                }
+            }
+            if (event.special != Event::Special::None) {
+                mask |= EVENT_SPECIAL;
+                specials.push_back((uint8_t)event.special);
+            }
+            masks.push_back(mask);
         }
-    }
 
-    return offset;
+        out.varint(palette.size());
+        for (float velocity : palette)
+            out.leFloat(velocity);
+        for (auto column : {&masks, &times, &sampleColumn, &pitches,
+                            &velocities, &rawVelocities, &specials, &offsets})
+            out.bytes(column->data(), column->size());
+    }
 }
 
 } // namespace
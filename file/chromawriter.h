@@ -1,35 +1,105 @@
 #pragma once
 #include <common.h>
 
+#include "bytewriter.h"
 #include "chroma.h"
+#include "types.h"
 #include <song.h>
-#include <SDL2/SDL_rwops.h>
+#include <atomic>
+#include <unordered_map>
 
 namespace chromatracker::file::chroma {
 
+// where objects were written by the last save, so the next save can append
+// only changed objects and a new directory
+struct SaveState
+{
+    struct Record
+    {
+        // detects a new object allocated at the address of a freed one
+        std::weak_ptr<const SongObject> object;
+        uint32_t offset; // sample / track / section
+        uint32_t dataOffset; // wave / events
+        Wave wave; // that was written, for samples
+    };
+
+    bool valid {false};
+    Path path;
+    uint64_t fileSize;
+    std::unordered_map<const SongObject *, Record> records;
+    // object order, references are stored as indices
+    vector<std::weak_ptr<const Sample>> sampleOrder;
+    vector<std::weak_ptr<const Section>> sectionOrder;
+};
+
+// encodes a snapshot of a song into memory, then writes it in one pass
 class Writer
 {
 public:
-    Writer(SDL_RWops *stream); // takes ownership of stream
-    ~Writer();
+    // copies the changed objects (locks the song briefly). waves are shared
+    // immutable copies, so the song can be edited before encode().
+    // with a state, dirty flags are cleared, and if the state is valid for
+    // path only changed objects are saved, unless compact is set.
+    // state must not be used by anything else until save()
+    Writer(const Song *song, Path path, SaveState *state = nullptr,
+           bool compact = false);
+
+    bool incremental() const { return append; }
 
-    void writeSong(const Song *song);
+    // can be called from any thread. encodes changed objects in parallel
+    void encode();
+    // call after encode. return false on error (state becomes invalid)
+    // full save: writes a temporary file, then replaces path with it
+    // incremental: appends objects and a directory, then points the header
+    // to the new directory
+    bool save();
 
 private:
-    void writeFloat(float f);
-    void writeString(string s);
-    uint16_t writeObjectType(ObjectType type, uint16_t count); // return count
-
-    // return offset
-    uint32_t writeSongInfo(const Song *song);
-    uint32_t writeSample(shared_ptr<const Sample> sample);
-    uint32_t writeWave(const vector<vector<float>> &wave);
-    uint32_t writeTrack(shared_ptr<const Track> track);
-    uint32_t writeSection(shared_ptr<const Section> section);
-    uint32_t writeEvents(const vector<vector<Event>> &trackEvents);
-
-    SDL_RWops *stream;
-    const Song *song;
+    // find objects that can be reused from the last save
+    void findUnchanged(const vector<bool> &sampleDirty,
+                       const vector<bool> &trackDirty,
+                       const vector<bool> &sectionDirty);
+    void encodeObject(size_t index);
+    // assign offsets to changed objects starting at offset, return the end
+    uint32_t placeObjects(uint32_t offset);
+    uint32_t directorySize() const;
+    void encodeDirectory(ByteWriter &out) const;
+    // stream is at offset
+    bool writeObjects(SDL_RWops *stream, uint32_t offset) const;
+    bool writeFull(uint64_t *fileSize);
+    bool writeAppend(uint64_t *fileSize);
+    void updateState(uint64_t fileSize);
+
+    void encodeSongInfo(ByteWriter &out);
+    void encodeSample(const Sample &sample, ByteWriter &out);
+    void encodeWave(const Wave &wave, vector<uint8_t> &out);
+    void encodeTrack(const Track &track, ByteWriter &out);
+    void encodeSection(const Section &section, ByteWriter &out);
+    void encodeEvents(const Section &section, ByteWriter &out);
+
+    float volume;
+    vector<shared_ptr<const Sample>> samples;
+    vector<Wave> waves; // of samples
+    vector<shared_ptr<const Track>> tracks;
+    vector<shared_ptr<const Section>> sections;
+    // built once instead of searching for every reference
+    std::unordered_map<const Sample *, uint16_t> sampleIndices;
+    std::unordered_map<const Section *, uint16_t> sectionIndices;
+    // copies of changed objects to encode, null if unchanged. references in
+    // them still point to the song's objects
+    vector<unique_ptr<const Sample>> sampleCopies;
+    vector<unique_ptr<const Track>> trackCopies;
+    vector<unique_ptr<const Section>> sectionCopies; // also for events
+
+    Path path;
+    SaveState *state;
+    bool append {false};
+    size_t samplesStart, tracksStart, sectionsStart, eventsStart, wavesStart;
+
+    // in directory order
+    vector<vector<uint8_t>> objects; // encoded if changed
+    vector<bool> changed;
+    vector<uint32_t> offsets;
 };
 
 } // namespace
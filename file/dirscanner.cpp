@@ -0,0 +1,147 @@
+#include "dirscanner.h"
+#include <exception>
+
+namespace chromatracker::file {
+
+const size_t CACHE_SIZE = 256; // listings
+
+DirectoryScanner::DirectoryScanner(const LibraryIndex *index)
+    : index(index)
+{
+    thread = std::thread(&DirectoryScanner::run, this);
+}
+
+DirectoryScanner::~DirectoryScanner()
+{
+    {
+        std::unique_lock lock(mu);
+        stopping = true;
+    }
+    cv.notify_one();
+    thread.join();
+}
+
+void DirectoryScanner::scan(Path path, FileType type)
+{
+    {
+        std::unique_lock lock(mu);
+        this->path = path;
+        this->type = type;
+        request++;
+        current = Listing();
+        complete = false;
+        numDirectoriesTaken = numFilesTaken = 0;
+    }
+    cv.notify_one();
+}
+
+void DirectoryScanner::cancel()
+{
+    std::unique_lock lock(mu);
+    path.clear();
+    request++;
+    current = Listing();
+    complete = true;
+    numDirectoriesTaken = numFilesTaken = 0;
+}
+
+bool DirectoryScanner::update(vector<Path> &directories, vector<Path> &files)
+{
+    std::unique_lock lock(mu);
+    directories.insert(directories.end(),
+                       current.directories.begin() + numDirectoriesTaken,
+                       current.directories.end());
+    files.insert(files.end(),
+                 current.files.begin() + numFilesTaken, current.files.end());
+    numDirectoriesTaken = current.directories.size();
+    numFilesTaken = current.files.size();
+    return complete;
+}
+
+void DirectoryScanner::run()
+{
+    std::unique_lock lock(mu);
+    while (true) {
+        cv.wait(lock, [this] { return stopping || scanned != request; });
+        if (stopping)
+            return;
+        scanned = request;
+        if (path.empty())
+            continue;
+        Path scanPath = path;
+        FileType scanType = type;
+        lock.unlock();
+        try {
+            list(scanPath, scanType, scanned);
+        } catch (std::exception &e) {
+            cout << "Error reading directory: " <<e.what()<< "\n";
+        }
+        lock.lock();
+        if (request == scanned)
+            complete = true; // even if it failed
+    }
+}
+
+void DirectoryScanner::list(const Path &path, FileType type, uint64_t request)
+{
+    std::error_code ec;
+    auto mtime = std::filesystem::last_write_time(path, ec);
+    auto key = std::make_pair(path, type);
+    auto cached = cache.find(key);
+    if (!ec && cached != cache.end() && cached->second.mtime == mtime) {
+        cached->second.lastUsed = ++useCount;
+        std::unique_lock lock(mu);
+        if (this->request == request)
+            current = cached->second;
+        return;
+    }
+    FileInfo info;
+    if (!ec && type == FileType::Sample && typeForPath(path) == FileType::Module
+            && index->find(path, mtime, &info)) {
+        std::unique_lock lock(mu);
+        if (this->request == request) {
+            for (int i = 0; i < info.sampleNames.size(); i++) {
+                current.files.push_back(
+                    moduleSamplePath(path, i, info.sampleNames[i]));
+            }
+        }
+        return;
+    }
+
+    bool cancelled = false;
+    listDirectory(path, type, [&](Path child, bool directory) {
+        std::unique_lock lock(mu);
+        if (this->request != request || stopping) {
+            cancelled = true;
+            return false;
+        }
+        if (directory)
+            current.directories.push_back(child);
+        else
+            current.files.push_back(child);
+        return true;
+    });
+    if (cancelled || ec)
+        return;
+
+    Listing listing;
+    {
+        std::unique_lock lock(mu);
+        if (this->request != request)
+            return;
+        listing = current;
+    }
+    listing.mtime = mtime;
+    listing.lastUsed = ++useCount;
+    cache[key] = std::move(listing);
+    if (cache.size() > CACHE_SIZE) {
+        auto oldest = cache.begin();
+        for (auto it = cache.begin(); it != cache.end(); it++) {
+            if (it->second.lastUsed < oldest->second.lastUsed)
+                oldest = it;
+        }
+        cache.erase(oldest);
+    }
+}
+
+} // namespace
@@ -0,0 +1,66 @@
+#pragma once
+#include <common.h>
+
+#include "libraryindex.h"
+#include "types.h"
+#include <condition_variable>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace chromatracker::file {
+
+// lists directories (see listDirectory) on a background thread, so slow disks
+// and large modules don't block the UI. entries become available as they are
+// read. complete listings are cached until the modification time of the path
+// changes. samples of indexed modules are listed without reading the module
+class DirectoryScanner : noncopyable
+{
+public:
+    DirectoryScanner(const LibraryIndex *index); // starts thread
+    ~DirectoryScanner(); // stops thread
+
+    // replaces (cancels) the current scan
+    void scan(Path path, FileType type);
+    void cancel();
+    // append entries found since the last call, for the current scan.
+    // return true if the scan is complete
+    bool update(vector<Path> &directories, vector<Path> &files);
+
+private:
+    struct Listing
+    {
+        std::filesystem::file_time_type mtime;
+        vector<Path> directories;
+        vector<Path> files;
+        uint64_t lastUsed {0};
+    };
+
+    void run();
+    // fill current, unless another scan is requested
+    void list(const Path &path, FileType type, uint64_t request);
+
+    const LibraryIndex * const index;
+
+    // thread
+    std::map<std::pair<Path, FileType>, Listing> cache;
+    uint64_t useCount {0};
+
+    std::mutex mu; // protects everything below
+    std::condition_variable cv;
+    Path path;
+    FileType type {FileType::Unknown};
+    uint64_t request {0}; // incremented for every scan
+    uint64_t scanned {0}; // last request that was started
+    bool stopping {false};
+    // current scan
+    Listing current;
+    bool complete {true};
+    size_t numDirectoriesTaken {0}, numFilesTaken {0};
+
+    std::thread thread;
+};
+
+} // namespace
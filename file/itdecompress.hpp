@@ -1,12 +1,12 @@
 #pragma once
 #include <common.h>
 
+#include "bytereader.h"
 #include <sample.h>
 #include <units.h>
 #include <algorithm>
 #include <limits>
 #include <stdexcept>
-#include <SDL2/SDL_rwops.h>
 
 namespace chromatracker::file {
 
@@ -37,106 +37,145 @@ struct IT8BitParams
 	static constexpr int8_t defaultWidth = 9;
 };
 
+// reads bit fields from a compressed block, least significant bit first.
+// keeps up to 64 bits in a register so most reads are a shift and a mask
+class ITBitReader
+{
+public:
+    ITBitReader(const uint8_t *data, size_t size)
+        : p(data)
+        , end(data + size)
+    {}
+
+    // up to 31 bits. throws std::runtime_error past the end of the block
+    uint32_t read(int numBits)
+    {
+        if (count < numBits) {
+            refill();
+            if (count < numBits)
+                throw std::runtime_error("Unexpected end of block");
+        }
+        uint32_t value = (uint32_t)bits & ((1u << numBits) - 1);
+        bits >>= numBits;
+        count -= numBits;
+        return value;
+    }
+
+private:
+    void refill()
+    {
+        if (end - p >= 8) {
+            // take as many whole bytes as fit. the bits of the next partial
+            // byte are also copied but they match what the next refill adds
+            uint64_t word = 0;
+            for (int i = 0; i < 8; i++)
+                word |= (uint64_t)p[i] << (i * 8); // becomes a single load
+            bits |= word << count;
+            p += (63 - count) >> 3;
+            count |= 56;
+        } else {
+            while (count <= 56 && p < end) {
+                bits |= (uint64_t)*p++ << count;
+                count += 8;
+            }
+        }
+    }
+
+    const uint8_t *p, *end;
+    uint64_t bits {0};
+    int count {0}; // valid bits
+};
+
 // decompress IT samples
 template<typename Params>
 class ITDecompress
 {
 private:
+    using sample_t = typename Params::sample_t;
     static const int BLOCK_SIZE = 0x8000;
+    static const int BLOCK_FRAMES = BLOCK_SIZE / sizeof(sample_t);
 
-    SDL_RWops *stream;
-    shared_ptr<Sample> sample;
+    ByteReader &reader;
+    vector<vector<float>> &channels;
     const frames numFrames;
     const int numChannels;
     const bool it215;
 
-    unique_ptr<uint8_t[]> block;
-    int bitPos;
-
-    int blockLength;
-    unsigned int mem1, mem2; // integrator memory
+    // deltas of one block, before integrating
+    // (the integrator wraps around like the original)
+    unique_ptr<sample_t[]> deltas;
 
 public:
-    ITDecompress(SDL_RWops *stream, shared_ptr<Sample> sample,
+    ITDecompress(ByteReader &reader, vector<vector<float>> &channels,
                  frames numFrames, int numChannels, bool it215)
-        : stream(stream)
-        , sample(sample)
+        : reader(reader)
+        , channels(channels)
         , numFrames(numFrames)
         , numChannels(numChannels)
         , it215(it215)
+        , deltas(new sample_t[BLOCK_FRAMES])
     {}
 
 private:
-    uint32_t readBits(int numBits)
+    static void changeWidth(int *curWidth, int width)
     {
-        uint32_t value = 0;
-        uint32_t bitCount = 0;
-        while (bitCount < numBits) {
-            uint32_t bitOffset = bitPos % 8;
-            uint32_t readBits = std::min(8 - bitOffset, numBits - bitCount);
-            uint32_t bits = block[bitPos / 8] >> bitOffset;
-            value |= bits << bitCount;
-            bitPos += readBits;
-            bitCount += readBits;
-        }
-        value &= (1 << numBits) - 1;
-        return value;
+        width++;
+        if (width >= *curWidth)
+            width++;
+        setWidth(curWidth, width);
     }
 
-    void write(int v, int topBit, vector<float> &wave)
+    static void setWidth(int *curWidth, int width)
     {
-        if (v & topBit)
-            v -= topBit << 1; // make negative
-        mem1 += v;
-        mem2 += mem1;
-        Params::sample_t val = (int)(it215 ? mem2 : mem1);
-        wave.push_back((float)val / Params::maxVal);
-        blockLength--;
-        if (wave.back() > 1.1 || wave.back() < -1.1) {
-            throw std::runtime_error("it's broken :(");
+        if (width > Params::defaultWidth) {
+            throw std::runtime_error("Invalid bit width");
         }
-    }
-
-    void changeWidth(int *curWidth, int width)
-    {
-        width++;
-        if (width >= *curWidth)
-            width++;
         *curWidth = width;
     }
 
-    void decompressBlock(vector<float> &wave)
+    void decodeBlock(ITBitReader &bits, int length)
     {
-        blockLength = std::min(numFrames - wave.size(),
-                               BLOCK_SIZE / sizeof(Params::sample_t));
-
         int width = Params::defaultWidth;
-        while (blockLength > 0) {
-            if (width > Params::defaultWidth) {
-                throw std::runtime_error("Invalid bit width");
-            }
-
-            int v = readBits(width);
+        int pos = 0;
+        while (pos < length) {
+            int v = bits.read(width);
             int topBit = 1 << (width - 1);
             if (width <= 6) {
                 // Mode A: 1 to 6 bits
-                if (v == topBit)
-                    changeWidth(&width, readBits(Params::fetchA));
-                else
-                    write(v, topBit, wave);
+                if (v == topBit) {
+                    changeWidth(&width, bits.read(Params::fetchA));
+                    continue;
+                }
             } else if (width < Params::defaultWidth) {
                 // Mode B: 7 to 8 / 16 bits
-                if (v >= topBit + Params::lowerB && v <= topBit + Params::upperB)
+                if (v >= topBit + Params::lowerB
+                        && v <= topBit + Params::upperB) {
                     changeWidth(&width, v - (topBit + Params::lowerB));
-                else
-                    write(v, topBit, wave);
+                    continue;
+                }
             } else {
                 // Mode C: 9 / 17 bits
                 if (v & topBit)
-                    width = (v & ~topBit) + 1;
+                    setWidth(&width, (v & ~topBit) + 1);
                 else
-                    write((v & ~topBit), 0, wave);
+                    deltas[pos++] = (sample_t)v;
+                continue;
             }
+            if (v & topBit)
+                v -= topBit << 1; // make negative
+            deltas[pos++] = (sample_t)v;
+        }
+    }
+
+    // IT 2.15 integrates twice
+    template<bool doubleIntegrate>
+    void integrate(float *wave, int length) const
+    {
+        sample_t mem1 = 0, mem2 = 0;
+        for (int i = 0; i < length; i++) {
+            mem1 += deltas[i];
+            mem2 += mem1;
+            wave[i] = (float)(doubleIntegrate ? mem2 : mem1) / Params::maxVal;
         }
     }
 
@@ -144,17 +183,21 @@ public:
     void decompress()
     {
         for (int c = 0; c < numChannels; c++) {
-            vector<float> &wave = sample->channels[c];
-            while (wave.size() < numFrames) {
-                uint16_t compressedSize = SDL_ReadLE16(stream);
+            vector<float> &wave = channels[c];
+            wave.resize(numFrames);
+            frames pos = 0;
+            while (pos < numFrames) {
+                uint16_t compressedSize = reader.le16();
                 if (!compressedSize)
                     continue;
-                block = unique_ptr<uint8_t[]>(new uint8_t[compressedSize]);
-                SDL_RWread(stream, block.get(), 1, compressedSize);
-                bitPos = 0;
-
-                mem1 = mem2 = 0;
-                decompressBlock(wave);
+                ITBitReader bits(reader.bytes(compressedSize), compressedSize);
+                int length = std::min(numFrames - pos, (frames)BLOCK_FRAMES);
+                decodeBlock(bits, length);
+                if (it215)
+                    integrate<true>(&wave[pos], length);
+                else
+                    integrate<false>(&wave[pos], length);
+                pos += length;
             }
         }
     }
@@ -1,6 +1,8 @@
 #include "itloader.h"
 #include "itdecompress.hpp"
+#include <parallel.h>
 #include <stringutil.h>
+#include <algorithm>
 #include <cstring>
 #include <limits>
 #include <stdexcept>
@@ -15,121 +17,156 @@ const ticks IT_TICK_TIME = 8; // chroma ticks per IT tick
 const int MAX_CHANNELS = 64;
 
 const uint32_t INST_SAMPLE_NUM_OFFSET = 0x40 + 2*MIDDLE_C + 1;
+const size_t NAME_LENGTH = 26;
 
-ITLoader::ITLoader(SDL_RWops *stream)
-    : stream(stream)
+// fixed length, null terminated unless it fills the field
+static string readName(ByteReader &reader)
+{
+    auto chars = (const char *)reader.bytes(NAME_LENGTH);
+    return string(chars, strnlen(chars, NAME_LENGTH));
+}
+
+ITLoader::ITLoader(MappedFile *file)
+    : file(file)
+    , reader(file->data(), file->size())
 {
     checkHeader();
     loadObjects();
 }
 
-ITLoader::~ITLoader()
+ByteReader ITLoader::readerAt(uint32_t offset) const
 {
-    SDL_RWclose(stream);
+    ByteReader r(file->data(), file->size());
+    r.seek(offset);
+    return r;
 }
 
 void ITLoader::checkHeader()
 {
-    SDL_RWseek(stream, 0, RW_SEEK_SET);
-    char signature[5]{0};
-    SDL_RWread(stream, signature, 1, 4);
-    if (std::memcmp(signature, "IMPM", 4)) {
+    if (reader.size() < 4 || std::memcmp(reader.bytes(4), "IMPM", 4)) {
         throw std::runtime_error("Unrecognized format");
     }
 
-    SDL_RWseek(stream, 0x2A, RW_SEEK_SET);
-    compatibleVersion = SDL_ReadLE16(stream);
+    reader.seek(0x2A);
+    compatibleVersion = reader.le16();
     if (compatibleVersion < 0x200) {
         throw std::runtime_error("Old IT files (pre 2.00) not supported");
     }
 
-    uint16_t songFlags = SDL_ReadLE16(stream);
+    uint16_t songFlags = reader.le16();
     instrumentMode = songFlags & (1<<2);
 }
 
 void ITLoader::loadObjects()
 {
-    SDL_RWseek(stream, 0x20, RW_SEEK_SET);
-    numOrders = SDL_ReadLE16(stream);
-    numInstruments = SDL_ReadLE16(stream);
-    numSamples = SDL_ReadLE16(stream);
-    numPatterns = SDL_ReadLE16(stream);
+    reader.seek(0x20);
+    numOrders = reader.le16();
+    numInstruments = reader.le16();
+    numSamples = reader.le16();
+    numPatterns = reader.le16();
 
-    SDL_RWseek(stream, 0xC0, RW_SEEK_SET);
+    reader.seek(0xC0);
     orders.reset(new uint8_t[numOrders]);
-    SDL_RWread(stream, orders.get(), 1, numOrders);
+    std::memcpy(orders.get(), reader.bytes(numOrders), numOrders);
     instOffsets.reset(new uint32_t[numInstruments]);
-    SDL_RWread(stream, instOffsets.get(), 4, numInstruments);
+    for (int i = 0; i < numInstruments; i++)
+        instOffsets[i] = reader.le32();
     sampleOffsets.reset(new uint32_t[numSamples]);
-    SDL_RWread(stream, sampleOffsets.get(), 4, numSamples);
+    for (int i = 0; i < numSamples; i++)
+        sampleOffsets[i] = reader.le32();
     patternOffsets.reset(new uint32_t[numPatterns]);
-    SDL_RWread(stream, patternOffsets.get(), 4, numPatterns);
+    for (int i = 0; i < numPatterns; i++)
+        patternOffsets[i] = reader.le32();
+}
+
+void ITLoader::checkCancelled() const
+{
+    if (progress && progress->cancelled)
+        throw LoadCancelled();
+}
+
+void ITLoader::jobDone()
+{
+    size_t done = ++jobsDone;
+    if (progress && numJobs)
+        progress->fraction = (float)done / numJobs;
 }
 
 void ITLoader::loadSong(Song *song)
+{
+    loadStructure(song, nullptr);
+}
+
+void ITLoader::loadStructure(Song *song, LoadProgress *progress)
 {
     this->song = song;
+    this->progress = progress;
+    numJobs = numSamples + (instrumentMode ? numInstruments : 0) + numPatterns;
+    jobsDone = 0;
 
     auto firstSection = song->sections.emplace_back(new Section);
 
-    char songName[27]{0};
-    SDL_RWseek(stream, 0x04, RW_SEEK_SET);
-    SDL_RWread(stream, songName, 1, 26);
-    firstSection->title = string(songName);
+    reader.seek(0x04);
+    firstSection->title = readName(reader);
 
     // highlight information (not used for playback)
-    uint8_t rowsPerBeat = SDL_ReadU8(stream);
-    uint8_t rowsPerMeasure = SDL_ReadU8(stream);
+    uint8_t rowsPerBeat = reader.u8();
+    uint8_t rowsPerMeasure = reader.u8();
     if (rowsPerMeasure % rowsPerBeat == 0) {
         firstSection->meter = rowsPerMeasure / rowsPerBeat;
     }
 
-    SDL_RWseek(stream, 0x30, RW_SEEK_SET);
-    uint8_t globalVolume = SDL_ReadU8(stream);
-    uint8_t mixVolume = SDL_ReadU8(stream);
+    reader.seek(0x30);
+    uint8_t globalVolume = reader.u8();
+    uint8_t mixVolume = reader.u8();
     song->volume = (globalVolume / 128.0f) * (mixVolume / 128.0f);
 
-    ticksPerRow = SDL_ReadU8(stream);
-    uint8_t initialTempo = SDL_ReadU8(stream);
+    ticksPerRow = reader.u8();
+    uint8_t initialTempo = reader.u8();
     firstSection->tempo = initialTempo;
 
     // for now add all 64 tracks (will be reduced later)
     song->tracks.reserve(MAX_CHANNELS);
-    SDL_RWseek(stream, 0x40, RW_SEEK_SET);
+    reader.seek(0x40);
     for (int i = 0; i < MAX_CHANNELS; i++) {
         auto track = song->tracks.emplace_back(new Track);
-        uint8_t pan = SDL_ReadU8(stream);
+        uint8_t pan = reader.u8();
         track->mute = pan & 0x80;
         pan &= 0x7f;
         if (pan <= 64)
             track->pan = (pan - 32) / 32.0f; // TODO fix units and amplitude
     }
     for (auto &track : song->tracks) {
-        uint8_t vol = SDL_ReadU8(stream);
+        uint8_t vol = reader.u8();
         track->volume = vol / 64.0f;
     }
 
-    for (int i = 0; i < numSamples; i++) {
-        shared_ptr<Sample> sample;
-        InstrumentExtra *extra;
-        if (!instrumentMode) {
-            sample = song->samples.emplace_back(new Sample);
-            extra = &instrumentExtras.emplace_back();
-        } else {
-            sample = itSamples.emplace_back(new Sample);
-            extra = &itSampleExtras.emplace_back();
-        }
-        loadITSample(sampleOffsets[i], sample, extra);
-    }
+    // create all objects first, then decode them independently. each job only
+    // writes to its own sample and extra
+    auto &loadSamples = instrumentMode ? itSamples : song->samples;
+    auto &loadExtras = instrumentMode ? itSampleExtras : instrumentExtras;
+    loadSamples.reserve(numSamples);
+    for (int i = 0; i < numSamples; i++)
+        loadSamples.emplace_back(new Sample);
+    loadExtras.resize(numSamples);
+    parallelFor(numSamples, [&](size_t i) {
+        checkCancelled();
+        loadITSample(sampleOffsets[i], loadSamples[i], &loadExtras[i]);
+        jobDone();
+    });
 
     if (instrumentMode) {
         song->samples.reserve(numInstruments);
-        instrumentExtras.reserve(numInstruments);
-        for (int i = 0; i < numInstruments; i++) {
-            auto sample = song->samples.emplace_back(new Sample);
-            InstrumentExtra *extra = &instrumentExtras.emplace_back();
-            loadInstrument(instOffsets[i], sample, extra);
-        }
+        for (int i = 0; i < numInstruments; i++)
+            song->samples.emplace_back(new Sample);
+        instrumentExtras.resize(numInstruments);
+        // only reads itSamples
+        parallelFor(numInstruments, [&](size_t i) {
+            checkCancelled();
+            loadInstrument(instOffsets[i], song->samples[i],
+                           &instrumentExtras[i]);
+            jobDone();
+        });
     }
 
     // add names and colors to samples
@@ -140,9 +177,9 @@ void ITLoader::loadSong(Song *song)
         sample->color = glm::rgbColor(
             glm::vec3((float)i / song->samples.size() * 360.0f, 1, 1));
     }
-    offsetSamples.resize(song->samples.size());
 
-    song->sections.reserve(numOrders);
+    vector<int> sectionPatterns;
+    sectionPatterns.reserve(numOrders);
     for (int i = 0; i < numOrders; i++) {
         int order = orders[i];
         if (order == 255) {
@@ -152,7 +189,26 @@ void ITLoader::loadSong(Song *song)
         } else if (order >= numPatterns) {
             throw std::runtime_error("Order out of range");
         }
+        sectionPatterns.push_back(order);
+    }
 
+    // decode each pattern once, in order of first use
+    vector<Pattern> patterns(numPatterns);
+    for (int order : sectionPatterns) {
+        Pattern &pattern = patterns[order];
+        if (pattern.uses++ == 0) {
+            checkCancelled();
+            loadPattern(patternOffsets[order], &pattern);
+            jobDone();
+        }
+    }
+    for (auto &pattern : patterns) {
+        if (pattern.uses)
+            pattern.trackEvents.resize(maxUsedChannel + 1);
+    }
+
+    song->sections.reserve(sectionPatterns.size());
+    for (int i = 0; i < sectionPatterns.size(); i++) {
         shared_ptr<Section> section;
         if (i == 0) {
             section = firstSection;
@@ -161,24 +217,22 @@ void ITLoader::loadSong(Song *song)
             section = song->sections.emplace_back(new Section);
             prevSection->next = section;
         }
-        section->trackEvents.resize(MAX_CHANNELS);
 
-        uint32_t patternOffset = patternOffsets[order];
-        if (patternOffset == 0) { // empty
-            section->length = 64 * (int)ticksPerRow * IT_TICK_TIME;
-        } else {
-            // TODO: inefficient, can load the same pattern many times
-            loadPattern(patternOffset, section);
-        }
+        Pattern &pattern = patterns[sectionPatterns[i]];
+        section->length = pattern.length;
+        if (--pattern.uses == 0) // last section can take the events
+            section->trackEvents = std::move(pattern.trackEvents);
+        else
+            section->trackEvents = pattern.trackEvents;
     }
 
     song->tracks.erase(song->tracks.begin() + (maxUsedChannel + 1),
                        song->tracks.end());
-    for (auto &section : song->sections) {
-        section->trackEvents.erase(
-            section->trackEvents.begin() + (maxUsedChannel + 1),
-            section->trackEvents.end());
-    }
+    if (sectionPatterns.empty())
+        firstSection->trackEvents.resize(song->tracks.size());
+    if (progress)
+        progress->fraction = 1; // unused patterns aren't decoded
+    this->progress = nullptr;
 }
 
 vector<string> ITLoader::listSamples()
@@ -186,11 +240,9 @@ vector<string> ITLoader::listSamples()
     vector<string> sampleNames;
     sampleNames.reserve(numSamples);
     for (int i = 0; i < numSamples; i++) {
-        checkSampleHeader(sampleOffsets[i]);
-        SDL_RWseek(stream, sampleOffsets[i] + 0x14, RW_SEEK_SET);
-        char nameBuf[27]{0};
-        SDL_RWread(stream, nameBuf, 1, 26);
-        sampleNames.push_back(nameBuf);
+        ByteReader sampleReader = checkSampleHeader(sampleOffsets[i]);
+        sampleReader.seek(sampleOffsets[i] + 0x14);
+        sampleNames.push_back(readName(sampleReader));
     }
     if (!instrumentMode) {
         return sampleNames;
@@ -199,14 +251,11 @@ vector<string> ITLoader::listSamples()
     vector<string> instrumentNames;
     instrumentNames.reserve(numInstruments);
     for (int i = 0; i < numInstruments; i++) {
-        checkInstrumentHeader(instOffsets[i]);
-        SDL_RWseek(stream, instOffsets[i] + INST_SAMPLE_NUM_OFFSET,
-                   RW_SEEK_SET);
-        uint8_t sampleNum = SDL_ReadU8(stream);
-        SDL_RWseek(stream, instOffsets[i] + 0x20, RW_SEEK_SET);
-        char nameBuf[27]{0};
-        SDL_RWread(stream, nameBuf, 1, 26);
-        string name = nameBuf;
+        ByteReader instReader = checkInstrumentHeader(instOffsets[i]);
+        instReader.seek(instOffsets[i] + INST_SAMPLE_NUM_OFFSET);
+        uint8_t sampleNum = instReader.u8();
+        instReader.seek(instOffsets[i] + 0x20);
+        string name = readName(instReader);
         if (!name.empty()) {
             instrumentNames.push_back(name);
         } else if (sampleNum != 0 && sampleNum <= sampleNames.size()) {
@@ -218,6 +267,48 @@ vector<string> ITLoader::listSamples()
     return instrumentNames;
 }
 
+FileInfo ITLoader::loadInfo()
+{
+    FileInfo info;
+    reader.seek(0x04);
+    info.title = readName(reader);
+    info.sampleNames = listSamples();
+
+    reader.seek(0x32);
+    ticksPerRow = reader.u8();
+    uint8_t initialTempo = reader.u8();
+
+    int rows = 0;
+    vector<bool> scanned(numPatterns, false);
+    for (int i = 0; i < numOrders; i++) {
+        int order = orders[i];
+        if (order == 255)
+            break;
+        else if (order == 254)
+            continue;
+        else if (order >= numPatterns)
+            throw std::runtime_error("Order out of range");
+        uint32_t offset = patternOffsets[order];
+        if (offset == 0) { // empty
+            rows += 64;
+            continue;
+        }
+        ByteReader patternReader = readerAt(offset + 2);
+        rows += patternReader.le16();
+        if (!scanned[order]) {
+            scanned[order] = true;
+            info.numChannels = std::max(info.numChannels,
+                                        patternChannels(offset));
+        }
+    }
+    // tempo changes are ignored
+    if (initialTempo != 0) {
+        ticks length = rows * (int)ticksPerRow * IT_TICK_TIME;
+        info.seconds = (float)length / TICKS_PER_BEAT * 60 / initialTempo;
+    }
+    return info;
+}
+
 void ITLoader::loadSample(int index, shared_ptr<Sample> sample)
 {
     if (!instrumentMode) {
@@ -234,46 +325,42 @@ void ITLoader::loadSample(int index, shared_ptr<Sample> sample)
 }
 
 template<typename T>
-void loadWave(SDL_RWops *stream, shared_ptr<Sample> sample,
+void loadWave(ByteReader &reader, vector<vector<float>> &channels,
               frames numFrames, int numChannels)
 {
-    int numSamples = numFrames * numChannels;
-    unique_ptr<T[]> data(new T[numSamples]);
-    // TODO endianess
-    SDL_RWread(stream, data.get(), sizeof(T), numSamples);
-
+    const uint8_t *read = reader.bytes((size_t)numFrames * numChannels
+                                       * sizeof(T));
     std::numeric_limits<T> limits;
-    T *read = &data[0];
     for (int c = 0; c < numChannels; c++) {
-        for (frames f = 0; f < numFrames; f++, read++) {
-            float value = (float)(*read) / limits.max();
+        for (frames f = 0; f < numFrames; f++, read += sizeof(T)) {
+            T v = sizeof(T) == 1 ? read[0] : read[0] | (read[1] << 8);
+            float value = (float)v / limits.max();
             if (!limits.is_signed)
                 value = value * 2 - 1;
-            sample->channels[c].push_back(value);
+            channels[c].push_back(value);
         }
     }
 }
 
-void ITLoader::checkSampleHeader(uint32_t offset)
+ByteReader ITLoader::checkSampleHeader(uint32_t offset) const
 {
-    SDL_RWseek(stream, offset, RW_SEEK_SET);
-    char signature[5]{0};
-    SDL_RWread(stream, signature, 1, 4);
-    if (std::memcmp(signature, "IMPS", 4)) {
+    ByteReader sampleReader = readerAt(offset);
+    if (std::memcmp(sampleReader.bytes(4), "IMPS", 4)) {
         throw std::runtime_error("Invalid sample header");
     }
+    return sampleReader;
 }
 
 void ITLoader::loadITSample(uint32_t offset, shared_ptr<Sample> sample,
                             InstrumentExtra *extra)
 {
-    checkSampleHeader(offset);
+    ByteReader reader = checkSampleHeader(offset);
 
-    SDL_RWseek(stream, offset + 0x11, RW_SEEK_SET);
-    uint8_t globalVolume = SDL_ReadU8(stream);
+    reader.seek(offset + 0x11);
+    uint8_t globalVolume = reader.u8();
     sample->volume = globalVolume / 64.0f;
 
-    uint8_t flags = SDL_ReadU8(stream);
+    uint8_t flags = reader.u8();
     bool bit16 = flags & (1<<1);
     bool stereo = flags & (1<<2);
     bool compressed = flags & (1<<3);
@@ -291,26 +378,24 @@ void ITLoader::loadITSample(uint32_t offset, shared_ptr<Sample> sample,
         sample->loopMode = Sample::LoopMode::Once;
     }
 
-    extra->defaultVolume = SDL_ReadU8(stream);
+    extra->defaultVolume = reader.u8();
 
-    char nameBuf[27]{0};
-    SDL_RWread(stream, nameBuf, 1, 26);
-    sample->name = nameBuf;
+    sample->name = readName(reader);
 
-    uint8_t convertFlags = SDL_ReadU8(stream);
+    uint8_t convertFlags = reader.u8();
     bool signedSamples = convertFlags & (1<<0);
 
-    SDL_RWseek(stream, offset + 0x30, RW_SEEK_SET);
-    uint32_t numFrames = SDL_ReadLE32(stream);
-    uint32_t loopStart = SDL_ReadLE32(stream);
-    uint32_t loopEnd = SDL_ReadLE32(stream);
+    reader.seek(offset + 0x30);
+    uint32_t numFrames = reader.le32();
+    uint32_t loopStart = reader.le32();
+    uint32_t loopEnd = reader.le32();
     
     // ITTECH seems to be wrong, this is frames per second, not bytes
-    uint32_t c5speed = SDL_ReadLE32(stream);
+    uint32_t c5speed = reader.le32();
     sample->frameRate = c5speed;
 
-    uint32_t susLoopStart = SDL_ReadLE32(stream);
-    uint32_t susLoopEnd = SDL_ReadLE32(stream);
+    uint32_t susLoopStart = reader.le32();
+    uint32_t susLoopEnd = reader.le32();
     if (hasSusLoop) {
         sample->loopStart = susLoopStart;
         sample->loopEnd = susLoopEnd;
@@ -322,57 +407,59 @@ void ITLoader::loadITSample(uint32_t offset, shared_ptr<Sample> sample,
         sample->loopEnd = numFrames;
     }
 
-    uint32_t samplePointer = SDL_ReadLE32(stream);
-    SDL_RWseek(stream, samplePointer, RW_SEEK_SET);
+    uint32_t samplePointer = reader.le32();
+    reader.seek(samplePointer);
+    // compressed samples use at least 1 bit per frame
+    if (numFrames > (uint64_t)(reader.size() - reader.tell()) * 8)
+        throw std::runtime_error("Invalid sample length");
 
     int numChannels = stereo ? 2 : 1;
-    sample->channels.reserve(numChannels);
-    for (int i = 0; i < numChannels; i++) {
-        sample->channels.emplace_back().reserve(numFrames);
+    vector<vector<float>> channels(numChannels);
+    for (auto &channel : channels) {
+        channel.reserve(numFrames);
     }
 
     bool it215 = compatibleVersion >= 0x215;
     if (bit16) {
         if (compressed)
-            ITDecompress<IT16BitParams>(stream, sample, numFrames, numChannels,
-                                        it215).decompress();
+            ITDecompress<IT16BitParams>(reader, channels, numFrames,
+                                        numChannels, it215).decompress();
         else if (signedSamples)
-            loadWave<int16_t>(stream, sample, numFrames, numChannels);
+            loadWave<int16_t>(reader, channels, numFrames, numChannels);
         else
-            loadWave<uint16_t>(stream, sample, numFrames, numChannels);
+            loadWave<uint16_t>(reader, channels, numFrames, numChannels);
     } else {
         if (compressed)
-            ITDecompress<IT8BitParams>(stream, sample, numFrames, numChannels,
-                                       it215).decompress();
+            ITDecompress<IT8BitParams>(reader, channels, numFrames,
+                                       numChannels, it215).decompress();
         else if (signedSamples)
-            loadWave<int8_t>(stream, sample, numFrames, numChannels);
+            loadWave<int8_t>(reader, channels, numFrames, numChannels);
         else
-            loadWave<uint8_t>(stream, sample, numFrames, numChannels);
+            loadWave<uint8_t>(reader, channels, numFrames, numChannels);
     }
+    sample->wave = Wave(std::move(channels));
 
     sample->fadeOut = 1.0f; // will be overridden by instruments
 }
 
-void ITLoader::checkInstrumentHeader(uint32_t offset)
+ByteReader ITLoader::checkInstrumentHeader(uint32_t offset) const
 {
-    SDL_RWseek(stream, offset, RW_SEEK_SET);
-    char signature[5]{0};
-    SDL_RWread(stream, signature, 1, 4);
-    if (std::memcmp(signature, "IMPI", 4)) {
+    ByteReader instReader = readerAt(offset);
+    if (std::memcmp(instReader.bytes(4), "IMPI", 4)) {
         throw std::runtime_error("Invalid instrument header");
     }
+    return instReader;
 }
 
 void ITLoader::loadInstrument(uint32_t offset, shared_ptr<Sample> sample,
                               InstrumentExtra *extra)
 {
-    SDL_RWseek(stream, offset, RW_SEEK_SET);
-    checkInstrumentHeader(offset);
+    ByteReader reader = checkInstrumentHeader(offset);
 
     // get the sample associated with middle c
     // TODO also get note and transpose
-    SDL_RWseek(stream, offset + INST_SAMPLE_NUM_OFFSET, RW_SEEK_SET);
-    uint8_t sampleNum = SDL_ReadU8(stream);
+    reader.seek(offset + INST_SAMPLE_NUM_OFFSET);
+    uint8_t sampleNum = reader.u8();
     if (sampleNum == 0 || sampleNum > numSamples) {
         return;
     }
@@ -381,48 +468,47 @@ void ITLoader::loadInstrument(uint32_t offset, shared_ptr<Sample> sample,
         // probably loading single instrument
         loadITSample(sampleOffsets[sampleNum - 1], sample, extra);
     } else {
-        // copies wave
+        // shares wave
         *sample = *(itSamples[sampleNum - 1]);
         *extra = itSampleExtras[sampleNum - 1];
     }
 
-    SDL_RWseek(stream, offset + 0x14, RW_SEEK_SET);
-    uint16_t fadeOut = SDL_ReadLE16(stream);
+    reader.seek(offset + 0x14);
+    uint16_t fadeOut = reader.le16();
     float fadeTime = 1024.0 / fadeOut; // time to fade to zero in IT ticks
 
-    SDL_RWseek(stream, offset + 0x18, RW_SEEK_SET);
-    uint8_t globalVolume = SDL_ReadU8(stream);
+    reader.seek(offset + 0x18);
+    uint8_t globalVolume = reader.u8();
     sample->volume *= globalVolume / 128.0f;
 
-    SDL_RWseek(stream, offset + 0x20, RW_SEEK_SET);
-    char nameBuf[27]{0};
-    SDL_RWread(stream, nameBuf, 1, 26);
-    string name = nameBuf;
+    reader.seek(offset + 0x20);
+    string name = readName(reader);
     if (!name.empty()) // otherwise keep sample name
-        sample->name = nameBuf;
+        sample->name = name;
     
     // volume envelope
-    SDL_RWseek(stream, offset + 0x130, RW_SEEK_SET);
-    uint8_t volEnvFlags = SDL_ReadU8(stream);
+    reader.seek(offset + 0x130);
+    uint8_t volEnvFlags = reader.u8();
     bool volEnvEnable = volEnvFlags & (1<<0);
     if (volEnvEnable) {
         bool envSustain = volEnvFlags & (1<<2);
         if (!envSustain)
             extra->autoFade = true;
 
-        uint8_t numNodes = SDL_ReadU8(stream);
-        SDL_RWseek(stream, 3, RW_SEEK_CUR); // TODO clean up SEEK_CUR
-        uint8_t susLoopEnd = SDL_ReadU8(stream);
+        uint8_t numNodes = reader.u8();
+        reader.seek(offset + 0x135);
+        uint8_t susLoopEnd = reader.u8();
 
-        // skip to last node
-        SDL_RWseek(stream, 3 * (numNodes - 1), RW_SEEK_CUR);
-        uint8_t lastNodeY = SDL_ReadU8(stream);
-        uint16_t lastNodeTime = SDL_ReadLE16(stream);
+        // nodes are 3 bytes: y value, 16-bit time
+        const uint32_t nodesOffset = offset + 0x136;
+        reader.seek(nodesOffset + 3 * (numNodes - 1)); // last node
+        uint8_t lastNodeY = reader.u8();
+        uint16_t lastNodeTime = reader.le16();
 
         uint16_t loopEndTime = 0;
         if (envSustain) {
-            SDL_RWseek(stream, 3 * (susLoopEnd - numNodes) + 1, RW_SEEK_CUR);
-            loopEndTime = SDL_ReadLE16(stream);
+            reader.seek(nodesOffset + 3 * susLoopEnd + 1);
+            loopEndTime = reader.le16();
         }
 
         if (lastNodeY == 0) {
@@ -436,13 +522,20 @@ void ITLoader::loadInstrument(uint32_t offset, shared_ptr<Sample> sample,
     sample->fadeOut = 1 / fadeTime / IT_TICK_TIME;
 }
 
-void ITLoader::loadPattern(uint32_t offset, shared_ptr<Section> section)
+void ITLoader::loadPattern(uint32_t offset, Pattern *pattern)
 {
-    SDL_RWseek(stream, offset, RW_SEEK_SET);
-    uint16_t packedLength = SDL_ReadLE16(stream);
-    uint16_t numRows = SDL_ReadLE16(stream);
-    section->length = numRows * (int)ticksPerRow * IT_TICK_TIME;
-    SDL_RWseek(stream, offset + 0x08, RW_SEEK_SET);
+    pattern->trackEvents.resize(MAX_CHANNELS);
+    if (offset == 0) { // empty
+        pattern->length = 64 * (int)ticksPerRow * IT_TICK_TIME;
+        return;
+    }
+
+    ByteReader reader = readerAt(offset);
+    uint16_t packedLength = reader.le16();
+    uint16_t numRows = reader.le16();
+    pattern->length = numRows * (int)ticksPerRow * IT_TICK_TIME;
+    reader.seek(offset + 0x08);
+    ByteReader packed(reader.bytes(packedLength), packedLength);
 
     struct PatternCell {
         int note{-1}; // -1 = no note!
@@ -453,12 +546,11 @@ void ITLoader::loadPattern(uint32_t offset, shared_ptr<Section> section)
     };
 
     // https://github.com/schismtracker/schismtracker/wiki/ITTECH.TXT#impulse-pattern-format
-    int pos = 0;
     int row = 0;
     vector<uint8_t> channelMasks(MAX_CHANNELS, 0);
     vector<PatternCell> channelCells(MAX_CHANNELS);
-    while (pos < packedLength) {
-        uint8_t channelVar = SDL_ReadU8(stream); pos++;
+    while (packed.tell() < packed.size()) {
+        uint8_t channelVar = packed.u8();
         if (channelVar == 0) {
             row++;
             continue;
@@ -475,7 +567,7 @@ void ITLoader::loadPattern(uint32_t offset, shared_ptr<Section> section)
         }
 
         if (channelVar & 0x80) {
-            channelMasks[channelNum] = SDL_ReadU8(stream); pos++;
+            channelMasks[channelNum] = packed.u8();
         }
         uint8_t mask = channelMasks[channelNum];
 
@@ -483,27 +575,27 @@ void ITLoader::loadPattern(uint32_t offset, shared_ptr<Section> section)
         PatternCell cell;
         PatternCell *cellMemory = &channelCells[channelNum];
         if (mask & 1) {
-            cell.note = SDL_ReadU8(stream); pos++;
+            cell.note = packed.u8();
             cellMemory->note = cell.note;
         } else if (mask & 0x10) {
             cell.note = cellMemory->note;
         }
         if (mask & 2) {
-            cell.instrument = SDL_ReadU8(stream); pos++;
+            cell.instrument = packed.u8();
             cellMemory->instrument = cell.instrument;
         } else if (mask & 0x20) {
             cell.instrument = cellMemory->instrument;
         }
         if (mask & 4) {
-            cell.volume = SDL_ReadU8(stream); pos++;
+            cell.volume = packed.u8();
             cellMemory->volume = cell.volume;
         } else if (mask & 0x40) {
             cell.volume = cellMemory->volume;
         }
         if (mask & 8) {
-            cell.command = SDL_ReadU8(stream); pos++;
+            cell.command = packed.u8();
             cellMemory->command = cell.command;
-            cell.commandValue = SDL_ReadU8(stream); pos++;
+            cell.commandValue = packed.u8();
             cellMemory->commandValue = cell.commandValue;
         } else if (mask & 0x80) {
             cell.command = cellMemory->command;
@@ -512,13 +604,14 @@ void ITLoader::loadPattern(uint32_t offset, shared_ptr<Section> section)
 
         uint8_t cmdNibble1 = cell.commandValue >> 4;
         uint8_t cmdNibble2 = cell.commandValue & 0xf;
+        bool validInstrument = cell.instrument > 0
+            && cell.instrument <= song->samples.size();
         Event event;
         event.time = row * (int)ticksPerRow * IT_TICK_TIME;
         // set sample/special
         if (cell.note >= 120 && cell.note != 254) {
             event.special = Event::Special::FadeOut;
-        } else if (cell.instrument > 0
-                && cell.instrument <= song->samples.size()) {
+        } else if (validInstrument) {
             if (!((cell.volume >= 193 && cell.volume <= 202)
                    || cell.command == 7)) // no portamento
                 event.sample = song->samples[cell.instrument - 1];
@@ -543,27 +636,27 @@ void ITLoader::loadPattern(uint32_t offset, shared_ptr<Section> section)
             if (cmdNibble1 == 0xD) {
                 event.time += (frames)cmdNibble2 * IT_TICK_TIME;
             }
-        } else if (cell.instrument > 0 && cell.command == 15) { // Oxx
-            event.sample = getOffsetSample(cell.instrument - 1,
-                                           cell.commandValue);
+        } else if (validInstrument && cell.command == 15) { // Oxx
+            event.sample = song->samples[cell.instrument - 1];
+            event.offset = cell.commandValue * 256;
         }
 
         if (!event.empty()) {
-            section->trackEvents[channelNum].push_back(event);
+            pattern->trackEvents[channelNum].push_back(event);
         }
 
         if (cell.command == 19 && cmdNibble1 == 0xC) { // SCx
             Event cutEvent;
             cutEvent.time = event.time + (frames)cmdNibble2 * IT_TICK_TIME;
             cutEvent.velocity = 0;
-            section->trackEvents[channelNum].push_back(cutEvent);
+            pattern->trackEvents[channelNum].push_back(cutEvent);
         } else if (cell.command == 17) { // Qxy
             if (cmdNibble2 != 0) {
                 Event retriggerEvent = event;
                 for (int i = cmdNibble2; i < ticksPerRow; i += cmdNibble2) {
                     retriggerEvent.time = event.time + i * IT_TICK_TIME;
                     // TODO volume change
-                    section->trackEvents[channelNum].push_back(retriggerEvent);
+                    pattern->trackEvents[channelNum].push_back(retriggerEvent);
                 }
             }
         }
@@ -571,33 +664,35 @@ void ITLoader::loadPattern(uint32_t offset, shared_ptr<Section> section)
     }
 }
 
-shared_ptr<Sample> ITLoader::getOffsetSample(int i, int value)
+int ITLoader::patternChannels(uint32_t offset) const
 {
-    if (offsetSamples[i].count(value))
-        return offsetSamples[i][value];
-    frames offset = value * 256;
-    auto source = song->samples[i];
-    if (source->channels.size() == 0 || source->channels[0].size() < offset)
-        return source;
-
-    auto sample = song->samples.emplace_back(new Sample);
-    offsetSamples[i][value] = sample;
-    *sample = *source;
-
-    sample->name += " O" + leftPad(toUpper(hex(value)), 2);
-    for (auto &channel : sample->channels) {
-        channel.erase(channel.begin(), channel.begin() + offset);
-    }
-    if (sample->loopStart >= offset)
-        sample->loopStart -= offset;
-    else
-        sample->loopStart = 0;
-    if (sample->loopEnd >= offset)
-        sample->loopEnd -= offset;
-    else
-        sample->loopEnd = 0;
+    ByteReader reader = readerAt(offset);
+    uint16_t packedLength = reader.le16();
+    reader.seek(offset + 0x08);
+    ByteReader packed(reader.bytes(packedLength), packedLength);
+
+    // same format as loadPattern, only skips over the cell values
+    int numChannels = 0;
+    uint8_t channelMasks[MAX_CHANNELS] {};
+    while (packed.tell() < packed.size()) {
+        uint8_t channelVar = packed.u8();
+        if (channelVar == 0)
+            continue;
+        int channelNum = channelVar & 0x7f;
+        if (channelNum > 0)
+            channelNum--;
+        if (channelNum >= MAX_CHANNELS)
+            throw std::runtime_error("Exceeded maximum channels");
+        numChannels = std::max(numChannels, channelNum + 1);
 
-    return sample;
+        if (channelVar & 0x80)
+            channelMasks[channelNum] = packed.u8();
+        uint8_t mask = channelMasks[channelNum];
+        // note, instrument, volume, command + value
+        packed.skip((mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1)
+                    + ((mask & 8) ? 2 : 0));
+    }
+    return numChannels;
 }
 
 } // namespace
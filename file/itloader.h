@@ -1,22 +1,25 @@
 #pragma once
 #include <common.h>
 
+#include "bytereader.h"
+#include "mappedfile.h"
 #include "types.h"
 #include <song.h>
-#include <unordered_map>
-#include <SDL2/SDL_rwops.h>
+#include <atomic>
 
 namespace chromatracker::file {
 
 class ITLoader : public ModuleLoader
 {
 public:
-    ITLoader(SDL_RWops *stream); // takes ownership of stream
-    ~ITLoader();
+    ITLoader(MappedFile *file); // takes ownership
 
     void loadSong(Song *song) override;
+    // waves are decoded with the structure
+    void loadStructure(Song *song, LoadProgress *progress) override;
     vector<string> listSamples() override;
     void loadSample(int index, shared_ptr<Sample> sample) override;
+    FileInfo loadInfo() override;
 
 private:
     struct InstrumentExtra
@@ -25,20 +28,36 @@ private:
         bool autoFade = false;
     };
 
+    // decoded once and copied to every section that plays it. sections own
+    // their events, so memory still grows with the length of the order list,
+    // and copying an event updates the weak count of its sample
+    struct Pattern
+    {
+        ticks length {0};
+        vector<vector<Event>> trackEvents;
+        int uses {0}; // remaining sections
+    };
+
     void checkHeader();
     void loadObjects();
+    void checkCancelled() const; // throws
+    void jobDone(); // thread safe
+    // independent of the member reader
+    ByteReader readerAt(uint32_t offset) const;
 
     void loadITSample(uint32_t offset, shared_ptr<Sample> sample,
                       InstrumentExtra *extra);
-    void checkSampleHeader(uint32_t offset);
+    // return a reader positioned after the signature
+    ByteReader checkSampleHeader(uint32_t offset) const;
     void loadInstrument(uint32_t offset,
                         shared_ptr<Sample> sample, InstrumentExtra *extra);
-    void checkInstrumentHeader(uint32_t offset);
-    void loadPattern(uint32_t offset, shared_ptr<Section> section);
-    
-    shared_ptr<Sample> getOffsetSample(int i, int value);
+    ByteReader checkInstrumentHeader(uint32_t offset) const;
+    void loadPattern(uint32_t offset, Pattern *pattern);
+    // without decoding events
+    int patternChannels(uint32_t offset) const;
 
-    SDL_RWops *stream;
+    unique_ptr<MappedFile> file;
+    ByteReader reader; // over the whole file
 
     Song *song;
     uint16_t compatibleVersion;
@@ -51,10 +70,14 @@ private:
     vector<shared_ptr<Sample>> itSamples;
     vector<InstrumentExtra> itSampleExtras;
     vector<InstrumentExtra> instrumentExtras;
-    vector<std::unordered_map<frames, shared_ptr<Sample>>> offsetSamples;
 
     uint8_t ticksPerRow;
     int maxUsedChannel = 0;
+
+    LoadProgress *progress {nullptr}; // null if not reported
+    // samples, instruments and patterns, for progress
+    size_t numJobs {0};
+    std::atomic<size_t> jobsDone {0};
 };
 
 } // namespace
@@ -0,0 +1,460 @@
+#include "journal.h"
+#include "bytereader.h"
+#include "bytewriter.h"
+#include "chromaloader.h"
+#include "mappedfile.h"
+#include <edit/opstream.h>
+#include <edit/songops.h>
+#include <version.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+namespace chromatracker::file {
+
+const char JOURNAL_MAGIC[4] = {'C', 'H', 'J', 'R'};
+const size_t RECORD_HEADER_SIZE = 5;
+const auto CHECKPOINT_INTERVAL = std::chrono::minutes(2);
+const uint64_t CHECKPOINT_JOURNAL_SIZE = 16 << 20;
+const char LOCK_NAME[] = "lock";
+const int MAX_SESSIONS = 1000;
+
+Journal::Journal(Path dir, edit::Undoer<Song *> *undoer)
+    : dir(dir)
+    , undoer(undoer)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    if (ec)
+        cout << "Error creating journal directory: " <<ec.message()<< "\n";
+    // a new directory can't belong to another instance. it could be removed
+    // by one before it's locked, then try the next
+    for (int n = 0; n < MAX_SESSIONS && !sessionLock; n++) {
+        Path path = dir / std::to_string(n);
+        if (!std::filesystem::create_directory(path, ec)) {
+            if (ec)
+                break;
+            continue; // exists
+        }
+        sessionLock.reset(LockFile::tryLock(path / LOCK_NAME));
+        if (sessionLock)
+            sessionDir = path;
+    }
+    if (!sessionLock)
+        cout << "Error creating journal session, journal disabled\n";
+    thread = std::thread(&Journal::run, this);
+}
+
+Journal::~Journal()
+{
+    {
+        std::unique_lock lock(mu);
+        stopping = true;
+    }
+    cv.notify_one();
+    thread.join();
+    if (file)
+        std::fclose(file);
+    // nothing to recover after a clean exit
+    if (sessionLock)
+        removeSession(sessionDir, std::move(sessionLock));
+}
+
+Path Journal::checkpointPath(const Path &session, int generation)
+{
+    return session / (std::to_string(generation) + ".chroma");
+}
+
+Path Journal::journalPath(const Path &session, int generation)
+{
+    return session / (std::to_string(generation) + ".journal");
+}
+
+int Journal::lastGeneration(const Path &session, bool withCheckpoint)
+{
+    int last = -1;
+    std::error_code ec;
+    for (auto &entry : std::filesystem::directory_iterator(session, ec)) {
+        Path path = entry.path();
+        if (withCheckpoint && path.extension() != ".chroma")
+            continue;
+        try {
+            last = std::max(last, std::stoi(path.stem().string()));
+        } catch (std::logic_error &) {} // not a number
+    }
+    return last;
+}
+
+void Journal::removeSession(const Path &session, unique_ptr<LockFile> lock)
+{
+    std::error_code ec;
+    for (auto &entry : std::filesystem::directory_iterator(session, ec)) {
+        if (entry.path().filename() != LOCK_NAME)
+            std::filesystem::remove(entry.path(), ec);
+    }
+    lock.reset(); // (can't remove an open file on Windows)
+    std::filesystem::remove_all(session, ec);
+}
+
+bool Journal::recover(Song *song)
+{
+    struct Session
+    {
+        Path dir;
+        unique_ptr<LockFile> lock;
+        int generation;
+        std::filesystem::file_time_type time;
+    };
+    // sessions that aren't locked by a running instance
+    vector<Session> crashed;
+    std::error_code ec;
+    for (auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+        Path path = entry.path();
+        if (path == sessionDir || !entry.is_directory(ec))
+            continue;
+        unique_ptr<LockFile> lock(LockFile::tryLock(path / LOCK_NAME));
+        if (!lock)
+            continue; // running
+        int generation = lastGeneration(path, true);
+        if (generation < 0) {
+            // crashed before the first checkpoint
+            removeSession(path, std::move(lock));
+            continue;
+        }
+        auto time = std::filesystem::last_write_time(
+            checkpointPath(path, generation), ec);
+        crashed.push_back({path, std::move(lock), generation, time});
+    }
+    // newest first. the others are recovered after this session ends, unless
+    // it crashes too
+    std::sort(crashed.begin(), crashed.end(), [](auto &a, auto &b) {
+        return a.time > b.time;
+    });
+    for (auto &session : crashed) {
+        if (recoverSession(session.dir, session.generation, song)) {
+            recoveredDir = session.dir;
+            recoveredLock = std::move(session.lock);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Journal::recoverSession(const Path &session, int recoverGeneration,
+                             Song *song)
+{
+    Path path = checkpointPath(session, recoverGeneration);
+    cout << "Recovering " <<path<< "\n";
+
+    Song loaded;
+    try {
+        MappedFile *mapped = MappedFile::open(path);
+        if (!mapped)
+            return false;
+        chroma::Loader loader(mapped);
+        loader.loadSong(&loaded);
+    } catch (std::exception &e) {
+        cout << "Error loading checkpoint: " <<e.what()<< "\n";
+        return false;
+    }
+    {
+        std::unique_lock lock(song->mu);
+        song->clear();
+        song->samples = std::move(loaded.samples);
+        song->tracks = std::move(loaded.tracks);
+        song->sections = std::move(loaded.sections);
+        song->volume = loaded.volume;
+    }
+    undoer->reset(song);
+
+    Path journalFile = journalPath(session, recoverGeneration);
+    unique_ptr<MappedFile> journal(MappedFile::open(journalFile));
+    if (!journal)
+        return true; // crashed before any changes
+    ByteReader in(journal->data(), journal->size());
+    int numRecords = 0;
+    bool corrupt = false;
+    try {
+        // operations are serialized in the current format only, a journal
+        // left by another version can't be replayed
+        if (std::memcmp(in.bytes(4), JOURNAL_MAGIC, 4) || in.le16() != VERSION)
+            throw std::runtime_error("Unrecognized format");
+        while (in.tell() < in.size()) {
+            // the last record is incomplete if the crash happened while writing
+            if (in.size() - in.tell() < RECORD_HEADER_SIZE) {
+                cout << "Journal ends early\n";
+                break;
+            }
+            auto type = (RecordType)in.u8();
+            uint32_t size = in.le32();
+            if (size > in.size() - in.tell()) {
+                cout << "Journal ends early\n";
+                break;
+            }
+            ByteReader data(in.bytes(size), size);
+            switch (type) {
+            case RecordType::Op:
+            case RecordType::ContinuousOp: {
+                edit::OpReader opReader(song, data);
+                // read before performing, like the original operation
+                unique_ptr<edit::Operation<Song *>> op =
+                    edit::ops::readOp(opReader);
+                undoer->doOp(std::move(op),
+                             type == RecordType::ContinuousOp);
+                break;
+            }
+            case RecordType::EndContinuous:
+                undoer->endContinuous();
+                break;
+            case RecordType::Undo:
+                undoer->undo();
+                break;
+            case RecordType::Redo:
+                undoer->redo();
+                break;
+            default:
+                throw std::runtime_error("Unknown record");
+            }
+            numRecords++;
+        }
+    } catch (std::exception &e) {
+        cout << "Error replaying journal: " <<e.what()<< "\n";
+        corrupt = true;
+    }
+    cout << "Replayed " <<numRecords<< " changes\n";
+    if (corrupt) {
+        // keep it for inspection, but don't replay it again on the next start
+        journal.reset();
+        // outside the session, which is deleted
+        Path badPath = dir / ("corrupt-" + session.filename().string() + "-"
+                              + std::to_string(recoverGeneration) + ".journal");
+        std::error_code ec;
+        std::filesystem::rename(journalFile, badPath, ec);
+        if (ec)
+            std::filesystem::remove(journalFile, ec);
+        cout << "Moved corrupt journal to " <<badPath<< "\n";
+    }
+    return true;
+}
+
+void Journal::checkpoint(const Song *song)
+{
+    if (!sessionLock)
+        return;
+    Record record;
+    record.checkpoint = std::make_shared<chroma::Writer>(
+        song, checkpointPath(sessionDir, generation));
+    record.generation = generation++;
+    push(std::move(record));
+    _suspended = false;
+    needCheckpoint = false;
+    opsSinceCheckpoint = 0;
+    baseUndoSize = undoer->undoSize();
+    baseRedoSize = undoer->redoSize();
+    checkpointTime = std::chrono::steady_clock::now();
+}
+
+void Journal::suspend()
+{
+    _suspended = true;
+}
+
+bool Journal::suspended() const
+{
+    return _suspended;
+}
+
+void Journal::update(const Song *song)
+{
+    if (_suspended)
+        return;
+    // until the journal thread reaches the last checkpoint, journalSize is
+    // still the size of the previous generation
+    bool checkpointQueued = startedGeneration != generation - 1;
+    if (needCheckpoint
+            || (opsSinceCheckpoint && !checkpointQueued
+                && (journalSize > CHECKPOINT_JOURNAL_SIZE
+                    || std::chrono::steady_clock::now() - checkpointTime
+                        > CHECKPOINT_INTERVAL)))
+        checkpoint(song);
+}
+
+bool Journal::active() const
+{
+    return !_suspended && !needCheckpoint;
+}
+
+void Journal::historyChanged()
+{
+    // the checkpoint will include the change
+    needCheckpoint = true;
+}
+
+void Journal::doOp(Song *song, const edit::Operation<Song *> &op,
+                   bool continuous)
+{
+    if (!active())
+        return;
+    // a new op clears the redo stack
+    baseRedoSize = std::min(baseRedoSize, undoer->redoSize());
+    if (continuous && undoer->continuing()
+            && undoer->undoSize() <= baseUndoSize) {
+        historyChanged(); // might replace an op from before the checkpoint
+        return;
+    }
+    auto songOp = dynamic_cast<const edit::SongOp *>(&op);
+    if (!songOp)
+        return;
+    Record record;
+    record.type = continuous ? RecordType::ContinuousOp : RecordType::Op;
+    edit::OpWriter out(song, record.data);
+    songOp->write(out);
+    record.waves.assign(out.waves().begin(), out.waves().end());
+    push(std::move(record));
+    opsSinceCheckpoint++;
+}
+
+void Journal::endContinuous()
+{
+    if (active())
+        push({RecordType::EndContinuous});
+}
+
+void Journal::undo()
+{
+    if (!active())
+        return;
+    baseRedoSize = std::min(baseRedoSize, undoer->redoSize());
+    size_t size = undoer->undoSize();
+    if (size && size <= baseUndoSize) {
+        historyChanged();
+        return;
+    }
+    push({RecordType::Undo});
+    opsSinceCheckpoint++;
+}
+
+void Journal::redo()
+{
+    if (!active())
+        return;
+    baseRedoSize = std::min(baseRedoSize, undoer->redoSize());
+    size_t size = undoer->redoSize();
+    if (size && size <= baseRedoSize) {
+        historyChanged();
+        return;
+    }
+    push({RecordType::Redo});
+    opsSinceCheckpoint++;
+}
+
+void Journal::push(Record record)
+{
+    {
+        std::unique_lock lock(mu);
+        queue.push_back(std::move(record));
+    }
+    cv.notify_one();
+}
+
+void Journal::run()
+{
+    vector<Record> records;
+    std::unique_lock lock(mu);
+    while (true) {
+        cv.wait(lock, [this] { return stopping || !queue.empty(); });
+        if (queue.empty())
+            break; // stopping
+        records.swap(queue);
+        lock.unlock();
+
+        for (auto &record : records) {
+            if (record.checkpoint)
+                startGeneration(record);
+            else
+                writeRecord(record);
+        }
+        records.clear();
+        // survive a crash of the program (but not of the system)
+        if (file && std::fflush(file) != 0)
+            cout << "Error writing journal\n";
+
+        lock.lock();
+    }
+}
+
+void Journal::startGeneration(const Record &record)
+{
+    if (file) {
+        std::fclose(file);
+        file = nullptr;
+    }
+    journalSize = 0;
+    startedGeneration = record.generation;
+
+    record.checkpoint->encode();
+    if (!record.checkpoint->save()) {
+        // journal would be incomplete without it
+        cout << "Error writing checkpoint, journal disabled\n";
+        return;
+    }
+
+    if (recoveredLock) {
+        // the recovered song is in this session now
+        removeSession(recoveredDir, std::move(recoveredLock));
+    }
+
+    Path path = journalPath(sessionDir, record.generation);
+    file = std::fopen(path.string().c_str(), "wb");
+    if (!file) {
+        cout << "Error opening journal " <<path<< "\n";
+        return;
+    }
+    buffer.clear();
+    ByteWriter out(buffer);
+    out.bytes(JOURNAL_MAGIC, 4);
+    out.le16(VERSION);
+    std::fwrite(buffer.data(), 1, buffer.size(), file);
+
+    removeOldGenerations(record.generation);
+}
+
+void Journal::writeRecord(const Record &record)
+{
+    if (!file)
+        return;
+    buffer.clear();
+    ByteWriter out(buffer);
+    out.u8((uint8_t)record.type);
+    out.le32(0); // size
+    out.bytes(record.data.data(), record.data.size());
+    for (auto &wave : record.waves)
+        edit::writeWave(wave, buffer);
+    uint32_t size = buffer.size() - RECORD_HEADER_SIZE;
+    for (int b = 0; b < 4; b++)
+        buffer[1 + b] = (uint8_t)(size >> (b * 8));
+
+    if (std::fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size())
+        cout << "Error writing journal\n";
+    journalSize += buffer.size();
+}
+
+void Journal::removeOldGenerations(int generation)
+{
+    std::error_code ec;
+    for (auto &entry : std::filesystem::directory_iterator(sessionDir, ec)) {
+        Path path = entry.path();
+        int entryGeneration;
+        try {
+            entryGeneration = std::stoi(path.stem().string());
+        } catch (std::logic_error &) {
+            continue;
+        }
+        // (also removes temporary files from failed checkpoints)
+        if (entryGeneration < generation)
+            std::filesystem::remove(path, ec);
+    }
+}
+
+} // namespace
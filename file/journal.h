@@ -0,0 +1,126 @@
+#pragma once
+#include <common.h>
+
+#include "chromawriter.h"
+#include "lockfile.h"
+#include "types.h"
+#include <edit/undoer.hpp>
+#include <song.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+namespace chromatracker::file {
+
+// crash recovery. every change made through the undoer is appended to a
+// journal file on a background thread, with periodic checkpoints of the whole
+// song. each running instance writes to its own session directory
+// <dir>/<session>, which is locked while it runs. files are numbered by
+// generation: <n>.chroma is a checkpoint and <n>.journal contains the changes
+// made after it. older generations are deleted once a checkpoint is complete.
+// the replay starts with an empty undo history, so undoing past a checkpoint
+// makes a new checkpoint instead of being journaled
+class Journal : public edit::UndoObserver<Song *>, noncopyable
+{
+public:
+    // observe undoer after recover()
+    Journal(Path dir, edit::Undoer<Song *> *undoer);
+    // finishes writing, then deletes the session (clean exit)
+    ~Journal();
+
+    // load the last checkpoint of the newest session left by a crash into
+    // song and replay its journal through the undoer. the session is deleted
+    // after the first checkpoint of this one. sessions of running instances
+    // are ignored. return false if there was nothing to recover
+    bool recover(Song *song);
+
+    // start a new generation from a snapshot of the song (UI thread)
+    void checkpoint(const Song *song);
+    // stop journaling until the next checkpoint, eg. while a song is loading
+    void suspend();
+    bool suspended() const;
+    // call regularly from the UI thread, makes a checkpoint when due
+    void update(const Song *song);
+
+    // UndoObserver, UI thread. only serializes and queues the operation
+    void doOp(Song *song, const edit::Operation<Song *> &op,
+              bool continuous) override;
+    void endContinuous() override;
+    void undo() override;
+    void redo() override;
+
+private:
+    enum class RecordType : uint8_t
+    {
+        Op = 0,
+        ContinuousOp = 1,
+        EndContinuous = 2,
+        Undo = 3,
+        Redo = 4,
+    };
+
+    struct Record
+    {
+        RecordType type;
+        vector<uint8_t> data;
+        vector<Wave> waves; // encoded after data
+        // if set, start a new generation instead
+        shared_ptr<chroma::Writer> checkpoint;
+        int generation {0};
+    };
+
+    static Path checkpointPath(const Path &session, int generation);
+    static Path journalPath(const Path &session, int generation);
+    // from existing files, -1 if none
+    static int lastGeneration(const Path &session, bool withCheckpoint);
+    // delete the files before releasing the lock, so another instance can't
+    // recover it in between
+    static void removeSession(const Path &session, unique_ptr<LockFile> lock);
+
+    bool recoverSession(const Path &session, int generation, Song *song);
+
+    bool active() const;
+    // before undoing past the checkpoint. stops journaling until update()
+    void historyChanged();
+    void push(Record record);
+    void run(); // journal thread
+    void startGeneration(const Record &record);
+    void writeRecord(const Record &record);
+    void removeOldGenerations(int generation);
+
+    const Path dir;
+    edit::Undoer<Song *> * const undoer;
+    Path sessionDir; // empty if it couldn't be created (journal disabled)
+    unique_ptr<LockFile> sessionLock;
+    // recovered from, deleted by the journal thread after the first checkpoint
+    Path recoveredDir;
+    unique_ptr<LockFile> recoveredLock;
+
+    // UI thread
+    int generation {0};
+    bool _suspended {true}; // until the first checkpoint
+    bool needCheckpoint {false};
+    int opsSinceCheckpoint {0};
+    // undo / redo stack sizes at the checkpoint (or less if they shrank since)
+    // ops below these are not in the journal
+    size_t baseUndoSize {0}, baseRedoSize {0};
+    std::chrono::steady_clock::time_point checkpointTime;
+
+    std::mutex mu; // protects queue and stopping
+    std::condition_variable cv;
+    vector<Record> queue;
+    bool stopping {false};
+
+    // journal thread
+    std::FILE *file {nullptr};
+    vector<uint8_t> buffer;
+    std::atomic<uint64_t> journalSize {0}; // of the started generation
+    std::atomic<int> startedGeneration {-1};
+
+    std::thread thread;
+};
+
+} // namespace
@@ -0,0 +1,354 @@
+#include "libraryindex.h"
+#include "bytereader.h"
+#include "bytewriter.h"
+#include "mappedfile.h"
+#include <parallel.h>
+#include <stringutil.h>
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <sstream>
+#include <SDL2/SDL_rwops.h>
+
+namespace chromatracker::file {
+
+const char INDEX_MAGIC[4] = {'C', 'H', 'I', 'X'};
+// version 2 added the failed flag
+const uint16_t INDEX_VERSION = 2;
+// files read in parallel between updates of the entries
+const size_t CRAWL_BATCH = 256;
+
+LibraryIndex::LibraryIndex(Path indexPath)
+    : indexPath(indexPath)
+{
+    thread = std::thread(&LibraryIndex::run, this);
+}
+
+LibraryIndex::~LibraryIndex()
+{
+    {
+        std::unique_lock lock(requestMu);
+        stopping = true;
+    }
+    cv.notify_one();
+    thread.join();
+}
+
+void LibraryIndex::crawl(vector<Path> roots)
+{
+    {
+        std::unique_lock lock(requestMu);
+        if (_crawling)
+            return;
+        this->roots = roots;
+        crawlRequested = true;
+        _crawling = true;
+    }
+    cv.notify_one();
+}
+
+bool LibraryIndex::crawling() const
+{
+    return _crawling;
+}
+
+uint64_t LibraryIndex::version() const
+{
+    return _version;
+}
+
+bool LibraryIndex::find(const Path &path,
+                        std::filesystem::file_time_type mtime,
+                        FileInfo *info) const
+{
+    std::shared_lock lock(mu);
+    auto it = entries.find(path);
+    if (it == entries.end() || it->second.failed
+            || it->second.mtime != mtime.time_since_epoch().count())
+        return false;
+    *info = it->second.info;
+    return true;
+}
+
+void LibraryIndex::search(const string &query, FileType type, size_t limit,
+                          vector<Path> &directories, vector<Path> &files) const
+{
+    vector<string> words;
+    std::istringstream queryStream(toLower(query));
+    string word;
+    while (queryStream >> word)
+        words.push_back(word);
+    if (words.empty())
+        return;
+    // every word in either string
+    auto matches = [&](const string &a, const string &b) {
+        for (auto &word : words) {
+            if (a.find(word) == string::npos && b.find(word) == string::npos)
+                return false;
+        }
+        return true;
+    };
+
+    std::shared_lock lock(mu);
+    for (auto &[path, entry] : entries) {
+        if (directories.size() + files.size() >= limit)
+            break;
+        bool nameMatches = matches(entry.text, "");
+        if (entry.type != FileType::Module || type == FileType::Module) {
+            if (entry.type == type && nameMatches)
+                files.push_back(path);
+            continue;
+        }
+        if (nameMatches) {
+            // all samples would match, list them by opening the module
+            directories.push_back(path);
+            continue;
+        }
+        for (int i = 0; i < entry.sampleText.size(); i++) {
+            if (directories.size() + files.size() >= limit)
+                break;
+            if (matches(entry.text, entry.sampleText[i])) {
+                files.push_back(moduleSamplePath(path, i,
+                                                 entry.info.sampleNames[i]));
+            }
+        }
+    }
+}
+
+void LibraryIndex::run()
+{
+    load();
+    std::unique_lock lock(requestMu);
+    while (true) {
+        cv.wait(lock, [this] { return stopping || crawlRequested; });
+        if (stopping)
+            break;
+        crawlRequested = false;
+        vector<Path> requestedRoots = roots;
+        lock.unlock();
+        crawlRoots(requestedRoots);
+        if (modified)
+            save();
+        _crawling = false;
+        lock.lock();
+    }
+}
+
+void LibraryIndex::load()
+{
+    std::error_code ec;
+    if (!std::filesystem::exists(indexPath, ec))
+        return; // not created yet
+    unique_ptr<MappedFile> file(MappedFile::open(indexPath));
+    if (!file)
+        return;
+
+    std::map<Path, Entry> loaded;
+    try {
+        ByteReader reader(file->data(), file->size());
+        if (std::memcmp(reader.bytes(4), INDEX_MAGIC, 4)
+                || reader.le16() != INDEX_VERSION) {
+            cout << "Rebuilding library index\n";
+            return;
+        }
+        reader.skip(2);
+        uint32_t numEntries = reader.le32();
+        for (uint32_t i = 0; i < numEntries; i++) {
+            Path path = std::filesystem::u8path(reader.string16());
+            Entry entry;
+            entry.mtime = (int64_t)reader.le64();
+            entry.type = (FileType)reader.u8();
+            entry.failed = reader.u8();
+            entry.info.title = reader.string16();
+            entry.info.numChannels = reader.le16();
+            entry.info.seconds = reader.leFloat();
+            uint16_t numSamples = reader.le16();
+            entry.info.sampleNames.reserve(numSamples);
+            for (int s = 0; s < numSamples; s++)
+                entry.info.sampleNames.push_back(reader.string16());
+            makeSearchText(path, entry);
+            loaded.emplace_hint(loaded.end(), path, std::move(entry));
+        }
+    } catch (std::exception &e) {
+        cout << "Error reading library index: " <<e.what()<< "\n";
+        return;
+    }
+
+    std::unique_lock lock(mu);
+    entries = std::move(loaded);
+    _version++;
+}
+
+void LibraryIndex::save()
+{
+    vector<uint8_t> data;
+    ByteWriter out(data);
+    out.bytes(INDEX_MAGIC, 4);
+    out.le16(INDEX_VERSION);
+    out.le16(0);
+    {
+        std::shared_lock lock(mu);
+        out.le32(entries.size());
+        for (auto &[path, entry] : entries) {
+            out.string16(path.u8string());
+            out.le64((uint64_t)entry.mtime);
+            out.u8((uint8_t)entry.type);
+            out.u8(entry.failed);
+            out.string16(entry.info.title);
+            out.le16(entry.info.numChannels);
+            out.leFloat(entry.info.seconds);
+            size_t numSamples = std::min<size_t>(
+                entry.info.sampleNames.size(), UINT16_MAX);
+            out.le16(numSamples);
+            for (size_t s = 0; s < numSamples; s++)
+                out.string16(entry.info.sampleNames[s]);
+        }
+    }
+
+    Path tempPath = indexPath;
+    tempPath += ".tmp";
+    SDL_RWops *stream = SDL_RWFromFile(tempPath.string().c_str(), "wb");
+    if (!stream) {
+        cout << "Error opening stream: " <<SDL_GetError()<< "\n";
+        return;
+    }
+    bool ok = SDL_RWwrite(stream, data.data(), 1, data.size()) == data.size();
+    if (SDL_RWclose(stream) != 0)
+        ok = false;
+    std::error_code ec;
+    if (!ok) {
+        cout << "Error writing library index: " <<SDL_GetError()<< "\n";
+        std::filesystem::remove(tempPath, ec);
+        return;
+    }
+    std::filesystem::rename(tempPath, indexPath, ec); // replaces existing
+    if (ec) {
+        cout << "Error replacing library index: " <<ec.message()<< "\n";
+        return;
+    }
+    modified = false;
+}
+
+void LibraryIndex::crawlRoots(const vector<Path> &roots)
+{
+    std::set<Path> seen;
+    vector<FoundFile> changed;
+    vector<Path> completeRoots;
+    for (auto &root : roots) {
+        if (findChanged(root, seen, changed))
+            completeRoots.push_back(root);
+        if (stopping)
+            return;
+    }
+
+    // files that are gone. a root that can't be read (eg. an unplugged drive)
+    // keeps its entries
+    {
+        std::unique_lock lock(mu);
+        for (auto it = entries.begin(); it != entries.end(); ) {
+            auto &path = it->first;
+            bool removed = !seen.count(path) && std::any_of(
+                completeRoots.begin(), completeRoots.end(),
+                [&](const Path &root) {
+                    auto rel = path.lexically_relative(root);
+                    return !rel.empty() && *rel.begin() != "..";
+                });
+            if (removed) {
+                it = entries.erase(it);
+                modified = true;
+                _version++;
+            } else {
+                it++;
+            }
+        }
+    }
+
+    for (size_t start = 0; start < changed.size(); start += CRAWL_BATCH) {
+        if (stopping)
+            return;
+        size_t count = std::min(CRAWL_BATCH, changed.size() - start);
+        vector<Entry> batch(count);
+        parallelFor(count, [&](size_t i) {
+            const FoundFile &found = changed[start + i];
+            Entry &entry = batch[i];
+            entry.mtime = found.mtime;
+            entry.type = found.type;
+            entry.failed = !readInfo(found.path, found.type, &entry.info);
+            makeSearchText(found.path, entry);
+        });
+        std::unique_lock lock(mu);
+        for (size_t i = 0; i < count; i++)
+            entries[changed[start + i].path] = std::move(batch[i]);
+        modified = true;
+        _version++;
+    }
+}
+
+bool LibraryIndex::findChanged(const Path &root, std::set<Path> &seen,
+                               vector<FoundFile> &changed) const
+{
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    if (!fs::is_directory(root, ec))
+        return false;
+    fs::recursive_directory_iterator it(
+        root, fs::directory_options::skip_permission_denied, ec);
+    for (fs::recursive_directory_iterator end; !ec && it != end;
+            it.increment(ec)) {
+        if (stopping)
+            return false;
+        auto &path = it->path();
+        FileType type = typeForPath(path);
+        std::error_code statEc;
+        if (type == FileType::Unknown || !it->is_regular_file(statEc))
+            continue;
+        auto mtime = it->last_write_time(statEc);
+        if (statEc)
+            continue;
+        int64_t time = mtime.time_since_epoch().count();
+        seen.insert(path);
+
+        std::shared_lock lock(mu);
+        auto entry = entries.find(path);
+        if (entry == entries.end() || entry->second.mtime != time)
+            changed.push_back({path, type, time});
+    }
+    if (ec) {
+        cout << "Error indexing " <<root<< ": " <<ec.message()<< "\n";
+        return false;
+    }
+    return true;
+}
+
+bool LibraryIndex::readInfo(const Path &path, FileType type, FileInfo *info)
+{
+    try {
+        if (type == FileType::Module) {
+            unique_ptr<ModuleLoader> loader(moduleLoaderForPath(path));
+            if (loader) {
+                *info = loader->loadInfo();
+                return true;
+            }
+        } else {
+            unique_ptr<SampleLoader> loader(sampleLoaderForPath(path));
+            if (loader) {
+                *info = loader->loadInfo();
+                return true;
+            }
+        }
+    } catch (std::exception &e) {
+        cout << "Error indexing " <<path<< ": " <<e.what()<< "\n";
+    }
+    return false;
+}
+
+void LibraryIndex::makeSearchText(const Path &path, Entry &entry)
+{
+    entry.text = toLower(path.filename().u8string() + "\n" + entry.info.title);
+    entry.sampleText.clear();
+    entry.sampleText.reserve(entry.info.sampleNames.size());
+    for (auto &name : entry.info.sampleNames)
+        entry.sampleText.push_back(toLower(name));
+}
+
+} // namespace
@@ -0,0 +1,95 @@
+#pragma once
+#include <common.h>
+
+#include "types.h"
+#include <atomic>
+#include <condition_variable>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <thread>
+
+namespace chromatracker::file {
+
+// metadata of every module and sample in the library (eg. the bookmarked
+// directories), kept in a file so browsing and searching don't need to read
+// any headers. a background crawler reads new and modified files in parallel
+// and drops files that were removed
+class LibraryIndex : noncopyable
+{
+public:
+    LibraryIndex(Path indexPath); // starts thread, which loads the index
+    ~LibraryIndex(); // stops crawling and saves
+
+    // update entries for every file under roots in the background.
+    // ignored while crawling
+    void crawl(vector<Path> roots);
+    bool crawling() const;
+    // incremented whenever entries change
+    uint64_t version() const;
+
+    // return false if path isn't indexed, was modified since, or couldn't be
+    // read
+    bool find(const Path &path, std::filesystem::file_time_type mtime,
+              FileInfo *info) const;
+    // files with every word of query in their file name, title or a sample
+    // name (case insensitive), up to limit. for Sample type, matching modules
+    // are directories and matching samples in them are files (see
+    // listDirectory)
+    void search(const string &query, FileType type, size_t limit,
+                vector<Path> &directories, vector<Path> &files) const;
+
+private:
+    struct Entry
+    {
+        int64_t mtime {0}; // file_time_type ticks
+        FileType type {FileType::Unknown};
+        // kept so it isn't read again until it changes, info is empty
+        bool failed {false};
+        FileInfo info;
+        // lower case, for search
+        string text; // file name and title
+        vector<string> sampleText;
+    };
+
+    struct FoundFile
+    {
+        Path path;
+        FileType type;
+        int64_t mtime;
+    };
+
+    void run();
+    void load();
+    void save();
+    void crawlRoots(const vector<Path> &roots);
+    // add files under root which are new or modified, return false if the
+    // directory couldn't be read completely
+    bool findChanged(const Path &root, std::set<Path> &seen,
+                     vector<FoundFile> &changed) const;
+    // never throws, return false on error
+    static bool readInfo(const Path &path, FileType type, FileInfo *info);
+    static void makeSearchText(const Path &path, Entry &entry);
+
+    const Path indexPath;
+
+    mutable std::shared_mutex mu; // protects entries
+    std::map<Path, Entry> entries;
+    std::atomic<uint64_t> _version {0};
+
+    // thread
+    bool modified {false}; // since load / save
+
+    std::mutex requestMu; // protects roots and crawlRequested
+    std::condition_variable cv;
+    vector<Path> roots;
+    bool crawlRequested {false};
+    std::atomic<bool> _crawling {false};
+    std::atomic<bool> stopping {false};
+
+    std::thread thread;
+};
+
+} // namespace
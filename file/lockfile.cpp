@@ -0,0 +1,56 @@
+#include "lockfile.h"
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+namespace chromatracker::file {
+
+#ifdef _WIN32
+
+LockFile * LockFile::tryLock(Path path)
+{
+    // no sharing, fails while another handle is open
+    HANDLE fileHandle = CreateFileW(path.wstring().c_str(),
+        GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (fileHandle == INVALID_HANDLE_VALUE)
+        return nullptr;
+    LockFile *lock = new LockFile;
+    lock->fileHandle = fileHandle;
+    return lock;
+}
+
+LockFile::~LockFile()
+{
+    CloseHandle(fileHandle);
+}
+
+#else
+
+LockFile * LockFile::tryLock(Path path)
+{
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return nullptr;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        close(fd);
+        return nullptr;
+    }
+    LockFile *lock = new LockFile;
+    lock->fd = fd;
+    return lock;
+}
+
+LockFile::~LockFile()
+{
+    close(fd); // releases the lock
+}
+
+#endif
+
+} // namespace
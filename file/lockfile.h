@@ -0,0 +1,27 @@
+#pragma once
+#include <common.h>
+
+#include "types.h"
+
+namespace chromatracker::file {
+
+// exclusive lock on a file, held until destroyed or the process exits
+// (including crashes). tells if another process is using a directory
+class LockFile : noncopyable
+{
+public:
+    // creates the file. return null if another process holds the lock
+    static LockFile * tryLock(Path path);
+    ~LockFile(); // releases the lock, the file isn't removed
+
+private:
+    LockFile() = default;
+
+#ifdef _WIN32
+    void *fileHandle {nullptr};
+#else
+    int fd {-1};
+#endif
+};
+
+} // namespace
@@ -0,0 +1,165 @@
+#include "mappedfile.h"
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace chromatracker::file {
+
+// read one byte of every page
+static void touchPages(const void *data, size_t size, size_t pageSize)
+{
+    auto bytes = (const volatile uint8_t *)data;
+    for (size_t i = 0; i < size; i += pageSize)
+        (void)bytes[i];
+}
+
+#ifdef _WIN32
+
+MappedFile * MappedFile::open(Path path)
+{
+    unique_ptr<MappedFile> file(new MappedFile);
+    HANDLE fileHandle = CreateFileW(path.wstring().c_str(), GENERIC_READ,
+        FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (fileHandle == INVALID_HANDLE_VALUE) {
+        cout << "Error opening file: " <<GetLastError()<< "\n";
+        return nullptr;
+    }
+    file->fileHandle = fileHandle;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(fileHandle, &size)) {
+        cout << "Error reading file size: " <<GetLastError()<< "\n";
+        return nullptr;
+    }
+    file->_size = size.QuadPart;
+    if (file->_size == 0)
+        return file.release(); // can't map empty file
+    HANDLE mapHandle = CreateFileMappingW(fileHandle, NULL, PAGE_READONLY,
+                                          0, 0, NULL);
+    if (!mapHandle) {
+        cout << "Error mapping file: " <<GetLastError()<< "\n";
+        return nullptr;
+    }
+    file->mapHandle = mapHandle;
+    file->_data = (const uint8_t *)MapViewOfFile(mapHandle, FILE_MAP_READ,
+                                                 0, 0, 0);
+    if (!file->_data) {
+        cout << "Error mapping file: " <<GetLastError()<< "\n";
+        return nullptr;
+    }
+    return file.release();
+}
+
+MappedFile::~MappedFile()
+{
+    if (_data)
+        UnmapViewOfFile(_data);
+    if (mapHandle)
+        CloseHandle(mapHandle);
+    if (fileHandle)
+        CloseHandle(fileHandle);
+}
+
+bool MappedFile::pin(const void *data, size_t size)
+{
+    // limited by the working set size
+    if (VirtualLock((void *)data, size))
+        return true;
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    touchPages(data, size, info.dwPageSize);
+    return false;
+}
+
+void MappedFile::unpin(const void *data, size_t size)
+{
+    VirtualUnlock((void *)data, size);
+}
+
+#else
+
+MappedFile * MappedFile::open(Path path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cout << "Error opening file: " <<path<< "\n";
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        cout << "Error reading file size: " <<path<< "\n";
+        close(fd);
+        return nullptr;
+    }
+    unique_ptr<MappedFile> file(new MappedFile);
+    file->_size = st.st_size;
+    if (file->_size != 0) { // can't map empty file
+        void *data = mmap(nullptr, file->_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            cout << "Error mapping file: " <<path<< "\n";
+            close(fd);
+            return nullptr;
+        }
+        file->_data = (const uint8_t *)data;
+    }
+    close(fd); // mapping stays valid
+    return file.release();
+}
+
+MappedFile::~MappedFile()
+{
+    if (_data)
+        munmap((void *)_data, _size);
+}
+
+// the range rounded out to whole pages
+static void pageRange(const void *data, size_t size,
+                      void **start, size_t *pagesSize)
+{
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = (uintptr_t)data & ~(pageSize - 1);
+    uintptr_t end = (uintptr_t)data + size;
+    *start = (void *)begin;
+    *pagesSize = end - begin;
+}
+
+bool MappedFile::pin(const void *data, size_t size)
+{
+    void *start;
+    size_t pagesSize;
+    pageRange(data, size, &start, &pagesSize);
+    // start reading everything at once instead of faulting page by page
+    madvise(start, pagesSize, MADV_WILLNEED);
+    // limited by RLIMIT_MEMLOCK
+    if (mlock(start, pagesSize) == 0)
+        return true;
+    touchPages(data, size, sysconf(_SC_PAGESIZE));
+    return false;
+}
+
+void MappedFile::unpin(const void *data, size_t size)
+{
+    void *start;
+    size_t pagesSize;
+    pageRange(data, size, &start, &pagesSize);
+    munlock(start, pagesSize);
+}
+
+#endif
+
+const uint8_t * MappedFile::data() const
+{
+    return _data;
+}
+
+size_t MappedFile::size() const
+{
+    return _size;
+}
+
+} // namespace
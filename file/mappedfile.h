@@ -0,0 +1,36 @@
+#pragma once
+#include <common.h>
+
+#include "types.h"
+
+namespace chromatracker::file {
+
+// read-only memory map of a whole file
+class MappedFile : noncopyable
+{
+public:
+    // return null on error (could be a missing file)
+    static MappedFile * open(Path path);
+    ~MappedFile();
+
+    const uint8_t * data() const;
+    size_t size() const;
+
+    // keep part of a mapping in physical memory. return false if it couldn't
+    // be locked (eg. over the limit), then it's only read in and could be
+    // paged out again
+    static bool pin(const void *data, size_t size);
+    static void unpin(const void *data, size_t size);
+
+private:
+    MappedFile() = default;
+
+    const uint8_t *_data {nullptr};
+    size_t _size {0};
+#ifdef _WIN32
+    void *fileHandle {nullptr};
+    void *mapHandle {nullptr};
+#endif
+};
+
+} // namespace
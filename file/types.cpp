@@ -1,6 +1,8 @@
 #include "types.h"
 #include "chromaloader.h"
 #include "itloader.h"
+#include "mappedfile.h"
+#include "wavloader.h"
 #include <stringutil.h>
 #include <exception>
 
@@ -24,47 +26,47 @@ FileType typeForPath(Path path)
 
 ModuleLoader * moduleLoaderForPath(Path path)
 {
-    SDL_RWops *stream = SDL_RWFromFile(path.string().c_str(), "r");
-    if (!stream) {
-        cout << "Error opening stream: " <<SDL_GetError()<< "\n";
-        return nullptr;
-    }
     string ext = normalizedExtension(path);
-    if (ext == ".it") {
-        return new ITLoader(stream);
-    } else if (ext == ".chroma") {
-        return new chroma::Loader(stream);
-    } else {
-        SDL_RWclose(stream);
+    if (ext != ".chroma" && ext != ".it")
         return nullptr;
-    }
+    MappedFile *file = MappedFile::open(path);
+    if (!file)
+        return nullptr;
+    if (ext == ".chroma")
+        return new chroma::Loader(file);
+    else
+        return new ITLoader(file);
 }
 
 SampleLoader * sampleLoaderForPath(Path path)
 {
     Path parent = path.parent_path();
     string ext = normalizedExtension(path);
-    string parentExt = normalizedExtension(parent);
-    if (parentExt == ".it") {
-        Path modulePath = path.parent_path();
-        SDL_RWops *stream = SDL_RWFromFile(modulePath.string().c_str(), "r");
-        if (!stream) {
-            cout << "Error opening stream: " <<SDL_GetError()<< "\n";
-            return nullptr;
-        }
+    if (typeForPath(parent) == FileType::Module) {
         int index = std::stoi(path.filename()) - 1; // parse the first number
-        return new ModuleSampleLoader(new ITLoader(stream), index);
+        ModuleLoader *mod = moduleLoaderForPath(parent);
+        if (!mod)
+            return nullptr;
+        return new ModuleSampleLoader(mod, index);
+    } else if (ext == ".wav") {
+        MappedFile *file = MappedFile::open(path);
+        if (!file)
+            return nullptr;
+        return new WAVLoader(file, path.stem().string());
     } else {
         return nullptr;
     }
 }
 
-void listDirectory(Path path, FileType type,
-                   vector<Path> &directories, vector<Path> &files)
+Path moduleSamplePath(Path modulePath, int index, const string &name)
 {
-    directories.clear();
-    files.clear();
+    // sampleLoaderForPath parses the number
+    return modulePath / (leftPad(std::to_string(index + 1), 2) + " " + name);
+}
 
+void listDirectory(Path path, FileType type,
+                   std::function<bool(Path path, bool directory)> found)
+{
     FileType pathType = typeForPath(path);
     if (type == FileType::Sample && pathType == FileType::Module) {
         unique_ptr<ModuleLoader> loader(moduleLoaderForPath(path));
@@ -73,29 +75,59 @@ void listDirectory(Path path, FileType type,
         vector<string> sampleNames;
         try {
             sampleNames = loader->listSamples();
-        } catch (std::exception e) {
+        } catch (std::exception &e) {
             cout << "Error reading module: " <<e.what()<< "\n";
             return;
         }
         for (int i = 0; i < sampleNames.size(); i++) {
-            string fileName = leftPad(std::to_string(i + 1), 2)
-                + " " + sampleNames[i];
-            files.push_back(path / fileName);
+            if (!found(moduleSamplePath(path, i, sampleNames[i]), false))
+                return;
         }
     } else if (std::filesystem::is_directory(path)) {
-        for (const auto &dir : std::filesystem::directory_iterator(path)) {
-            auto &childPath = dir.path();
+        std::error_code ec;
+        std::filesystem::directory_iterator it(path, ec), end;
+        for (; !ec && it != end; it.increment(ec)) {
+            auto &childPath = it->path();
             FileType childType = typeForPath(childPath);
+            std::error_code statEc; // eg. broken link, skip it
+            bool keep = true;
             if (childType == type) {
-                files.push_back(childPath);
-            } else if (dir.is_directory() || (type == FileType::Sample &&
-                                              childType == FileType::Module)) {
-                directories.push_back(childPath);
+                keep = found(childPath, false);
+            } else if (it->is_directory(statEc) || (type == FileType::Sample
+                    && childType == FileType::Module)) {
+                keep = found(childPath, true);
             }
+            if (!keep)
+                return;
         }
+        if (ec)
+            cout << "Error reading directory: " <<ec.message()<< "\n";
     }
 }
 
+FileInfo ModuleLoader::loadInfo()
+{
+    FileInfo info;
+    info.sampleNames = listSamples();
+    return info;
+}
+
+void ModuleLoader::loadStructure(Song *song, LoadProgress *progress)
+{
+    loadSong(song);
+    if (progress)
+        progress->fraction = 1;
+}
+
+void ModuleLoader::loadWaves(const vector<shared_ptr<Sample>> &samples,
+                             LoadProgress *progress)
+{}
+
+FileInfo SampleLoader::loadInfo()
+{
+    return FileInfo();
+}
+
 ModuleSampleLoader::ModuleSampleLoader(ModuleLoader *mod, int index)
     : mod(mod)
     , index(index)
@@ -2,7 +2,10 @@
 #include <common.h>
 
 #include <song.h>
+#include <atomic>
 #include <filesystem>
+#include <functional>
+#include <stdexcept>
 #include <SDL2/SDL_rwops.h>
 
 namespace chromatracker::file {
@@ -14,6 +17,29 @@ enum class FileType
     Unknown, Module, Sample
 };
 
+// shared between a loading thread and the UI thread
+struct LoadProgress
+{
+    std::atomic<float> fraction {0}; // 0 - 1
+    std::atomic<bool> cancelled {false}; // set to stop loading
+};
+
+// thrown by loaders when LoadProgress::cancelled is set
+class LoadCancelled : public std::runtime_error
+{
+public:
+    LoadCancelled() : std::runtime_error("Cancelled") {}
+};
+
+// summary of a file for browsing, read without decoding waves or events
+struct FileInfo
+{
+    string title;
+    vector<string> sampleNames; // modules only
+    int numChannels {0}; // tracks of a module, or channels of a sample
+    float seconds {0}; // modules: until the sequence ends or repeats
+};
+
 // any methods may throw exceptions
 class ModuleLoader
 {
@@ -22,6 +48,18 @@ public:
     virtual void loadSong(Song *song) = 0; // song should be cleared
     virtual vector<string> listSamples() = 0;
     virtual void loadSample(int index, shared_ptr<Sample> sample) = 0;
+    // default only lists samples
+    virtual FileInfo loadInfo();
+
+    // progressive loading, instead of loadSong. loadStructure loads
+    // everything except wave data, then the song can be used while
+    // loadWaves fills in the waves of its samples (locking each sample).
+    // default loads everything in loadStructure
+    // samples are in the order of the song, null entries are skipped
+    // progress may be null
+    virtual void loadStructure(Song *song, LoadProgress *progress);
+    virtual void loadWaves(const vector<shared_ptr<Sample>> &samples,
+                           LoadProgress *progress);
 };
 
 // any methods may throw exceptions
@@ -30,6 +68,7 @@ class SampleLoader
 public:
     virtual ~SampleLoader() = default;
     virtual void loadSample(shared_ptr<Sample> sample) = 0;
+    virtual FileInfo loadInfo(); // default is empty
 };
 
 class ModuleSampleLoader : public SampleLoader
@@ -46,9 +85,12 @@ FileType typeForPath(Path path);
 // constructs loader, caller should take ownership (could return null!)
 ModuleLoader * moduleLoaderForPath(Path path);
 SampleLoader * sampleLoaderForPath(Path path);
+// a sample in a module, listed as a file in a directory (see listDirectory)
+Path moduleSamplePath(Path modulePath, int index, const string &name);
 
-// for Sample type, Module files are treated as directories of samples
+// for Sample type, Module files are treated as directories of samples.
+// found is called for each entry as it is read, return false to stop listing
 void listDirectory(Path path, FileType type,
-                   vector<Path> &directories, vector<Path> &files);
+                   std::function<bool(Path path, bool directory)> found);
 
 } // namespace
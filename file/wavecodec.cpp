@@ -0,0 +1,386 @@
+#include "wavecodec.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <SDL2/SDL_endian.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace chromatracker::file::chroma {
+
+const int MAX_RICE_K = 24;
+const int RAW_BITS = 24;
+
+static inline int countLeadingZeros(uint64_t x)
+{
+    if (x == 0)
+        return 64;
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, x);
+    return 63 - index;
+#else
+    return __builtin_clzll(x);
+#endif
+}
+
+static inline int32_t residual(int order, const int32_t *x, int i)
+{
+    // x[-1] and x[-2] are valid (history)
+    switch (order) {
+    case 0: return x[i];
+    case 1: return x[i] - x[i - 1];
+    default: return x[i] - 2 * x[i - 1] + x[i - 2];
+    }
+}
+
+static inline int32_t predict(int order, int32_t x1, int32_t x2)
+{
+    switch (order) {
+    case 0: return 0;
+    case 1: return x1;
+    default: return 2 * x1 - x2;
+    }
+}
+
+class BitWriter
+{
+public:
+    BitWriter(vector<uint8_t> &out) : out(out) {}
+
+    void put(uint32_t value, int numBits) // numBits <= 32
+    {
+        if (numBits == 0)
+            return;
+        acc = (acc << numBits) | (value & (uint32_t)((1ull << numBits) - 1));
+        count += numBits;
+        while (count >= 8) {
+            count -= 8;
+            out.push_back((uint8_t)(acc >> count));
+        }
+    }
+
+    void flush()
+    {
+        if (count > 0)
+            out.push_back((uint8_t)(acc << (8 - count)));
+        count = 0;
+    }
+
+private:
+    vector<uint8_t> &out;
+    uint64_t acc {0};
+    int count {0};
+};
+
+// reads past the end as zeros, check overrun() when done
+class BitReader
+{
+public:
+    BitReader(const uint8_t *data, size_t size)
+        : p(data), end(data + size) {}
+
+    // at least 57 bits available after
+    void refill()
+    {
+        while (avail <= 56) {
+            uint64_t byte = 0;
+            if (p < end)
+                byte = *p++;
+            else
+                padBytes++;
+            buf |= byte << (56 - avail);
+            avail += 8;
+        }
+    }
+
+    uint32_t peekZeros() const
+    {
+        return countLeadingZeros(buf);
+    }
+
+    void skip(int numBits)
+    {
+        buf <<= numBits;
+        avail -= numBits;
+    }
+
+    uint32_t get(int numBits) // numBits <= 32, must be available
+    {
+        if (numBits == 0)
+            return 0;
+        uint32_t value = (uint32_t)(buf >> (64 - numBits));
+        skip(numBits);
+        return value;
+    }
+
+    bool overrun() const
+    {
+        return padBytes * 8 > avail;
+    }
+
+private:
+    const uint8_t *p, *end;
+    uint64_t buf {0};
+    int avail {0};
+    int padBytes {0};
+};
+
+static inline void putRice(BitWriter &bits, uint32_t u, int k)
+{
+    uint32_t q = u >> k;
+    if (q >= RICE_ESCAPE) {
+        bits.put(0, RICE_ESCAPE);
+        bits.put(u, RAW_BITS);
+    } else {
+        bits.put(1, q + 1);
+        bits.put(u, k);
+    }
+}
+
+static inline size_t riceCost(uint32_t u, int k)
+{
+    uint32_t q = u >> k;
+    return q >= RICE_ESCAPE ? (RICE_ESCAPE + RAW_BITS) : (q + 1 + k);
+}
+
+static void encodeRice(const vector<int32_t> &values, vector<uint8_t> &out)
+{
+    size_t sizePos = out.size();
+    out.resize(out.size() + 4);
+
+    BitWriter bits(out);
+    // 2 frames of history before the start
+    vector<int32_t> x;
+    x.reserve(values.size() + 2);
+    x.assign(2, 0);
+    x.insert(x.end(), values.begin(), values.end());
+    const int32_t *xs = x.data() + 2;
+
+    for (size_t start = 0; start < values.size();
+            start += RICE_BLOCK_FRAMES) {
+        int n = (int)std::min(values.size() - start,
+                              (size_t)RICE_BLOCK_FRAMES);
+        int bestOrder = 0, bestK = 0;
+        size_t bestCost = SIZE_MAX;
+        for (int order = 0; order <= 2; order++) {
+            // estimate k from the mean, then try neighbors
+            uint64_t sum = 0;
+            for (int i = 0; i < n; i++)
+                sum += zigzag(residual(order, xs, start + i));
+            int estK = 0;
+            while (estK < MAX_RICE_K && (sum >> (estK + 1)) >= (uint64_t)n)
+                estK++;
+            for (int k = std::max(0, estK - 1);
+                    k <= std::min(MAX_RICE_K, estK + 1); k++) {
+                size_t cost = 0;
+                for (int i = 0; i < n && cost < bestCost; i++)
+                    cost += riceCost(zigzag(residual(order, xs, start + i)), k);
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestOrder = order;
+                    bestK = k;
+                }
+            }
+        }
+        bits.put(bestOrder, 2);
+        bits.put(bestK, 5);
+        for (int i = 0; i < n; i++)
+            putRice(bits, zigzag(residual(bestOrder, xs, start + i)), bestK);
+    }
+    bits.flush();
+
+    uint32_t size = out.size() - sizePos - 4;
+    for (int b = 0; b < 4; b++)
+        out[sizePos + b] = (uint8_t)(size >> (b * 8));
+}
+
+static void decodeRice(ByteReader &reader, uint32_t numFrames,
+                       float scale, float *out)
+{
+    uint32_t size = reader.le32();
+    BitReader bits(reader.bytes(size), size);
+
+    int32_t x1 = 0, x2 = 0; // history
+    for (uint32_t start = 0; start < numFrames; start += RICE_BLOCK_FRAMES) {
+        uint32_t n = std::min(numFrames - start, (uint32_t)RICE_BLOCK_FRAMES);
+        bits.refill();
+        int order = bits.get(2);
+        int k = bits.get(5);
+        if (order > 2 || k > MAX_RICE_K)
+            throw std::runtime_error("Invalid wave data");
+        float *blockOut = out + start;
+        for (uint32_t i = 0; i < n; i++) {
+            bits.refill();
+            uint32_t q = bits.peekZeros();
+            uint32_t u;
+            if (q >= RICE_ESCAPE) {
+                bits.skip(RICE_ESCAPE);
+                u = bits.get(RAW_BITS);
+            } else {
+                bits.skip(q + 1);
+                u = (q << k) | bits.get(k);
+            }
+            int32_t value = predict(order, x1, x2) + unzigzag(u);
+            x2 = x1;
+            x1 = value;
+            blockOut[i] = (float)value / scale;
+        }
+    }
+    if (bits.overrun())
+        throw std::runtime_error("Invalid wave data");
+}
+
+// return false if any value isn't exactly value / scale
+static bool quantize(const float *channel, size_t size, float scale,
+                     int32_t minVal, int32_t maxVal, vector<int32_t> &values)
+{
+    values.resize(size);
+    for (size_t i = 0; i < size; i++) {
+        float f = channel[i] * scale;
+        if (!(f >= minVal && f <= maxVal)) // also catches NaN
+            return false;
+        int32_t v = (int32_t)std::lround(f);
+        if ((float)v / scale != channel[i])
+            return false;
+        values[i] = v;
+    }
+    return true;
+}
+
+static void writeFloats(const float *channel, size_t size,
+                        vector<uint8_t> &out)
+{
+    size_t pos = out.size();
+    out.resize(pos + size * 4);
+    for (size_t s = 0; s < size; s++) {
+        uint32_t i;
+        std::memcpy(&i, &channel[s], 4);
+        for (int b = 0; b < 4; b++)
+            out[pos++] = (uint8_t)(i >> (b * 8));
+    }
+}
+
+WaveFormat encodeWave(const Wave &wave, vector<uint8_t> &out)
+{
+    int numChannels = wave.numChannels();
+    size_t length = wave.length();
+    // find the smallest integer scale that represents every channel exactly
+    int bits = 8;
+    vector<vector<int32_t>> values(numChannels);
+    for (int c = 0; c < numChannels && bits < 32; c++) {
+        if (bits == 8 && !quantize(wave.channel(c), length, 127.0f, -128, 127,
+                                   values[c]))
+            bits = 16;
+        if (bits == 16 && !quantize(wave.channel(c), length, 32767.0f,
+                                    -32768, 32767, values[c]))
+            bits = 32;
+    }
+    if (bits == 16) {
+        // earlier channels were quantized with the 8 bit scale
+        for (int c = 0; c < numChannels; c++)
+            quantize(wave.channel(c), length, 32767.0f, -32768, 32767,
+                     values[c]);
+    }
+
+    if (bits == 32) {
+        for (int c = 0; c < numChannels; c++)
+            writeFloats(wave.channel(c), length, out);
+        return WaveFormat::Float;
+    }
+
+    size_t start = out.size();
+    for (auto &channelValues : values)
+        encodeRice(channelValues, out);
+    size_t pcmSize = length * numChannels * (bits / 8);
+    if (out.size() - start < pcmSize)
+        return bits == 8 ? WaveFormat::Rice8 : WaveFormat::Rice16;
+
+    // compression didn't help (eg. noise)
+    out.resize(start);
+    for (auto &channelValues : values) {
+        for (int32_t v : channelValues) {
+            out.push_back((uint8_t)v);
+            if (bits == 16)
+                out.push_back((uint8_t)(v >> 8));
+        }
+    }
+    return bits == 8 ? WaveFormat::Int8 : WaveFormat::Int16;
+}
+
+bool decodeWave(ByteReader &reader, WaveFormat format, uint32_t numFrames,
+                uint16_t numChannels, vector<vector<float>> &wave)
+{
+    size_t bytesPerFrame;
+    switch (format) {
+    case WaveFormat::Float:
+        bytesPerFrame = 4;
+        break;
+    case WaveFormat::Int8:
+        bytesPerFrame = 1;
+        break;
+    case WaveFormat::Int16:
+        bytesPerFrame = 2;
+        break;
+    case WaveFormat::Rice8:
+    case WaveFormat::Rice16:
+        bytesPerFrame = 0; // at least
+        break;
+    default:
+        return false;
+    }
+    // before resizing
+    if ((uint64_t)numFrames * numChannels * bytesPerFrame
+            > reader.size() - reader.tell())
+        throw std::runtime_error("Unexpected end of file");
+
+    wave.resize(numChannels);
+    for (auto &channel : wave) {
+        channel.resize(numFrames);
+        float *out = channel.data();
+        switch (format) {
+        case WaveFormat::Float:
+            {
+                const uint8_t *data = reader.bytes(numFrames * 4);
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
+                // straight from the file mapping
+                std::memcpy(out, data, numFrames * 4);
+#else
+                for (uint32_t i = 0; i < numFrames; i++, data += 4) {
+                    uint32_t v = data[0] | (data[1] << 8) | (data[2] << 16)
+                        | ((uint32_t)data[3] << 24);
+                    std::memcpy(&out[i], &v, 4);
+                }
+#endif
+            }
+            break;
+        case WaveFormat::Int8:
+            {
+                const uint8_t *data = reader.bytes(numFrames);
+                for (uint32_t i = 0; i < numFrames; i++)
+                    out[i] = (float)(int8_t)data[i] / 127.0f;
+            }
+            break;
+        case WaveFormat::Int16:
+            {
+                const uint8_t *data = reader.bytes(numFrames * 2);
+                for (uint32_t i = 0; i < numFrames; i++, data += 2) {
+                    int16_t v = (int16_t)(data[0] | (data[1] << 8));
+                    out[i] = (float)v / 32767.0f;
+                }
+            }
+            break;
+        case WaveFormat::Rice8:
+            decodeRice(reader, numFrames, 127.0f, out);
+            break;
+        case WaveFormat::Rice16:
+            decodeRice(reader, numFrames, 32767.0f, out);
+            break;
+        }
+    }
+    return true;
+}
+
+} // namespace
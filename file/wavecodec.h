@@ -0,0 +1,33 @@
+#pragma once
+#include <common.h>
+
+#include "bytereader.h"
+#include "chroma.h"
+#include <sample.h>
+
+namespace chromatracker::file::chroma {
+
+// wave data encodings for .chroma files
+//
+// Float: raw 32-bit floats
+// Int8 / Int16: signed PCM, float value = int value / 127 (or 32767), the
+//   same conversion as ITLoader so converted modules are stored losslessly
+// Rice8 / Rice16: the same integers, compressed. each channel starts with its
+//   size in bytes (u32), followed by an MSB-first bit stream of blocks:
+//   2 bit predictor order (FLAC fixed predictors 0-2), 5 bit Rice parameter k,
+//   then a residual for each frame, zigzag encoded, as unary quotient (zeros
+//   terminated by a one) and k low bits. quotients >= RICE_ESCAPE are written
+//   as RICE_ESCAPE zeros followed by the raw 24 bit value
+const int RICE_BLOCK_FRAMES = 4096;
+const int RICE_ESCAPE = 24;
+// Float waves with at least this much data are mapped from the file by the
+// loader instead of decoded. integer waves are still compressed
+const size_t MAPPED_WAVE_BYTES = 4 << 20;
+
+// pick the smallest lossless format and encode all channels
+WaveFormat encodeWave(const Wave &wave, vector<uint8_t> &out);
+// return false for an unrecognized format. throws on invalid data
+bool decodeWave(ByteReader &reader, WaveFormat format, uint32_t numFrames,
+                uint16_t numChannels, vector<vector<float>> &wave);
+
+} // namespace
@@ -0,0 +1,290 @@
+#include "wavloader.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <SDL2/SDL_endian.h>
+
+namespace chromatracker::file {
+
+// http://soundfile.sapp.org/doc/WaveFormat/
+// https://www.recordingblogs.com/wiki/sample-chunk-of-a-wave-file
+
+const uint16_t FORMAT_PCM = 1;
+const uint16_t FORMAT_FLOAT = 3;
+const uint16_t FORMAT_EXTENSIBLE = 0xFFFE;
+
+const int MAX_CHANNELS = 256;
+// interleaved frames are converted in blocks of this size, then split
+const frames CONVERT_BLOCK_FRAMES = 4096;
+
+// unsigned integer of any size
+template<typename T>
+static inline T readLE(const uint8_t *p)
+{
+    T v;
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
+    std::memcpy(&v, p, sizeof(v));
+#else
+    v = 0;
+    for (int i = 0; i < sizeof(T); i++)
+        v |= (T)p[i] << (i * 8);
+#endif
+    return v;
+}
+
+// sample formats. read() converts one sample to -1 to 1
+struct U8Format
+{
+    static const int SIZE = 1;
+    static float read(const uint8_t *p)
+    {
+        return (float)(p[0] - 128) * (1.0f / 128);
+    }
+};
+
+struct S16Format
+{
+    static const int SIZE = 2;
+    static float read(const uint8_t *p)
+    {
+        return (float)(int16_t)readLE<uint16_t>(p) * (1.0f / 32768);
+    }
+};
+
+struct S24Format
+{
+    static const int SIZE = 3;
+    static float read(const uint8_t *p)
+    {
+        // sign extend from the top byte
+        int32_t v = (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16)
+                              | ((uint32_t)p[2] << 24)) >> 8;
+        return (float)v * (1.0f / 8388608);
+    }
+};
+
+struct S32Format
+{
+    static const int SIZE = 4;
+    static float read(const uint8_t *p)
+    {
+        return (float)(int32_t)readLE<uint32_t>(p) * (1.0f / 2147483648.0f);
+    }
+};
+
+struct F32Format
+{
+    static const int SIZE = 4;
+    static float read(const uint8_t *p)
+    {
+        uint32_t i = readLE<uint32_t>(p);
+        float v;
+        std::memcpy(&v, &i, sizeof(v));
+        return v;
+    }
+};
+
+struct F64Format
+{
+    static const int SIZE = 8;
+    static float read(const uint8_t *p)
+    {
+        uint64_t i = readLE<uint64_t>(p);
+        double v;
+        std::memcpy(&v, &i, sizeof(v));
+        return (float)v;
+    }
+};
+
+// contiguous loop with a constant stride, so the compiler can vectorize it
+template<typename Format>
+static void convert(const uint8_t *src, size_t count, float *out)
+{
+    for (size_t i = 0; i < count; i++)
+        out[i] = Format::read(src + i * Format::SIZE);
+}
+
+template<typename Format>
+static void convertFrames(const uint8_t *data, frames numFrames,
+                          vector<vector<float>> &channels)
+{
+    size_t numChannels = channels.size();
+    for (auto &channel : channels)
+        channel.resize(numFrames);
+    if (numChannels == 1) {
+        convert<Format>(data, numFrames, channels[0].data());
+        return;
+    }
+
+    // convert interleaved samples in blocks that stay in cache, then split
+    // them into channels
+    vector<float> block(CONVERT_BLOCK_FRAMES * numChannels);
+    for (frames start = 0; start < numFrames; start += CONVERT_BLOCK_FRAMES) {
+        frames count = std::min(CONVERT_BLOCK_FRAMES, numFrames - start);
+        convert<Format>(data + (size_t)start * numChannels * Format::SIZE,
+                        (size_t)count * numChannels, block.data());
+        for (size_t c = 0; c < numChannels; c++) {
+            const float *in = block.data() + c;
+            float *out = channels[c].data() + start;
+            for (frames f = 0; f < count; f++)
+                out[f] = in[f * numChannels];
+        }
+    }
+}
+
+WAVLoader::WAVLoader(MappedFile *file, string name)
+    : file(file)
+    , name(name)
+{}
+
+void WAVLoader::loadSample(shared_ptr<Sample> sample)
+{
+    readChunks();
+
+    sample->name = name;
+    sample->frameRate = frameRate;
+    sample->loopMode = Sample::LoopMode::Once;
+    if (hasLoop)
+        readLoop(loopChunk, sample);
+    if (sample->loopMode == Sample::LoopMode::Once
+            || sample->loopEnd > numFrames
+            || sample->loopStart >= sample->loopEnd) {
+        sample->loopMode = Sample::LoopMode::Once;
+        sample->loopStart = 0;
+        sample->loopEnd = numFrames;
+    }
+
+    vector<vector<float>> channels(numChannels);
+    loadWave(data, numFrames, channels);
+    sample->wave = Wave(std::move(channels));
+}
+
+FileInfo WAVLoader::loadInfo()
+{
+    readChunks();
+    FileInfo info;
+    info.title = name;
+    info.numChannels = numChannels;
+    info.seconds = (float)numFrames / frameRate;
+    return info;
+}
+
+void WAVLoader::readChunks()
+{
+    ByteReader reader(file->data(), file->size());
+    if (std::memcmp(reader.bytes(4), "RIFF", 4))
+        throw std::runtime_error("Not a RIFF file");
+    reader.skip(4); // size (often wrong)
+    if (std::memcmp(reader.bytes(4), "WAVE", 4))
+        throw std::runtime_error("Not a WAVE file");
+
+    data = nullptr;
+    numFrames = 0;
+    hasLoop = false;
+    while (reader.size() - reader.tell() >= 8) {
+        const uint8_t *id = reader.bytes(4);
+        // truncated files are common, the last chunk may be cut off
+        size_t size = std::min<size_t>(reader.le32(),
+                                       reader.size() - reader.tell());
+        ByteReader chunk(reader.bytes(size), size);
+        if (size & 1) // padding
+            reader.seek(std::min(reader.tell() + 1, reader.size()));
+
+        if (!std::memcmp(id, "fmt ", 4)) {
+            readFormat(chunk);
+        } else if (!std::memcmp(id, "data", 4)) {
+            if (!numChannels)
+                throw std::runtime_error("Data before format");
+            data = chunk.bytes(0);
+            numFrames = (frames)std::min<size_t>(
+                size / (numChannels * sampleBytes), INT32_MAX);
+        } else if (!std::memcmp(id, "smpl", 4)) {
+            loopChunk = chunk;
+            hasLoop = true;
+        }
+    }
+    if (!data || numFrames == 0)
+        throw std::runtime_error("Missing data");
+}
+
+void WAVLoader::readFormat(ByteReader chunk)
+{
+    uint16_t format = chunk.le16();
+    numChannels = chunk.le16();
+    frameRate = chunk.le32();
+    chunk.skip(4); // bytes per second
+    uint16_t blockAlign = chunk.le16();
+    uint16_t bitsPerSample = chunk.le16();
+    if (format == FORMAT_EXTENSIBLE) {
+        chunk.skip(2 + 2 + 4); // extension size, valid bits, channel mask
+        format = chunk.le16(); // first two bytes of the subformat GUID
+    }
+
+    if (format == FORMAT_PCM)
+        encoding = Encoding::PCM;
+    else if (format == FORMAT_FLOAT)
+        encoding = Encoding::Float;
+    else
+        throw std::runtime_error("Unsupported format");
+    if (numChannels <= 0 || numChannels > MAX_CHANNELS)
+        throw std::runtime_error("Invalid number of channels");
+    if (frameRate <= 0)
+        throw std::runtime_error("Invalid frame rate");
+    // samples with fewer bits (eg. 20) are padded to whole bytes
+    if (blockAlign && blockAlign % numChannels == 0)
+        sampleBytes = blockAlign / numChannels;
+    else
+        sampleBytes = (bitsPerSample + 7) / 8;
+
+    bool valid;
+    if (encoding == Encoding::Float)
+        valid = sampleBytes == 4 || sampleBytes == 8;
+    else
+        valid = sampleBytes >= 1 && sampleBytes <= 4;
+    if (!valid)
+        throw std::runtime_error("Unsupported sample size");
+}
+
+void WAVLoader::readLoop(ByteReader chunk, shared_ptr<Sample> sample) const
+{
+    // manufacturer, product, period, unity note, pitch fraction,
+    // SMPTE format, SMPTE offset
+    chunk.skip(7 * 4);
+    uint32_t numLoops = chunk.le32();
+    chunk.skip(4); // sampler data
+    if (numLoops == 0)
+        return;
+
+    chunk.skip(4); // cue point ID
+    uint32_t type = chunk.le32();
+    uint32_t start = chunk.le32();
+    uint32_t end = chunk.le32(); // inclusive
+    if (type == 0)
+        sample->loopMode = Sample::LoopMode::Forward;
+    else if (type == 1)
+        sample->loopMode = Sample::LoopMode::PingPong;
+    else // backward and manufacturer-specific loops aren't supported
+        return;
+    sample->loopStart = (frames)std::min<uint32_t>(start, INT32_MAX);
+    sample->loopEnd = (frames)std::min<uint32_t>(end, INT32_MAX - 1) + 1;
+}
+
+void WAVLoader::loadWave(const uint8_t *data, frames numFrames,
+                         vector<vector<float>> &channels) const
+{
+    if (encoding == Encoding::Float) {
+        if (sampleBytes == 4)
+            convertFrames<F32Format>(data, numFrames, channels);
+        else
+            convertFrames<F64Format>(data, numFrames, channels);
+        return;
+    }
+    switch (sampleBytes) {
+    case 1: convertFrames<U8Format>(data, numFrames, channels); break;
+    case 2: convertFrames<S16Format>(data, numFrames, channels); break;
+    case 3: convertFrames<S24Format>(data, numFrames, channels); break;
+    case 4: convertFrames<S32Format>(data, numFrames, channels); break;
+    }
+}
+
+} // namespace
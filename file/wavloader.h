@@ -0,0 +1,48 @@
+#pragma once
+#include <common.h>
+
+#include "bytereader.h"
+#include "mappedfile.h"
+#include "types.h"
+#include <song.h>
+
+namespace chromatracker::file {
+
+// RIFF WAVE files: 8/16/24/32-bit PCM or 32/64-bit float, any number of
+// channels. loop points are read from the smpl chunk
+class WAVLoader : public SampleLoader
+{
+public:
+    WAVLoader(MappedFile *file, string name); // takes ownership of file
+
+    void loadSample(shared_ptr<Sample> sample) override;
+    FileInfo loadInfo() override;
+
+private:
+    enum class Encoding
+    {
+        PCM, Float
+    };
+
+    void readChunks();
+    void readFormat(ByteReader chunk);
+    void readLoop(ByteReader chunk, shared_ptr<Sample> sample) const;
+    void loadWave(const uint8_t *data, frames numFrames,
+                  vector<vector<float>> &channels) const;
+
+    unique_ptr<MappedFile> file;
+    string name;
+
+    // from the fmt chunk
+    Encoding encoding {Encoding::PCM};
+    int numChannels {0};
+    int sampleBytes {0}; // container size of one sample in one channel
+    frames frameRate {0};
+    // from readChunks
+    const uint8_t *data {nullptr};
+    frames numFrames {0};
+    bool hasLoop {false};
+    ByteReader loopChunk;
+};
+
+} // namespace
@@ -0,0 +1,148 @@
+#pragma once
+#include <common.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+
+namespace chromatracker {
+
+// bounded multi-producer, single-consumer queue. never blocks or allocates
+// based on Dmitry Vyukov's bounded MPMC queue:
+// https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+template<typename T, size_t N>
+class MPSCQueue : noncopyable
+{
+    static_assert((N & (N - 1)) == 0, "size must be a power of two");
+
+    struct Cell
+    {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    std::array<Cell, N> cells;
+    alignas(64) std::atomic<size_t> tail {0}; // shared by producers
+    alignas(64) size_t head {0}; // consumer only
+
+public:
+    MPSCQueue()
+    {
+        for (size_t i = 0; i < N; i++)
+            cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    // any thread. return false if the queue is full
+    bool push(const T &value)
+    {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true) {
+            cell = &cells[pos & (N - 1)];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false; // full
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = value;
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer thread only. return false if the queue is empty
+    bool pop(T &value)
+    {
+        Cell *cell = &cells[head & (N - 1)];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        if ((intptr_t)seq - (intptr_t)(head + 1) < 0)
+            return false; // empty (or producer hasn't finished writing)
+        value = std::move(cell->value);
+        cell->seq.store(head + N, std::memory_order_release);
+        head++;
+        return true;
+    }
+};
+
+// single-producer, single-consumer ring buffer for blocks of values
+template<typename T>
+class SPSCRing : noncopyable
+{
+    const size_t capacity; // power of two
+    unique_ptr<T[]> buffer;
+    alignas(64) std::atomic<size_t> writePos {0};
+    alignas(64) std::atomic<size_t> readPos {0};
+
+    static size_t roundCapacity(size_t minCapacity)
+    {
+        size_t c = 1;
+        while (c < minCapacity)
+            c <<= 1;
+        return c;
+    }
+
+public:
+    SPSCRing(size_t minCapacity)
+        : capacity(roundCapacity(minCapacity))
+        , buffer(new T[capacity])
+    {}
+
+    // number of values available to read
+    size_t size() const
+    {
+        return writePos.load(std::memory_order_acquire)
+            - readPos.load(std::memory_order_acquire);
+    }
+
+    // producer only. return number of values written (may be less if full)
+    size_t write(const T *values, size_t count)
+    {
+        size_t w = writePos.load(std::memory_order_relaxed);
+        size_t r = readPos.load(std::memory_order_acquire);
+        count = std::min(count, capacity - (w - r));
+        size_t start = w & (capacity - 1);
+        size_t first = std::min(count, capacity - start);
+        std::copy(values, values + first, &buffer[start]);
+        std::copy(values + first, values + count, &buffer[0]);
+        writePos.store(w + count, std::memory_order_release);
+        return count;
+    }
+
+    // total number of values written, a position for skipTo
+    size_t written() const
+    {
+        return writePos.load(std::memory_order_acquire);
+    }
+
+    // consumer only. drop values before pos (not past what was written)
+    void skipTo(size_t pos)
+    {
+        size_t r = readPos.load(std::memory_order_relaxed);
+        size_t w = writePos.load(std::memory_order_acquire);
+        pos = std::min(pos, w);
+        if (pos > r)
+            readPos.store(pos, std::memory_order_release);
+    }
+
+    // consumer only. return number of values read (may be less if empty)
+    size_t read(T *values, size_t count)
+    {
+        size_t r = readPos.load(std::memory_order_relaxed);
+        size_t w = writePos.load(std::memory_order_acquire);
+        count = std::min(count, w - r);
+        size_t start = r & (capacity - 1);
+        size_t first = std::min(count, capacity - start);
+        std::copy(&buffer[start], &buffer[start] + first, values);
+        std::copy(&buffer[0], &buffer[0] + (count - first), values + first);
+        readPos.store(r + count, std::memory_order_release);
+        return count;
+    }
+};
+
+} // namespace
@@ -0,0 +1,136 @@
+#include "parallel.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+namespace chromatracker {
+
+namespace {
+
+// one call to parallelFor, lives on the caller's stack
+struct Job
+{
+    const std::function<void(size_t)> *fn;
+    size_t count;
+    std::atomic<size_t> next {0};
+    int numHelpers {0}; // pool threads working on it (protected by pool mutex)
+    std::mutex errorMu;
+    std::exception_ptr error;
+
+    void work()
+    {
+        size_t i;
+        while ((i = next++) < count) {
+            try {
+                (*fn)(i);
+            } catch (...) {
+                std::unique_lock lock(errorMu);
+                if (!error)
+                    error = std::current_exception();
+                next = count;
+            }
+        }
+    }
+};
+
+// threads which help with every parallelFor call, started on first use.
+// calls from several threads at once share them
+class WorkerPool
+{
+public:
+    WorkerPool()
+    {
+        for (int t = 1; t < numWorkers(); t++)
+            threads.emplace_back(&WorkerPool::run, this);
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::unique_lock lock(mu);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto &thread : threads)
+            thread.join();
+    }
+
+    void runJob(Job *job)
+    {
+        {
+            std::unique_lock lock(mu);
+            jobs.push_back(job);
+        }
+        cv.notify_all();
+        job->work(); // the calling thread works too
+
+        std::unique_lock lock(mu);
+        remove(job);
+        // items are all taken, wait for the ones still running
+        doneCv.wait(lock, [job] { return job->numHelpers == 0; });
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock lock(mu);
+        while (true) {
+            cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (stopping)
+                return;
+            Job *job = jobs.front();
+            job->numHelpers++;
+            lock.unlock();
+            job->work();
+            lock.lock();
+            remove(job); // no items left
+            if (--job->numHelpers == 0)
+                doneCv.notify_all();
+        }
+    }
+
+    void remove(Job *job) // mutex must be locked
+    {
+        auto it = std::find(jobs.begin(), jobs.end(), job);
+        if (it != jobs.end())
+            jobs.erase(it);
+    }
+
+    std::mutex mu; // protects everything below
+    std::condition_variable cv; // jobs added or stopping
+    std::condition_variable doneCv; // a helper finished a job
+    std::deque<Job *> jobs; // with items left to take
+    bool stopping {false};
+
+    vector<std::thread> threads;
+};
+
+} // namespace
+
+int numWorkers()
+{
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+void parallelFor(size_t count, const std::function<void(size_t)> &fn)
+{
+    if (count <= 1 || numWorkers() <= 1) {
+        for (size_t i = 0; i < count; i++)
+            fn(i);
+        return;
+    }
+
+    static WorkerPool pool;
+    Job job;
+    job.fn = &fn;
+    job.count = count;
+    pool.runJob(&job);
+    if (job.error)
+        std::rethrow_exception(job.error);
+}
+
+} // namespace
@@ -0,0 +1,18 @@
+#pragma once
+#include <common.h>
+
+#include <functional>
+
+namespace chromatracker {
+
+// number of threads used by parallelFor (at least 1)
+int numWorkers();
+
+// call fn(0) ... fn(count - 1) on a persistent pool of numWorkers() - 1
+// threads and the calling thread, and wait for all to finish. items are handed
+// out one at a time so uneven work is balanced. can be called from several
+// threads at once (and from fn). the first exception thrown is rethrown here
+// (remaining items are skipped)
+void parallelFor(size_t count, const std::function<void(size_t)> &fn);
+
+} // namespace
@@ -0,0 +1,30 @@
+#include "frameclock.h"
+
+namespace chromatracker::play {
+
+void FrameClock::publish(ClockPoint point)
+{
+    // only one writer (audio thread)
+    uint32_t s = seq.load(std::memory_order_relaxed);
+    seq.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    frame.store(point.frame, std::memory_order_relaxed);
+    time.store(point.time, std::memory_order_relaxed);
+    seq.store(s + 2, std::memory_order_release);
+}
+
+ClockPoint FrameClock::read() const
+{
+    ClockPoint point;
+    uint32_t s1, s2;
+    do {
+        s1 = seq.load(std::memory_order_acquire);
+        point.frame = frame.load(std::memory_order_relaxed);
+        point.time = time.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        s2 = seq.load(std::memory_order_relaxed);
+    } while ((s1 & 1) || s1 != s2);
+    return point;
+}
+
+} // namespace
@@ -0,0 +1,31 @@
+#pragma once
+#include <common.h>
+
+#include <atomic>
+
+namespace chromatracker::play {
+
+// a point on the output timeline: an output frame and the timer value when it
+// was passed to the audio device
+struct ClockPoint
+{
+    int64_t frame {0};
+    uint64_t time {0}; // high resolution timer (eg. SDL performance counter)
+};
+
+// published by the audio thread at the start of each callback, readable from
+// any thread without locking
+class FrameClock
+{
+public:
+    void publish(ClockPoint point);
+    ClockPoint read() const;
+
+private:
+    // seqlock: odd while writing
+    std::atomic<uint32_t> seq {0};
+    std::atomic<int64_t> frame {0};
+    std::atomic<uint64_t> time {0};
+};
+
+} // namespace
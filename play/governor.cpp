@@ -0,0 +1,81 @@
+#include "governor.h"
+#include <algorithm>
+
+namespace chromatracker::play {
+
+const float HIGH_LOAD = 0.7f;
+const float LOW_LOAD = 0.4f;
+const float LOAD_SMOOTHING = 0.1f; // per tick
+const int HOLD_TICKS = 8;
+const int RESTORE_TICKS = 200; // a few seconds
+const int MIN_VOICES = 4;
+
+void OverloadGovernor::update(float load, int activeVoices)
+{
+    float smoothLoad = _load + (load - _load) * LOAD_SMOOTHING;
+    _load = smoothLoad;
+
+    if (holdTicks > 0) {
+        holdTicks--;
+        return;
+    }
+
+    if (smoothLoad > HIGH_LOAD) {
+        lowTicks = 0;
+        if (_interpolation != Interpolation::Nearest) {
+            _interpolation = Interpolation::Nearest;
+            qualityDrops++;
+        } else {
+            int voices = std::min(_maxVoices, activeVoices);
+            _maxVoices = std::max(MIN_VOICES, voices * 3 / 4);
+        }
+        holdTicks = HOLD_TICKS;
+    } else if (smoothLoad < LOW_LOAD) {
+        if (++lowTicks < RESTORE_TICKS)
+            return;
+        lowTicks = 0;
+        if (_maxVoices != UNLIMITED_VOICES) {
+            if (_maxVoices >= activeVoices)
+                _maxVoices = UNLIMITED_VOICES;
+            else
+                _maxVoices += std::max(1, _maxVoices / 4);
+        } else {
+            _interpolation = Interpolation::Linear;
+        }
+        holdTicks = HOLD_TICKS;
+    } else {
+        lowTicks = 0;
+    }
+}
+
+Interpolation OverloadGovernor::interpolation() const
+{
+    return _interpolation;
+}
+
+int OverloadGovernor::maxVoices() const
+{
+    return _maxVoices;
+}
+
+float OverloadGovernor::load() const
+{
+    return _load;
+}
+
+uint32_t OverloadGovernor::numQualityDrops() const
+{
+    return qualityDrops;
+}
+
+uint32_t OverloadGovernor::numVoicesDropped() const
+{
+    return voicesDropped;
+}
+
+void OverloadGovernor::countVoicesDropped(uint32_t count)
+{
+    voicesDropped += count;
+}
+
+} // namespace
@@ -0,0 +1,40 @@
+#pragma once
+#include <common.h>
+
+#include "sampleplay.h"
+#include <atomic>
+
+namespace chromatracker::play {
+
+// reduces rendering cost when rendering can't keep up with real time.
+// first lowers interpolation quality, then limits the number of voices.
+// restores one step at a time when load falls
+class OverloadGovernor
+{
+public:
+    static const int UNLIMITED_VOICES = INT32_MAX;
+
+    // render thread. load is render time / real time for the last tick
+    void update(float load, int activeVoices);
+
+    Interpolation interpolation() const;
+    int maxVoices() const;
+
+    // readable from any thread
+    float load() const; // smoothed
+    uint32_t numQualityDrops() const;
+    uint32_t numVoicesDropped() const;
+    void countVoicesDropped(uint32_t count);
+
+private:
+    Interpolation _interpolation {Interpolation::Linear};
+    int _maxVoices {UNLIMITED_VOICES};
+    int holdTicks {0}; // wait for a change to take effect
+    int lowTicks {0}; // consecutive ticks under low threshold
+
+    std::atomic<float> _load {0};
+    std::atomic<uint32_t> qualityDrops {0};
+    std::atomic<uint32_t> voicesDropped {0};
+};
+
+} // namespace
@@ -3,73 +3,101 @@
 
 namespace chromatracker::play {
 
-const int NUM_JAM_TRACKS = 8;
-
 Jam::Jam()
 {
-    jamTracks.resize(NUM_JAM_TRACKS);
-    jamTrackTouches.resize(NUM_JAM_TRACKS);
-    std::fill(jamTrackTouches.begin(), jamTrackTouches.end(), 0);
+    jamTrackTouches.fill(0);
 }
 
 void Jam::stop()
 {
-    for (auto &track : jamTracks) {
-        track.stop();
-    }
-    jamTouchTracks.clear();
-    std::fill(jamTrackTouches.begin(), jamTrackTouches.end(), 0);
+    // jam tracks are only accessed by the audio thread
+    stops++;
 }
 
-void Jam::queueJamEvent(const JamEvent &jam)
+bool Jam::queueJamEvent(const JamEvent &jam)
 {
-    jamEvents[(jamEventI + numJamEvents) % jamEvents.size()] = jam;
-    if (numJamEvents == jamEvents.size()) {
-        jamEventI++;
-    } else {
-        numJamEvents++;
+    JamEvent tagged = jam;
+    tagged.stops = stops;
+    if (!jamEvents.push(tagged)) {
+        overflows++;
+        return false;
     }
+    return true;
+}
+
+uint32_t Jam::numOverflows() const
+{
+    return overflows;
 }
 
 void Jam::processJamEvent(const JamEvent &jam)
 {
-    int trackIndex;
-    if (jamTouchTracks.count(jam.touchId)) {
-        trackIndex = jamTouchTracks[jam.touchId];
-    } else {
-        auto it = std::find(jamTrackTouches.begin(), jamTrackTouches.end(), 0);
+    auto it = std::find(jamTrackTouches.begin(), jamTrackTouches.end(),
+                        jam.touchId);
+    if (it == jamTrackTouches.end()) {
+        it = std::find(jamTrackTouches.begin(), jamTrackTouches.end(), 0);
         if (it == jamTrackTouches.end())
             return; // limit number of touches at once
-        trackIndex = it - jamTrackTouches.begin();
-        jamTouchTracks[jam.touchId] = trackIndex;
-        jamTrackTouches[trackIndex] = jam.touchId;
-        //cout << "assign " <<jam.touchId<< " to track " <<trackIndex<< "\n";
+        *it = jam.touchId;
     }
+    int trackIndex = it - jamTrackTouches.begin();
     jamTracks[trackIndex].processEvent(jam.event);
     if (jam.event.special == Event::Special::FadeOut) {
-        jamTouchTracks.erase(jam.touchId);
         jamTrackTouches[trackIndex] = 0;
     }
 }
 
 void Jam::processTick(float *tickBuffer, frames tickFrames,
-                      frames outFrameRate, float globalAmp)
+                      frames outFrameRate, float globalAmp, int64_t tickFrame)
 {
-    for (int i = 0; i < numJamEvents; i++) {
-        JamEvent *jam = &jamEvents[(i + jamEventI) % jamEvents.size()];
-        if (jam->event.time == 0) {
-            processJamEvent(*jam);
-            jamEventI++;
-            numJamEvents--;
-            i--;
-        } else {
-            jam->event.time -= 1;
+    uint32_t newStops = stops;
+    if (newStops != stopsDone) {
+        for (auto &track : jamTracks) {
+            track.stop();
         }
+        jamTrackTouches.fill(0);
+        stopsDone = newStops;
     }
 
+    frames pos = 0;
+    // events are in input order, don't reorder them
+    while (hasNextEvent || (hasNextEvent = jamEvents.pop(nextEvent))) {
+        if ((int32_t)(nextEvent.stops - stopsDone) < 0) {
+            // queued before a stop, must not sound after it
+            hasNextEvent = false;
+            continue;
+        } else if (nextEvent.stops != stopsDone) {
+            break; // queued after a stop that takes effect next tick
+        }
+        int64_t offset = nextEvent.frame - tickFrame;
+        if (offset >= tickFrames)
+            break;
+        if (offset > pos) {
+            processFrames(tickBuffer + pos * 2, offset - pos,
+                          outFrameRate, globalAmp);
+            pos = offset;
+        }
+        processJamEvent(nextEvent);
+        lastEventFrame = tickFrame + pos;
+        lastEventInputTime = nextEvent.inputTime;
+        hasNextEvent = false;
+    }
+
+    processFrames(tickBuffer + pos * 2, tickFrames - pos,
+                  outFrameRate, globalAmp);
+    for (auto &track : jamTracks) {
+        track.processEffects();
+    }
+}
+
+void Jam::processFrames(float *buffer, frames numFrames,
+                        frames outFrameRate, float globalAmp)
+{
+    if (numFrames <= 0)
+        return;
     for (auto &track : jamTracks) {
-        track.processTick(tickBuffer, tickFrames,
-                          outFrameRate, globalAmp, globalAmp);
+        track.processFrames(buffer, numFrames,
+                            outFrameRate, globalAmp, globalAmp);
     }
 }
 
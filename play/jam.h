@@ -3,37 +3,61 @@
 
 #include "trackplay.h"
 #include <event.h>
+#include <lockfree.hpp>
 #include <array>
-#include <unordered_map>
+#include <atomic>
 
 namespace chromatracker::play {
 
 struct JamEvent
 {
-    Event event;
+    Event event; // time is ignored
     int touchId {0}; // 0 should not be used
+    int64_t frame {0}; // output frame to start playing (see FrameClock)
+    uint64_t inputTime {0}; // timer value when the input happened
+    uint32_t stops {0}; // number of stops before it was queued (set by Jam)
 };
 
 class Jam
 {
+    static const int NUM_JAM_TRACKS = 8;
+
 public:
     Jam();
 
+    // takes effect on the next tick, doesn't require lock.
+    // events queued before the stop are discarded
     void stop();
-    // event time is interpreted as delay
-    void queueJamEvent(const JamEvent &jam);
+    // can be called from any thread without locking.
+    // return false if the queue overflowed (event is lost)
+    bool queueJamEvent(const JamEvent &jam);
     void processJamEvent(const JamEvent &jam);
+    // tickFrame is the output frame at the start of the tick. events are
+    // played at their exact frame within the tick
     void processTick(float *tickBuffer, frames tickFrames,
-                     frames outFrameRate, float globalAmp);
+                     frames outFrameRate, float globalAmp, int64_t tickFrame);
 
-private:
-    std::array<JamEvent, 32> jamEvents; // circular buffer
-    int jamEventI {0}, numJamEvents {0};
+    // number of events lost because the queue was full
+    uint32_t numOverflows() const;
 
-    vector<TrackPlay> jamTracks;
+    // last event played (audio thread only), for measuring latency
+    int64_t lastEventFrame {-1};
+    uint64_t lastEventInputTime {0};
 
-    std::unordered_map<int, int8_t> jamTouchTracks;
-    vector<int> jamTrackTouches;
+private:
+    void processFrames(float *buffer, frames numFrames,
+                       frames outFrameRate, float globalAmp);
+
+    std::atomic<uint32_t> stops {0};
+    uint32_t stopsDone {0}; // audio thread
+    MPSCQueue<JamEvent, 256> jamEvents;
+    std::atomic<uint32_t> overflows {0};
+    // popped from the queue but not played yet (audio thread)
+    JamEvent nextEvent;
+    bool hasNextEvent {false};
+
+    std::array<TrackPlay, NUM_JAM_TRACKS> jamTracks;
+    std::array<int, NUM_JAM_TRACKS> jamTrackTouches; // 0 if track is free
 };
 
 } // namespace
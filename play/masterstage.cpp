@@ -0,0 +1,193 @@
+#include "masterstage.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) \
+    || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MASTER_SSE
+#include <immintrin.h>
+#endif
+
+namespace chromatracker::play {
+
+const float LIMIT_THRESHOLD = 0.98f;
+const float LOOKAHEAD_SECONDS = 0.0015f;
+const float RELEASE_SECONDS = 0.1f;
+
+void disableDenormals()
+{
+#ifdef MASTER_SSE
+    // FTZ (bit 15) | DAZ (bit 6)
+    _mm_setcsr(_mm_getcsr() | 0x8040);
+#endif
+}
+
+// gain to bring each frame under the threshold (1 if already under)
+static void requiredGains(const float *buffer, float *gains, frames numFrames)
+{
+    frames f = 0;
+#ifdef MASTER_SSE
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    const __m128 threshold = _mm_set1_ps(LIMIT_THRESHOLD);
+    for (; f + 4 <= numFrames; f += 4) {
+        __m128 a = _mm_and_ps(_mm_loadu_ps(buffer + f * 2), absMask);
+        __m128 b = _mm_and_ps(_mm_loadu_ps(buffer + f * 2 + 4), absMask);
+        __m128 left = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 right = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        __m128 peak = _mm_max_ps(_mm_max_ps(left, right), threshold);
+        _mm_storeu_ps(gains + f, _mm_div_ps(threshold, peak));
+    }
+#endif
+    for (; f < numFrames; f++) {
+        float peak = std::max(std::abs(buffer[f * 2]),
+                              std::abs(buffer[f * 2 + 1]));
+        gains[f] = LIMIT_THRESHOLD / std::max(peak, LIMIT_THRESHOLD);
+    }
+}
+
+static void applyGains(const float *in, const float *gains, float *out,
+                       frames numFrames)
+{
+    frames f = 0;
+#ifdef MASTER_SSE
+    for (; f + 4 <= numFrames; f += 4) {
+        __m128 g = _mm_loadu_ps(gains + f);
+        __m128 a = _mm_loadu_ps(in + f * 2), b = _mm_loadu_ps(in + f * 2 + 4);
+        _mm_storeu_ps(out + f * 2, _mm_mul_ps(a, _mm_unpacklo_ps(g, g)));
+        _mm_storeu_ps(out + f * 2 + 4, _mm_mul_ps(b, _mm_unpackhi_ps(g, g)));
+    }
+#endif
+    for (; f < numFrames; f++) {
+        out[f * 2] = in[f * 2] * gains[f];
+        out[f * 2 + 1] = in[f * 2 + 1] * gains[f];
+    }
+}
+
+static void clip(float *samples, size_t numSamples)
+{
+    size_t i = 0;
+#ifdef MASTER_SSE
+    const __m128 hi = _mm_set1_ps(1.0f), lo = _mm_set1_ps(-1.0f);
+    for (; i + 4 <= numSamples; i += 4) {
+        __m128 v = _mm_loadu_ps(samples + i);
+        _mm_storeu_ps(samples + i, _mm_max_ps(_mm_min_ps(v, hi), lo));
+    }
+#endif
+    for (; i < numSamples; i++) {
+        samples[i] = std::max(std::min(samples[i], 1.0f), -1.0f);
+    }
+}
+
+MasterStage::MasterStage(frames outFrameRate, frames maxBlockFrames)
+    : lookahead(std::max(1, (frames)(LOOKAHEAD_SECONDS * outFrameRate)))
+    , maxBlockFrames(std::max(1, maxBlockFrames))
+    // reach the target gain within the lookahead
+    , attackCoef(1.0f - std::exp(-4.0f / lookahead))
+    , releaseCoef(1.0f - std::exp(-1.0f / (RELEASE_SECONDS * outFrameRate)))
+    , delay((lookahead + this->maxBlockFrames) * 2, 0.0f)
+    , gains(this->maxBlockFrames)
+    , windowGain(lookahead + 1)
+    , windowFrame(lookahead + 1)
+{}
+
+bool MasterStage::limiter() const
+{
+    return _limiter;
+}
+
+void MasterStage::setLimiter(bool enable)
+{
+    _limiter = enable;
+    gain = 1;
+    std::fill(delay.begin(), delay.end(), 0.0f);
+    windowHead = windowCount = 0;
+}
+
+frames MasterStage::latency() const
+{
+    return _limiter ? lookahead : 0;
+}
+
+bool MasterStage::dither() const
+{
+    return _dither;
+}
+
+void MasterStage::setDither(bool enable)
+{
+    _dither = enable;
+}
+
+void MasterStage::process(float *buffer, frames numFrames)
+{
+    if (_limiter) {
+        for (frames f = 0; f < numFrames; f += maxBlockFrames)
+            limit(buffer + f * 2, std::min(numFrames - f, maxBlockFrames));
+    }
+    // catches anything the limiter didn't (or everything if disabled)
+    clip(buffer, numFrames * 2);
+}
+
+void MasterStage::toInt16(const float *in, int16_t *out, size_t numSamples)
+{
+    uint32_t x = rngState;
+    for (size_t i = 0; i < numSamples; i++) {
+        float v = in[i] * 32767.0f;
+        if (_dither) {
+            // xorshift, difference of two uniform values is triangular
+            // (+-1 LSB)
+            x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+            float r1 = (x >> 8) * (1.0f / 16777216.0f);
+            x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+            float r2 = (x >> 8) * (1.0f / 16777216.0f);
+            v += r1 - r2;
+        }
+        v = std::floor(v + 0.5f);
+        out[i] = (int16_t)std::max(std::min(v, 32767.0f), -32768.0f);
+    }
+    rngState = x;
+}
+
+void MasterStage::limit(float *buffer, frames numFrames)
+{
+    std::copy(buffer, buffer + numFrames * 2, delay.begin() + lookahead * 2);
+    requiredGains(buffer, gains.data(), numFrames);
+
+    // the sliding minimum and smoothing depend on the previous frame
+    const size_t capacity = windowGain.size();
+    for (frames f = 0; f < numFrames; f++, inputFrame++) {
+        float required = gains[f];
+
+        // window covers the frames from the output frame to the input frame
+        if (windowCount > 0
+                && windowFrame[windowHead] < inputFrame - lookahead) {
+            windowHead = (windowHead + 1) % capacity;
+            windowCount--;
+        }
+        // push to window, dropping larger gains which can't be the minimum
+        while (windowCount > 0) {
+            size_t back = (windowHead + windowCount - 1) % capacity;
+            if (windowGain[back] < required)
+                break;
+            windowCount--;
+        }
+        size_t back = (windowHead + windowCount) % capacity;
+        windowGain[back] = required;
+        windowFrame[back] = inputFrame;
+        windowCount++;
+        float target = windowGain[windowHead];
+
+        if (target < gain)
+            gain += (target - gain) * attackCoef;
+        else
+            gain += (target - gain) * releaseCoef;
+        gains[f] = gain;
+    }
+
+    // output the frames from lookahead ago
+    applyGains(delay.data(), gains.data(), buffer, numFrames);
+    std::copy(delay.begin() + numFrames * 2,
+              delay.begin() + (numFrames + lookahead) * 2, delay.begin());
+}
+
+} // namespace
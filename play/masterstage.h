@@ -0,0 +1,56 @@
+#pragma once
+#include <common.h>
+
+#include <units.h>
+
+namespace chromatracker::play {
+
+// enable flush-to-zero / denormals-are-zero on the calling thread, so fading
+// tails don't slow down the mixer. call at the start of every render thread
+void disableDenormals();
+
+// final processing of the stereo mix, once per block. used for live output and
+// can be owned by an offline render
+class MasterStage
+{
+public:
+    // buffers are allocated for blocks up to maxBlockFrames, larger blocks
+    // are processed in parts
+    MasterStage(frames outFrameRate, frames maxBlockFrames);
+
+    bool limiter() const;
+    // clears limiter state. not thread safe, lock audio while changing
+    void setLimiter(bool enable);
+    // output delay of the limiter lookahead (0 if disabled)
+    frames latency() const;
+
+    bool dither() const;
+    void setDither(bool enable); // lock audio while changing
+
+    // in place, stereo. output is within [-1, 1]
+    void process(float *buffer, frames numFrames);
+    // convert processed output to 16 bit, with TPDF dither if enabled
+    void toInt16(const float *in, int16_t *out, size_t numSamples);
+
+private:
+    void limit(float *buffer, frames numFrames); // up to maxBlockFrames
+
+    const frames lookahead, maxBlockFrames;
+    const float attackCoef, releaseCoef;
+
+    bool _limiter {false};
+    bool _dither {true};
+    uint32_t rngState {0x12345678};
+    float gain {1};
+    // stereo. the last lookahead frames of input, followed by the block
+    // (sized for the largest block)
+    vector<float> delay;
+    vector<float> gains; // for each frame of the block
+    // sliding window minimum of required gain, as a monotonic queue
+    vector<float> windowGain;
+    vector<int64_t> windowFrame;
+    size_t windowHead {0}, windowCount {0};
+    int64_t inputFrame {0};
+};
+
+} // namespace
@@ -0,0 +1,97 @@
+#include "midiinput.h"
+#include <SDL2/SDL_timer.h>
+#ifdef CHROMA_ALSA
+#include <alsa/asoundlib.h>
+#include <poll.h>
+#include <pthread.h>
+#endif
+
+namespace chromatracker::play {
+
+MidiInput::MidiInput(std::function<void(const MidiNote &)> callback)
+    : callback(callback)
+{
+#ifdef CHROMA_ALSA
+    if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_INPUT,
+                     SND_SEQ_NONBLOCK) < 0) {
+        cout << "Can't open ALSA sequencer, MIDI input disabled\n";
+        seq = nullptr;
+        return;
+    }
+    snd_seq_set_client_name(seq, "chromatracker");
+    int port = snd_seq_create_simple_port(seq, "Jam",
+        SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+        SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    if (port < 0) {
+        cout << "Can't create MIDI port: " <<snd_strerror(port)<< "\n";
+        snd_seq_close(seq);
+        seq = nullptr;
+        return;
+    }
+    cout << "MIDI input on port " <<snd_seq_client_id(seq)<< ":"
+        <<port<< "\n";
+
+    running = true;
+    thread = std::thread(&MidiInput::run, this);
+#endif
+}
+
+MidiInput::~MidiInput()
+{
+    running = false;
+    if (thread.joinable())
+        thread.join();
+#ifdef CHROMA_ALSA
+    if (seq)
+        snd_seq_close(seq);
+#endif
+}
+
+bool MidiInput::isOpen() const
+{
+    return seq != nullptr;
+}
+
+void MidiInput::run()
+{
+#ifdef CHROMA_ALSA
+    // input latency matters as much as output, try to get the same priority as
+    // the audio thread (usually needs rtprio permission, otherwise ignored)
+    sched_param param {};
+    param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+    pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+    int numFds = snd_seq_poll_descriptors_count(seq, POLLIN);
+    vector<pollfd> fds(numFds);
+    snd_seq_poll_descriptors(seq, fds.data(), numFds, POLLIN);
+
+    while (running) {
+        // timeout to check if still running
+        if (poll(fds.data(), numFds, 100) <= 0)
+            continue;
+        uint64_t time = SDL_GetPerformanceCounter();
+
+        snd_seq_event_t *ev;
+        while (snd_seq_event_input(seq, &ev) >= 0) {
+            MidiNote note;
+            note.time = time;
+            switch (ev->type) {
+            case SND_SEQ_EVENT_NOTEON:
+                note.channel = ev->data.note.channel;
+                note.note = ev->data.note.note;
+                note.velocity = ev->data.note.velocity;
+                callback(note);
+                break;
+            case SND_SEQ_EVENT_NOTEOFF:
+                note.channel = ev->data.note.channel;
+                note.note = ev->data.note.note;
+                note.velocity = 0;
+                callback(note);
+                break;
+            }
+        }
+    }
+#endif
+}
+
+} // namespace
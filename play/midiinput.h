@@ -0,0 +1,41 @@
+#pragma once
+#include <common.h>
+
+#include <atomic>
+#include <functional>
+#include <thread>
+
+struct _snd_seq;
+
+namespace chromatracker::play {
+
+struct MidiNote
+{
+    int channel;
+    int note; // MIDI note number, same as pitch
+    int velocity; // 1 - 127, or 0 for note off
+    uint64_t time; // high resolution timer when the message was received
+};
+
+// receives notes on a separate thread, independent of the UI frame rate.
+// on Linux this creates an ALSA sequencer port, connect to it with aconnect
+class MidiInput
+{
+public:
+    // callback is called from the MIDI thread!
+    MidiInput(std::function<void(const MidiNote &)> callback);
+    ~MidiInput();
+
+    bool isOpen() const;
+
+private:
+    void run();
+
+    const std::function<void(const MidiNote &)> callback;
+    std::atomic<bool> running {false};
+    std::thread thread;
+
+    _snd_seq *seq {nullptr};
+};
+
+} // namespace
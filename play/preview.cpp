@@ -0,0 +1,195 @@
+#include "preview.h"
+#include "songplay.h"
+#include <algorithm>
+#include <exception>
+#include <unordered_set>
+
+namespace chromatracker::play {
+
+const int RENDER_SECONDS = 10; // of modules
+const int DEFAULT_TEMPO = 125; // same as SongPlay
+
+// samples of song (in the same order) used by events in the first seconds,
+// others are null. follows the sequence from the first section, like
+// WavePrefetcher::scan
+static vector<shared_ptr<Sample>> usedSamples(const Song &song, float seconds)
+{
+    std::unordered_set<const Sample *> used;
+    int tempo = DEFAULT_TEMPO;
+    shared_ptr<Section> sectionP = song.sections[0];
+    // sections can repeat, but the same section doesn't need to be scanned
+    // more than twice
+    for (size_t s = 0; s <= song.sections.size() && sectionP && seconds > 0;
+            s++) {
+        std::shared_lock sectionLock(sectionP->mu);
+        if (sectionP->tempo != Section::NO_TEMPO)
+            tempo = sectionP->tempo;
+        float ticksPerSecond = (float)tempo * TICKS_PER_BEAT / 60;
+        ticks end = (ticks)std::min(
+            (float)sectionP->length, glm::ceil(seconds * ticksPerSecond));
+        for (auto &events : sectionP->trackEvents) {
+            for (auto &event : events) {
+                if (event.time >= end)
+                    break;
+                if (auto sample = event.sample.lock())
+                    used.insert(sample.get());
+            }
+        }
+        seconds -= end / ticksPerSecond;
+        sectionP = sectionP->next.lock();
+    }
+
+    vector<shared_ptr<Sample>> samples;
+    samples.reserve(song.samples.size());
+    for (auto &sample : song.samples)
+        samples.push_back(used.count(sample.get()) ? sample : nullptr);
+    return samples;
+}
+
+Preview::Preview(frames outFrameRate, frames maxTickFrames)
+    : outFrameRate(outFrameRate)
+    , maxTickFrames(maxTickFrames)
+{
+    thread = std::thread(&Preview::run, this);
+}
+
+Preview::~Preview()
+{
+    {
+        std::unique_lock lock(mu);
+        stopping = true;
+        progress.cancelled = true;
+    }
+    cv.notify_one();
+    thread.join();
+}
+
+void Preview::load(file::Path path)
+{
+    {
+        std::unique_lock lock(mu);
+        this->path = path;
+        request++;
+        progress.cancelled = true;
+        loaded.reset();
+    }
+    cv.notify_one();
+}
+
+void Preview::cancel()
+{
+    load(file::Path());
+}
+
+bool Preview::loading() const
+{
+    std::unique_lock lock(mu);
+    return !path.empty() && finished != request;
+}
+
+shared_ptr<Sample> Preview::take()
+{
+    std::unique_lock lock(mu);
+    if (!loaded)
+        return nullptr;
+    taken = std::move(loaded);
+    return taken;
+}
+
+void Preview::run()
+{
+    std::unique_lock lock(mu);
+    while (true) {
+        cv.wait(lock, [this] { return stopping || started != request; });
+        if (stopping)
+            return;
+        started = request;
+        progress.cancelled = false;
+        if (path.empty())
+            continue;
+        file::Path loadPath = path;
+        lock.unlock();
+
+        shared_ptr<Sample> sample;
+        try {
+            sample = loadSample(loadPath);
+        } catch (file::LoadCancelled &) {
+        } catch (std::exception &e) {
+            cout << "Error loading preview: " <<e.what()<< "\n";
+        }
+
+        lock.lock();
+        if (request == started) {
+            loaded = sample;
+            finished = started;
+        }
+    }
+}
+
+shared_ptr<Sample> Preview::loadSample(const file::Path &path)
+{
+    // check for samples in modules first, their names could look like modules
+    unique_ptr<file::SampleLoader> loader(file::sampleLoaderForPath(path));
+    if (!loader) {
+        unique_ptr<file::ModuleLoader> modLoader(
+            file::moduleLoaderForPath(path));
+        if (!modLoader)
+            return nullptr;
+        return renderModule(modLoader.get(), path);
+    }
+
+    auto sample = std::make_shared<Sample>();
+    loader->loadSample(sample);
+    // jam only plays resident waves, copy it instead of pinning
+    if (sample->wave.mapped())
+        sample->wave.edit();
+    return sample;
+}
+
+shared_ptr<Sample> Preview::renderModule(file::ModuleLoader *loader,
+                                         const file::Path &path)
+{
+    Song song;
+    loader->loadStructure(&song, &progress);
+    if (song.sections.empty())
+        return nullptr;
+    // the rest of a large module isn't read
+    loader->loadWaves(usedSamples(song, RENDER_SECONDS), &progress);
+    // not real time, rendering can wait for the disk
+    for (auto &sample : song.samples)
+        sample->wave.setResident(true);
+
+    SongPlay player;
+    player.setCursor(Cursor(&song, song.sections[0]));
+    vector<float> tickBuffer(maxTickFrames * 2);
+    vector<vector<float>> channels(2);
+    frames maxLength = RENDER_SECONDS * outFrameRate;
+    for (auto &channel : channels)
+        channel.reserve(maxLength + maxTickFrames);
+    while (channels[0].size() < maxLength) {
+        if (progress.cancelled)
+            return nullptr;
+        frames tickFrames;
+        {
+            std::unique_lock playerLock(player.mu);
+            if (!player.cursor().section.lock())
+                break; // end of song
+            tickFrames = player.processTick(tickBuffer.data(), maxTickFrames,
+                                            outFrameRate, false);
+        }
+        for (frames f = 0; f < tickFrames; f++) {
+            channels[0].push_back(tickBuffer[f * 2]);
+            channels[1].push_back(tickBuffer[f * 2 + 1]);
+        }
+    }
+
+    auto sample = std::make_shared<Sample>();
+    sample->name = path.stem().string();
+    sample->frameRate = outFrameRate;
+    sample->loopMode = Sample::LoopMode::Once;
+    sample->loopEnd = channels[0].size();
+    sample->wave = Wave(std::move(channels));
+    return sample;
+}
+
+} // namespace
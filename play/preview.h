@@ -0,0 +1,53 @@
+#pragma once
+#include <common.h>
+
+#include <file/types.h>
+#include <sample.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace chromatracker::play {
+
+// auditions files without adding them to the song. a sample, or the first
+// seconds of a module rendered to a sample, is loaded on a background thread
+// to be played on a jam track. only the latest request is loaded, earlier
+// ones are cancelled (or discarded if they can't be interrupted)
+class Preview : noncopyable
+{
+public:
+    // module renders use the same format as the output
+    Preview(frames outFrameRate, frames maxTickFrames); // starts thread
+    ~Preview(); // cancels and waits for the thread
+
+    // path is a sample (see sampleLoaderForPath) or a module
+    void load(file::Path path); // replaces (cancels) the current load
+    void cancel();
+    bool loading() const;
+    // the loaded sample, once, otherwise null. it is kept alive until the
+    // next one is taken, so it can fade out after the jam track is released
+    shared_ptr<Sample> take();
+
+private:
+    void run();
+    shared_ptr<Sample> loadSample(const file::Path &path);
+    shared_ptr<Sample> renderModule(file::ModuleLoader *loader,
+                                    const file::Path &path);
+
+    const frames outFrameRate, maxTickFrames;
+    file::LoadProgress progress; // cancelled by every new request
+
+    mutable std::mutex mu; // protects everything below
+    std::condition_variable cv;
+    file::Path path; // empty if cancelled
+    uint64_t request {0}; // incremented for every load
+    uint64_t started {0}; // last request that was started
+    uint64_t finished {0};
+    bool stopping {false};
+    shared_ptr<Sample> loaded; // ready to take
+    shared_ptr<Sample> taken;
+
+    std::thread thread;
+};
+
+} // namespace
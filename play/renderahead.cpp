@@ -0,0 +1,116 @@
+#include "renderahead.h"
+#include "masterstage.h"
+#include <algorithm>
+#include <chrono>
+
+namespace chromatracker::play {
+
+// the ring has aheadFrames minus a buffer or two when a wake is missed
+const auto WAKE_TIMEOUT = std::chrono::milliseconds(10);
+
+RenderAhead::RenderAhead(SongPlay *player, frames outFrameRate,
+                         frames aheadFrames, frames maxTickFrames)
+    : player(player)
+    , outFrameRate(outFrameRate)
+    , aheadFrames(aheadFrames)
+    , maxTickFrames(maxTickFrames)
+    , ring((aheadFrames + maxTickFrames) * 2)
+    , tickBuffer(maxTickFrames * 2)
+{
+    {
+        // the ring starts playing with the next jam tick
+        std::unique_lock lock(player->mu);
+        player->resetCursorFrame();
+    }
+    fill();
+    thread = std::thread(&RenderAhead::run, this);
+}
+
+RenderAhead::~RenderAhead()
+{
+    finish();
+}
+
+bool RenderAhead::read(float *buffer, frames numFrames)
+{
+    // before checking for a flush, anything written later could be new
+    size_t end = ring.written();
+    bool flushed = markedFlush == flushes;
+    // until the render thread marks the flush, everything is from before it
+    ring.skipTo(flushed ? staleEnd.load() : end);
+    if (finished && (!flushed || ring.size() < numFrames * 2)) {
+        _done = true;
+        return false;
+    }
+
+    size_t numRead = flushed ? ring.read(buffer, numFrames * 2) : 0;
+    if (numRead < numFrames * 2) {
+        std::fill(buffer + numRead, buffer + numFrames * 2, 0.0f);
+        if (flushed)
+            underruns++;
+    }
+    wake.notify_one();
+    return true;
+}
+
+void RenderAhead::flush()
+{
+    flushes++;
+    wake.notify_one();
+}
+
+void RenderAhead::finish()
+{
+    running = false;
+    wake.notify_one();
+    if (thread.joinable())
+        thread.join();
+    finished = true;
+}
+
+bool RenderAhead::done() const
+{
+    return _done;
+}
+
+uint32_t RenderAhead::numUnderruns() const
+{
+    return underruns;
+}
+
+void RenderAhead::fill()
+{
+    while (ring.size() < aheadFrames * 2) {
+        frames tickFrames;
+        uint32_t flush;
+        {
+            std::unique_lock lock(player->mu);
+            flush = flushes;
+            tickFrames = player->processTick(tickBuffer.data(), maxTickFrames,
+                                             outFrameRate, false);
+        }
+        if (tickFrames == 0)
+            break; // no song
+        if (flush != renderedFlush) {
+            renderedFlush = flush;
+            staleEnd = ring.written();
+            markedFlush = flush;
+        }
+        // capacity leaves room for a full tick
+        ring.write(tickBuffer.data(), tickFrames * 2);
+    }
+}
+
+void RenderAhead::run()
+{
+    disableDenormals();
+    while (running) {
+        fill();
+        // woken by the audio callback after each read. timeout in case the
+        // notification was missed
+        std::unique_lock lock(wakeMu);
+        wake.wait_for(lock, WAKE_TIMEOUT);
+    }
+}
+
+} // namespace
@@ -0,0 +1,66 @@
+#pragma once
+#include <common.h>
+
+#include "songplay.h"
+#include <lockfree.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace chromatracker::play {
+
+// renders song playback on a separate thread into a ring buffer, some time
+// ahead of the audio callback, so a slow tick doesn't miss the deadline.
+// jam is not included, render it in the callback with processJamTick
+class RenderAhead
+{
+public:
+    // renders the first aheadFrames immediately, then starts the thread
+    RenderAhead(SongPlay *player, frames outFrameRate,
+                frames aheadFrames, frames maxTickFrames);
+    ~RenderAhead(); // stops thread
+
+    // audio thread. fills with silence if the thread fell behind or was
+    // flushed. after finish(), return false without reading once less than
+    // numFrames are left (the rest is dropped), then render the song in the
+    // callback instead
+    bool read(float *buffer, frames numFrames);
+    // drop the audio rendered so far, after the player was stopped, moved or
+    // its song replaced. call with the player mutex locked, after the change
+    void flush();
+    // stop rendering, read() continues until the queued audio runs out
+    void finish();
+    // finished and read() returned false, can be destroyed
+    bool done() const;
+
+    uint32_t numUnderruns() const;
+
+private:
+    void fill();
+    void run();
+
+    SongPlay * const player;
+    const frames outFrameRate, aheadFrames, maxTickFrames;
+
+    SPSCRing<float> ring; // stereo samples
+    vector<float> tickBuffer; // render thread only
+    std::atomic<uint32_t> underruns {0};
+
+    std::atomic<uint32_t> flushes {0};
+    // ring position of the first tick rendered after flush number
+    // markedFlush, earlier audio is dropped by read()
+    std::atomic<size_t> staleEnd {0};
+    std::atomic<uint32_t> markedFlush {0};
+    uint32_t renderedFlush {0}; // render thread
+
+    std::atomic<bool> finished {false};
+    std::atomic<bool> _done {false};
+
+    std::atomic<bool> running {true};
+    std::mutex wakeMu;
+    std::condition_variable wake;
+    std::thread thread;
+};
+
+} // namespace
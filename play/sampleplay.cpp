@@ -1,4 +1,5 @@
 #include "sampleplay.h"
+#include <algorithm>
 
 namespace chromatracker::play {
 
@@ -7,11 +8,23 @@ shared_ptr<const Sample> SamplePlay::sample() const
     return _sample.lock();
 }
 
-void SamplePlay::setSample(shared_ptr<const Sample> sample)
+void SamplePlay::setSample(shared_ptr<const Sample> sample, frames offset)
 {
     _sample = sample;
     playbackPos = 0;
     backwards = false;
+    if (sample && offset > 0) {
+        std::shared_lock lock(sample->mu);
+        frames length = sample->wave.length();
+        if (offset >= length) {
+            // past the end, play from the start
+        } else if (sample->loopMode != Sample::LoopMode::Once
+                && offset >= sample->loopEnd) {
+            playbackPos = framesToFine(sample->loopStart);
+        } else {
+            playbackPos = framesToFine(offset);
+        }
+    }
 }
 
 float SamplePlay::pitch() const
@@ -34,6 +47,15 @@ void SamplePlay::setVelocity(float velocity)
     _velocity = velocity;
 }
 
+float SamplePlay::amplitude() const
+{
+    if (auto sampleP = _sample.lock()) {
+        std::shared_lock lock(sampleP->mu);
+        return velocityToAmplitude(_velocity) * sampleP->volume;
+    }
+    return 0;
+}
+
 void SamplePlay::fadeOut()
 {
     if (auto sampleP = _sample.lock()) {
@@ -45,16 +67,22 @@ void SamplePlay::fadeOut()
 }
 
 void SamplePlay::processTick(float *tickBuffer, frames tickFrames,
-                             frames outFrameRate, float lAmp, float rAmp)
+                             frames outFrameRate, float lAmp, float rAmp,
+                             Interpolation interp, bool silent)
 {
     auto sampleP = _sample.lock();
     if (!sampleP)
         return;
     std::shared_lock lock(sampleP->mu);
-    if (sampleP->channels.size() == 0) {
+    const Wave &wave = sampleP->wave;
+    if (wave.numChannels() == 0) {
         _sample.reset();
         return;
     }
+    // reading a mapped wave that isn't resident would wait for the disk.
+    // keep the position moving so the note comes in when it's prefetched
+    if (!wave.resident())
+        silent = true;
 
     // TODO: anti-click
 
@@ -103,18 +131,48 @@ void SamplePlay::processTick(float *tickBuffer, frames tickFrames,
             _sample.reset();
             break;
         }
-        bool stereo = sampleP->channels.size() > 1;
+        bool stereo = wave.numChannels() > 1;
+        const float *lData = wave.channel(0);
+        const float *rData = wave.channel(stereo ? 1 : 0);
         // TODO prevent leaving sample data
-        while (playbackPos < maxPos && playbackPos > minPos) {
-            // TODO smooth (linear) interpolation
-            frames frame = fineToFrames(playbackPos);
-            // works for stereo and mono
-            float left = sampleP->channels[0][frame];
-            float right = stereo ? sampleP->channels[1][frame] : left;
-            tickBuffer[writeFrame * 2] += left * lAmp;
-            tickBuffer[writeFrame * 2 + 1] += right * rAmp;
-            playbackPos += playbackRate;
-            writeFrame++;
+        if (silent) {
+            // same number of steps as the loops below
+            framesFine distance = backwards ?
+                (playbackPos - minPos) : (maxPos - playbackPos);
+            framesFine step = backwards ? -playbackRate : playbackRate;
+            frames steps = (distance + step - 1) / step;
+            playbackPos += steps * playbackRate;
+            writeFrame += steps;
+        } else if (interp == Interpolation::Linear && sampleP->interpolationMode
+                == Sample::InterpolationMode::Smooth) {
+            // the last frame before the loop point is interpolated with the
+            // frame that plays after it
+            frames endFrame = std::min(sampleP->loopEnd, wave.length()) - 1;
+            frames wrapFrame = endFrame;
+            if (sampleP->loopMode == Sample::LoopMode::Forward)
+                wrapFrame = sampleP->loopStart;
+            else if (sampleP->loopMode == Sample::LoopMode::PingPong)
+                wrapFrame = std::max(endFrame - 1, sampleP->loopStart);
+            while (playbackPos < maxPos && playbackPos > minPos) {
+                frames frame = fineToFrames(playbackPos);
+                frames next = frame < endFrame ? frame + 1 : wrapFrame;
+                float t = (playbackPos & 0xFFFF) * (1.0f / 65536.0f);
+                // works for stereo and mono
+                float left = lData[frame] + (lData[next] - lData[frame]) * t;
+                float right = rData[frame] + (rData[next] - rData[frame]) * t;
+                tickBuffer[writeFrame * 2] += left * lAmp;
+                tickBuffer[writeFrame * 2 + 1] += right * rAmp;
+                playbackPos += playbackRate;
+                writeFrame++;
+            }
+        } else {
+            while (playbackPos < maxPos && playbackPos > minPos) {
+                frames frame = fineToFrames(playbackPos);
+                tickBuffer[writeFrame * 2] += lData[frame] * lAmp;
+                tickBuffer[writeFrame * 2 + 1] += rData[frame] * rAmp;
+                playbackPos += playbackRate;
+                writeFrame++;
+            }
         }
 
         if (collision) {
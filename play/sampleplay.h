@@ -6,21 +6,34 @@
 
 namespace chromatracker::play {
 
+enum class Interpolation
+{
+    Nearest, Linear
+};
+
 class SamplePlay
 {
 public:
     shared_ptr<const Sample> sample() const;
-    void setSample(shared_ptr<const Sample> sample);
+    // start playing from offset (clamped to the wave)
+    void setSample(shared_ptr<const Sample> sample, frames offset = 0);
     float pitch() const;
     void setPitch(float pitch); // note pitch
     float velocity() const;
     void setVelocity(float velocity); // note velocity
+    // approximate loudness, 0 if not playing (for choosing voices to drop)
+    float amplitude() const;
     
     // special effects (call every tick)
     void fadeOut();
 
+    // interp is the highest quality allowed, crunchy samples always use
+    // nearest. if silent, only the position advances (nothing is mixed).
+    // also silent while the wave isn't resident (see WavePrefetcher)
     void processTick(float *tickBuffer, frames tickFrames,
-                     frames outFrameRate, float lAmp, float rAmp);
+                     frames outFrameRate, float lAmp, float rAmp,
+                     Interpolation interp = Interpolation::Linear,
+                     bool silent = false);
 
 private:
     ObjWeakPtr<const Sample> _sample; // null for no sample
@@ -1,4 +1,6 @@
 #include "songplay.h"
+#include <algorithm>
+#include <chrono>
 
 namespace chromatracker::play {
 
@@ -15,11 +17,39 @@ void SongPlay::setCursor(Cursor cursor)
     _cursor = cursor;
 }
 
+Cursor SongPlay::cursorAt(int64_t frame) const
+{
+    Cursor cursor = _cursor;
+    auto sectionP = cursor.section.lock();
+    if (!sectionP || _tickFrames <= 0)
+        return cursor;
+    int64_t offset = frame - _cursorFrame;
+    if (offset >= 0) {
+        cursor.time += offset / _tickFrames;
+    } else {
+        cursor.time -= (-offset + _tickFrames - 1) / _tickFrames;
+    }
+    // don't cross into other sections
+    std::shared_lock sectionLock(sectionP->mu);
+    cursor.time = std::clamp(cursor.time, 0, sectionP->length - 1);
+    return cursor;
+}
+
 int SongPlay::currentTempo() const
 {
     return _tempo;
 }
 
+int64_t SongPlay::framePos() const
+{
+    return _framePos;
+}
+
+void SongPlay::resetCursorFrame()
+{
+    _cursorFrame = _framePos;
+}
+
 void SongPlay::stop()
 {
     _cursor.section.reset();
@@ -39,24 +69,41 @@ void SongPlay::fadeAll()
     }
 }
 
-frames SongPlay::processTick(float *tickBuffer, frames maxFrames,
-                             frames outFrameRate)
+void SongPlay::playingSamples(vector<shared_ptr<const Sample>> &samples) const
 {
-    Song *song = _cursor.song;
-    if (!song)
-        return 0;
+    for (auto &track : tracks) {
+        if (auto sample = track.currentSample())
+            samples.push_back(sample);
+    }
+}
 
+frames SongPlay::calcTickFrames(frames maxFrames, frames outFrameRate,
+                                framesFine *lenError) const
+{
     framesFine tickLen = framesToFine(outFrameRate) * 60l
         / (framesFine)_tempo / (framesFine)TICKS_PER_BEAT;
 
     int tickFrames = fineToFrames(tickLen);
-    tickLenError += tickLen & 0xFFFF;
-    while (tickLenError >= framesToFine(1)) {
-        tickLenError -= framesToFine(1);
+    *lenError += tickLen & 0xFFFF;
+    while (*lenError >= framesToFine(1)) {
+        *lenError -= framesToFine(1);
         tickFrames++;
     }
     if (tickFrames > maxFrames)
         tickFrames = maxFrames;
+    return tickFrames;
+}
+
+frames SongPlay::processTick(float *tickBuffer, frames maxFrames,
+                             frames outFrameRate, bool withJam)
+{
+    Song *song = _cursor.song;
+    if (!song)
+        return 0;
+
+    auto startTime = std::chrono::steady_clock::now();
+    frames tickFrames = calcTickFrames(maxFrames, outFrameRate,
+                                       &tickLenError);
 
     for (int i = 0; i < tickFrames * 2; i++) {
         tickBuffer[i] = 0;
@@ -67,9 +114,12 @@ frames SongPlay::processTick(float *tickBuffer, frames maxFrames,
         // hold the song for the whole block to ensure num tracks doesn't change
         std::shared_lock songLock(song->mu);
         amplitude = song->volume;
+        _volume = amplitude;
 
         if (tracks.size() != song->tracks.size()) {
             tracks.resize(song->tracks.size());
+            trackAmps.resize(song->tracks.size() * 2);
+            voices.reserve(song->tracks.size());
             for (int i = 0; i < song->tracks.size(); i++) {
                 tracks[i].stop();
             }
@@ -95,26 +145,94 @@ frames SongPlay::processTick(float *tickBuffer, frames maxFrames,
 
         for (int i = 0; i < song->tracks.size(); i++) {
             float lAmp = 0, rAmp = 0;
-            {
-                auto track = song->tracks[i];
-                std::shared_lock lock(track->mu);
-                if (!track->mute) {
-                    float tAmp = amplitude * track->volume;
-                    lAmp = tAmp * panningToLeftAmplitude(track->pan);
-                    rAmp = tAmp * panningToRightAmplitude(track->pan);
-                }
+            auto track = song->tracks[i];
+            std::shared_lock lock(track->mu);
+            if (!track->mute) {
+                float tAmp = amplitude * track->volume;
+                lAmp = tAmp * panningToLeftAmplitude(track->pan);
+                rAmp = tAmp * panningToRightAmplitude(track->pan);
             }
-            tracks[i].processTick(tickBuffer, tickFrames,
-                                  outFrameRate, lAmp, rAmp);
+            trackAmps[i * 2] = lAmp;
+            trackAmps[i * 2 + 1] = rAmp;
+        }
+        shedVoices(trackAmps);
+
+        Interpolation interp = governor.interpolation();
+        for (int i = 0; i < song->tracks.size(); i++) {
+            tracks[i].processTick(tickBuffer, tickFrames, outFrameRate,
+                                  trackAmps[i * 2], trackAmps[i * 2 + 1],
+                                  interp);
         }
     }
-    jam.processTick(tickBuffer, tickFrames, outFrameRate, amplitude);
+    if (withJam) {
+        jam.processTick(tickBuffer, tickFrames, outFrameRate, amplitude,
+                        _framePos);
+        _framePos += tickFrames;
+        _cursorFrame = _framePos;
+    } else {
+        // rendered ahead, output in the same order
+        _cursorFrame += tickFrames;
+    }
+    _tickFrames = tickFrames;
 
     _cursor.playStep();
     if (!_cursor.section.lock()) { // section may have been cleared after move
         fadeAll();
     }
 
+    if (tickFrames > 0) {
+        std::chrono::duration<float> renderTime =
+            std::chrono::steady_clock::now() - startTime;
+        float tickTime = (float)tickFrames / outFrameRate;
+        governor.update(renderTime.count() / tickTime, voices.size());
+    }
+
+    return tickFrames;
+}
+
+void SongPlay::shedVoices(const vector<float> &trackAmps)
+{
+    voices.clear();
+    for (int i = 0; i < tracks.size(); i++) {
+        if (tracks[i].currentSample()) {
+            float amp = tracks[i].amplitude()
+                * std::max(trackAmps[i * 2], trackAmps[i * 2 + 1]);
+            voices.emplace_back(amp, i);
+        } else {
+            tracks[i].setShed(false);
+        }
+    }
+    int maxVoices = governor.maxVoices();
+    if (voices.size() > maxVoices) {
+        // loudest first, ties go to the lower track
+        std::sort(voices.begin(), voices.end(), [](auto &a, auto &b) {
+            return a.first > b.first
+                || (a.first == b.first && a.second < b.second);
+        });
+    }
+    // chosen again every tick, so voices come back when the limit is raised
+    uint32_t dropped = 0;
+    for (int v = 0; v < voices.size(); v++) {
+        TrackPlay &track = tracks[voices[v].second];
+        bool shed = v >= maxVoices;
+        if (shed && !track.shed())
+            dropped++;
+        track.setShed(shed);
+    }
+    if (dropped)
+        governor.countVoicesDropped(dropped);
+}
+
+frames SongPlay::processJamTick(float *tickBuffer, frames maxFrames,
+                                frames outFrameRate)
+{
+    frames tickFrames = calcTickFrames(maxFrames, outFrameRate,
+                                       &jamTickLenError);
+    for (int i = 0; i < tickFrames * 2; i++) {
+        tickBuffer[i] = 0;
+    }
+    jam.processTick(tickBuffer, tickFrames, outFrameRate, _volume, _framePos);
+    _framePos += tickFrames;
     return tickFrames;
 }
 
@@ -1,10 +1,12 @@
 #pragma once
 #include <common.h>
 
+#include "governor.h"
 #include "jam.h"
 #include "trackplay.h"
 #include <cursor.h>
 #include <song.h>
+#include <atomic>
 #include <mutex>
 
 namespace chromatracker::play {
@@ -14,31 +16,58 @@ class SongPlay
 public:
     Cursor cursor();
     void setCursor(Cursor cursor);
+    // the cursor playing at an output frame (see FrameClock), near the
+    // current position. for recording jam events where they were heard
+    Cursor cursorAt(int64_t frame) const;
 
-    int currentTempo() const;
+    int currentTempo() const; // doesn't require lock
+    // total frames rendered with jam, the output frame at the start of the
+    // next jam tick
+    int64_t framePos() const;
+    // the song will be rendered ahead starting from the next jam tick
+    void resetCursorFrame();
 
     void stop();
     void fadeAll();
+    // samples playing in song tracks (not jam)
+    void playingSamples(vector<shared_ptr<const Sample>> &samples) const;
 
     // return tick length
+    // withJam false if jam is rendered separately with processJamTick
     frames processTick(float *tickBuffer, frames maxFrames,
-                       frames outFrameRate);
+                       frames outFrameRate, bool withJam=true);
+    // only render jam, doesn't require lock (call from one thread only)
+    frames processJamTick(float *tickBuffer, frames maxFrames,
+                          frames outFrameRate);
 
     mutable std::mutex mu;
 
     Jam jam;
+    OverloadGovernor governor;
 
 private:
+    frames calcTickFrames(frames maxFrames, frames outFrameRate,
+                          framesFine *lenError) const;
     // section must be locked
     void doSlide(TrackCursor tcur, shared_ptr<Section> sectionP,
                  vector<Event>::iterator eventIt);
 
     Cursor _cursor;
-    int _tempo {125};
+    std::atomic<int> _tempo {125};
+    int64_t _cursorFrame {0}; // output frame where the tick at _cursor starts
+    frames _tickFrames {0}; // length of the last tick
+
+    // song must be locked. silence the quietest tracks over the voice limit
+    void shedVoices(const vector<float> &trackAmps);
 
     vector<TrackPlay> tracks;
+    vector<float> trackAmps; // loudness of each track this tick
+    vector<std::pair<float, int>> voices; // loudness, track. for shedVoices
 
     framesFine tickLenError {0}; // accumulated
+    framesFine jamTickLenError {0};
+    int64_t _framePos {0};
+    std::atomic<float> _volume {1}; // song volume, for jam
 };
 
 } // namespace
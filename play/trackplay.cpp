@@ -22,7 +22,7 @@ void TrackPlay::stop()
 void TrackPlay::processEvent(const Event &event)
 {
     if (auto sampleP = event.sample.lock())
-        samplePlay.setSample(sampleP); // TODO new note action
+        samplePlay.setSample(sampleP, event.offset); // TODO new note action
     if (event.pitch != Event::NO_PITCH)
         samplePlay.setPitch(event.pitch);
     if (event.velocity != Event::NO_VELOCITY)
@@ -41,11 +41,39 @@ void TrackPlay::setSlideTarget(const Event &event, ticks time)
         velocitySlide = (event.velocity - samplePlay.velocity()) / time;
 }
 
+float TrackPlay::amplitude() const
+{
+    return samplePlay.amplitude();
+}
+
+bool TrackPlay::shed() const
+{
+    return _shed;
+}
+
+void TrackPlay::setShed(bool shed)
+{
+    _shed = shed;
+}
+
 void TrackPlay::processTick(float *tickBuffer, frames tickFrames,
-                            frames outFrameRate, float lAmp, float rAmp)
+                            frames outFrameRate, float lAmp, float rAmp,
+                            Interpolation interp)
+{
+    processFrames(tickBuffer, tickFrames, outFrameRate, lAmp, rAmp, interp);
+    processEffects();
+}
+
+void TrackPlay::processFrames(float *buffer, frames numFrames,
+                              frames outFrameRate, float lAmp, float rAmp,
+                              Interpolation interp)
+{
+    samplePlay.processTick(buffer, numFrames, outFrameRate, lAmp, rAmp,
+                           interp, _shed);
+}
+
+void TrackPlay::processEffects()
 {
-    samplePlay.processTick(tickBuffer, tickFrames, outFrameRate, lAmp, rAmp);
-    
     switch (_special) {
     case Event::Special::FadeOut:
         samplePlay.fadeOut();
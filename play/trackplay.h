@@ -19,12 +19,25 @@ public:
     // call after processEvent
     void setSlideTarget(const Event &event, ticks time);
 
+    float amplitude() const; // 0 if not playing
+    // a shed voice keeps playing silently, so it can be heard again when the
+    // voice limit is raised (see OverloadGovernor)
+    bool shed() const;
+    void setShed(bool shed);
+
     void processTick(float *tickBuffer, frames tickFrames,
-                     frames outFrameRate, float lAmp, float rAmp);
+                     frames outFrameRate, float lAmp, float rAmp,
+                     Interpolation interp = Interpolation::Linear);
+    // processTick split in two, so a tick can be rendered in pieces
+    void processFrames(float *buffer, frames numFrames,
+                       frames outFrameRate, float lAmp, float rAmp,
+                       Interpolation interp = Interpolation::Linear);
+    void processEffects(); // once per tick
 
 private:
     SamplePlay samplePlay;
     Event::Special _special {Event::Special::None};
+    bool _shed {false};
 
     Event slideTarget;
     float pitchSlide, velocitySlide;
@@ -0,0 +1,150 @@
+#include "waveprefetch.h"
+#include <file/mappedfile.h>
+#include <algorithm>
+
+namespace chromatracker::play {
+
+const auto SCAN_INTERVAL = std::chrono::milliseconds(50);
+// how far ahead of the cursor waves are made resident
+const int LOOKAHEAD_SECONDS = 10;
+// after the last time a wave was needed
+const auto UNPIN_DELAY = std::chrono::seconds(5);
+
+WavePrefetcher::WavePrefetcher(SongPlay *player)
+    : player(player)
+{
+    thread = std::thread(&WavePrefetcher::run, this);
+}
+
+WavePrefetcher::~WavePrefetcher()
+{
+    running = false;
+    wake.notify_one();
+    thread.join();
+}
+
+void WavePrefetcher::update(const Cursor &editCursor,
+                            shared_ptr<const Sample> jamSample)
+{
+    bool newJamSample;
+    {
+        std::unique_lock lock(mu);
+        this->editCursor = editCursor;
+        newJamSample = jamSample != this->jamSample.lock();
+        this->jamSample = jamSample;
+    }
+    // ready before the first note, if possible
+    if (newJamSample)
+        wake.notify_one();
+}
+
+void WavePrefetcher::cursorMoved()
+{
+    wake.notify_one();
+}
+
+void WavePrefetcher::run()
+{
+    while (running) {
+        prefetch();
+        std::unique_lock lock(wakeMu);
+        wake.wait_for(lock, SCAN_INTERVAL);
+    }
+
+    for (auto &p : pinned) {
+        p.wave.setResident(false);
+        file::MappedFile::unpin(p.wave.mappedData(), p.wave.mappedSize());
+    }
+    pinned.clear();
+}
+
+void WavePrefetcher::prefetch()
+{
+    vector<shared_ptr<const Sample>> samples;
+    Cursor cursor;
+    {
+        std::unique_lock playerLock(player->mu);
+        cursor = player->cursor();
+        player->playingSamples(samples);
+    }
+    {
+        std::unique_lock lock(mu);
+        if (!cursor.section.lock())
+            cursor = editCursor; // playback will probably start here
+        if (auto sample = jamSample.lock())
+            samples.push_back(sample);
+    }
+    ticks lookahead = LOOKAHEAD_SECONDS * player->currentTempo()
+        * TICKS_PER_BEAT / 60;
+    if (cursor.song)
+        scan(cursor, lookahead, samples);
+    std::sort(samples.begin(), samples.end());
+    samples.erase(std::unique(samples.begin(), samples.end()), samples.end());
+
+    auto now = std::chrono::steady_clock::now();
+    for (auto &sample : samples) {
+        Wave wave;
+        {
+            std::shared_lock lock(sample->mu);
+            wave = sample->wave;
+        }
+        if (!wave.mapped())
+            continue;
+        auto it = std::find_if(pinned.begin(), pinned.end(),
+            [&](const Pinned &p) { return p.wave.shares(wave); });
+        if (it != pinned.end()) {
+            it->lastNeeded = now;
+            continue;
+        }
+        // reads the whole wave
+        if (!file::MappedFile::pin(wave.mappedData(), wave.mappedSize())
+                && !warnedLimit) {
+            cout << "Can't lock waves in memory, playback could glitch\n";
+            warnedLimit = true;
+        }
+        wave.setResident(true);
+        pinned.push_back({wave, now});
+    }
+
+    for (auto it = pinned.begin(); it != pinned.end(); ) {
+        if (now - it->lastNeeded > UNPIN_DELAY) {
+            // stop playback from reading it before it can be paged out
+            it->wave.setResident(false);
+            file::MappedFile::unpin(it->wave.mappedData(),
+                                    it->wave.mappedSize());
+            it = pinned.erase(it);
+        } else {
+            it++;
+        }
+    }
+}
+
+void WavePrefetcher::scan(Cursor cursor, ticks length,
+                          vector<shared_ptr<const Sample>> &samples) const
+{
+    std::shared_lock songLock(cursor.song->mu);
+    // sections can repeat, but the same section doesn't need to be scanned
+    // more than twice (start and end of the range)
+    size_t maxSections = cursor.song->sections.size() + 1;
+    for (size_t s = 0; s < maxSections && length > 0; s++) {
+        auto sectionP = cursor.section.lock();
+        if (!sectionP)
+            break;
+        std::shared_lock sectionLock(sectionP->mu);
+        ticks end = std::min(sectionP->length, cursor.time + length);
+        TrackCursor tcur {cursor};
+        for (; tcur.track < sectionP->trackEvents.size(); tcur.track++) {
+            auto &events = tcur.events();
+            for (auto it = tcur.findEvent();
+                    it != events.end() && it->time < end; it++) {
+                if (auto sample = it->sample.lock())
+                    samples.push_back(sample);
+            }
+        }
+        length -= std::max(end - cursor.time, 0);
+        cursor.section = sectionP->next;
+        cursor.time = 0;
+    }
+}
+
+} // namespace
@@ -0,0 +1,60 @@
+#pragma once
+#include <common.h>
+
+#include "songplay.h"
+#include <cursor.h>
+#include <sample.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace chromatracker::play {
+
+// keeps mapped waves (see Wave) resident before they are played, so
+// rendering never waits for the disk. a thread scans the events ahead of the
+// playback cursor (or the edit cursor when stopped), pins the waves they use,
+// and unpins waves that haven't been needed for a while
+class WavePrefetcher
+{
+public:
+    WavePrefetcher(SongPlay *player); // starts thread
+    ~WavePrefetcher(); // stops thread and unpins everything
+
+    // UI thread. jamSample is played by the keyboard and MIDI
+    void update(const Cursor &editCursor, shared_ptr<const Sample> jamSample);
+    // after moving the playback cursor, scan now instead of at the next
+    // interval
+    void cursorMoved();
+
+private:
+    struct Pinned
+    {
+        Wave wave;
+        std::chrono::steady_clock::time_point lastNeeded;
+    };
+
+    void run();
+    void prefetch();
+    // add samples of events in the length after cursor
+    void scan(Cursor cursor, ticks length,
+              vector<shared_ptr<const Sample>> &samples) const;
+
+    SongPlay * const player;
+
+    std::mutex mu; // protects editCursor and jamSample
+    Cursor editCursor;
+    ObjWeakPtr<const Sample> jamSample;
+
+    // prefetch thread
+    vector<Pinned> pinned;
+    bool warnedLimit {false};
+
+    std::atomic<bool> running {true};
+    std::mutex wakeMu;
+    std::condition_variable wake;
+    std::thread thread;
+};
+
+} // namespace
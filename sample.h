@@ -4,11 +4,144 @@
 #include "songobj.h"
 #include "units.h"
 #include <array>
+#include <atomic>
 #include <shared_mutex>
 #include <glm/glm.hpp>
 
 namespace chromatracker {
 
+// audio data, one array of samples per channel. copies share the same
+// immutable data, which is copied when one of them is edited (copy on write).
+// the data can also be a view of memory owned by something else, like a
+// memory-mapped file. mapped data may not be in physical memory, so it's only
+// read by the audio thread while it's resident (see play::WavePrefetcher)
+class Wave
+{
+public:
+    Wave() = default;
+    Wave(vector<vector<float>> channels); // takes the data
+    // channels are stored one after another. owner keeps the memory valid
+    Wave(shared_ptr<const void> owner, const float *data, int numChannels,
+         frames length);
+
+    int numChannels() const;
+    frames length() const;
+    const float * channel(int c) const;
+    // same data (not just equal)
+    bool shares(const Wave &other) const;
+    // private copy of the data to modify (never mapped)
+    vector<vector<float>> & edit();
+
+    bool mapped() const;
+    // always true if not mapped
+    bool resident() const;
+    void setResident(bool resident) const; // for all copies
+    // the whole mapped range, null if not mapped
+    const void * mappedData() const;
+    size_t mappedSize() const;
+
+private:
+    struct Data
+    {
+        vector<vector<float>> channels; // if not mapped
+        shared_ptr<const void> owner; // if mapped
+        const float *mappedData {nullptr};
+        int numMapped {0};
+        frames mappedLength {0};
+        mutable std::atomic<bool> resident {true};
+    };
+
+    shared_ptr<const Data> data;
+};
+
+inline Wave::Wave(vector<vector<float>> channels)
+{
+    auto newData = std::make_shared<Data>();
+    newData->channels = std::move(channels);
+    data = newData;
+}
+
+inline Wave::Wave(shared_ptr<const void> owner, const float *mappedData,
+                  int numChannels, frames length)
+{
+    auto newData = std::make_shared<Data>();
+    newData->owner = owner;
+    newData->mappedData = mappedData;
+    newData->numMapped = numChannels;
+    newData->mappedLength = length;
+    newData->resident = false;
+    data = newData;
+}
+
+inline int Wave::numChannels() const
+{
+    if (!data)
+        return 0;
+    return data->owner ? data->numMapped : data->channels.size();
+}
+
+inline frames Wave::length() const
+{
+    if (!data)
+        return 0;
+    else if (data->owner)
+        return data->mappedLength;
+    else
+        return data->channels.empty() ? 0 : data->channels[0].size();
+}
+
+inline const float * Wave::channel(int c) const
+{
+    if (data->owner)
+        return data->mappedData + (size_t)c * data->mappedLength;
+    else
+        return data->channels[c].data();
+}
+
+inline bool Wave::shares(const Wave &other) const
+{
+    return data == other.data;
+}
+
+inline vector<vector<float>> & Wave::edit()
+{
+    // if this is the only owner, no other sample can be reading it
+    if (!data || data.use_count() > 1 || data->owner) {
+        vector<vector<float>> channels(numChannels());
+        for (int c = 0; c < channels.size(); c++)
+            channels[c].assign(channel(c), channel(c) + length());
+        *this = Wave(std::move(channels));
+    }
+    return const_cast<Data &>(*data).channels;
+}
+
+inline bool Wave::mapped() const
+{
+    return data && data->owner;
+}
+
+inline bool Wave::resident() const
+{
+    return !data || data->resident;
+}
+
+inline void Wave::setResident(bool resident) const
+{
+    if (data)
+        data->resident = resident;
+}
+
+inline const void * Wave::mappedData() const
+{
+    return mapped() ? data->mappedData : nullptr;
+}
+
+inline size_t Wave::mappedSize() const
+{
+    return mapped() ? (size_t)data->numMapped * data->mappedLength
+        * sizeof(float) : 0;
+}
+
 struct Sample : public SongObject
 {
     enum class InterpolationMode
@@ -34,7 +167,7 @@ struct Sample : public SongObject
     string name;
     glm::vec3 color {1, 1, 1};
 
-    vector<vector<float>> channels;
+    Wave wave;
     frames frameRate {48000};
     InterpolationMode interpolationMode { InterpolationMode::Smooth };
 
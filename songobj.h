@@ -7,12 +7,12 @@ namespace chromatracker {
 
 // ugly hack. initializes atomic bool to false and skips copying
 // TODO does this even need to be atomic?
-class DeletedFlag : public std::atomic<bool>
+class ObjectFlag : public std::atomic<bool>
 {
 public:
-    DeletedFlag() : std::atomic<bool>(false) {}
-    DeletedFlag(const DeletedFlag &rhs) {} // don't copy
-    DeletedFlag & operator=(const DeletedFlag &rhs) { return *this; }
+    ObjectFlag() : std::atomic<bool>(false) {}
+    ObjectFlag(const ObjectFlag &rhs) {} // don't copy
+    ObjectFlag & operator=(const ObjectFlag &rhs) { return *this; }
     bool operator=(bool desired) {return std::atomic<bool>::operator=(desired);}
 };
 
@@ -20,7 +20,10 @@ public:
 class SongObject
 {
 public:
-    DeletedFlag deleted;
+    ObjectFlag deleted;
+    // modified since the last save, set by edit operations
+    // (wave data is never modified in place, only replaced with a new Sample)
+    ObjectFlag dirty;
 };
 
 // replacement for weak_ptr which automatically resets if the object is deleted
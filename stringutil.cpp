@@ -1,5 +1,6 @@
 #include "stringutil.h"
 #include <algorithm>
+#include <cwchar>
 #include <exception>
 #include <iomanip>
 #include <locale>
@@ -25,7 +26,11 @@ string toUpper(string s)
     try {
         while (it < s.end()) {
             char32_t c = utf8::next(it, s.end());
-            utf8::append(std::toupper(c, std::locale()), result);
+            // there is no standard ctype<char32_t> facet
+            if (c <= WCHAR_MAX)
+                c = std::use_facet<std::ctype<wchar_t>>(std::locale())
+                    .toupper((wchar_t)c);
+            utf8::append(c, result);
         }
     } catch (utf8::exception e) {} // TODO
     return result;
@@ -38,7 +43,11 @@ string toLower(string s)
     try {
         while (it < s.end()) {
             char32_t c = utf8::next(it, s.end());
-            utf8::append(std::tolower(c, std::locale()), result);
+            // there is no standard ctype<char32_t> facet
+            if (c <= WCHAR_MAX)
+                c = std::use_facet<std::ctype<wchar_t>>(std::locale())
+                    .tolower((wchar_t)c);
+            utf8::append(c, result);
         }
     } catch (utf8::exception e) {} // TODO
     return result;
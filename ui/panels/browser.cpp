@@ -5,6 +5,8 @@
 namespace chromatracker::ui::panels {
 
 const glm::vec4 C_DIRECTORY {0.8, 0.8, 0.8, 1};
+const size_t MAX_RESULTS = 200;
+const int PREVIEW_TOUCH_ID = 0x20000; // after MIDI touches (see App)
 
 Browser::Browser(App *app, file::FileType type,
                  std::function<void(file::Path)> callback)
@@ -12,6 +14,10 @@ Browser::Browser(App *app, file::FileType type,
     , type(type)
     , callback(callback)
 {
+    SDL_StartTextInput();
+    // pick up changes since the last time
+    app->library.crawl(vector<file::Path>(app->settings.bookmarks.begin(),
+                                          app->settings.bookmarks.end()));
     if (app->settings.lastOpenPath.empty()) {
         open(std::filesystem::current_path());
     } else {
@@ -21,34 +27,114 @@ Browser::Browser(App *app, file::FileType type,
 
 Browser::~Browser()
 {
+    SDL_StopTextInput();
+    stopPreview();
+    app->preview.cancel();
+    app->dirScanner.cancel();
     app->settings.lastOpenPath = path.string();
 }
 
 void Browser::open(file::Path path)
 {
     this->path = path;
-    file::listDirectory(path, type, directories, files);
+    filter.clear();
+    directories.clear();
+    files.clear();
+    app->dirScanner.scan(path, type);
+    scanning = true;
     selected = 0;
 }
 
+void Browser::search()
+{
+    app->dirScanner.cancel();
+    scanning = false;
+    directories.clear();
+    files.clear();
+    searchVersion = app->library.version();
+    app->library.search(filter, type, MAX_RESULTS, directories, files);
+}
+
+file::Path Browser::selectedPath() const
+{
+    if (selected >= 0 && selected < directories.size())
+        return directories[selected];
+    int selectedFile = selected - directories.size();
+    if (selectedFile >= 0 && selectedFile < files.size())
+        return files[selectedFile];
+    return file::Path();
+}
+
+void Browser::updatePreview()
+{
+    file::Path path = selectedPath();
+    if (path != previewPath) {
+        previewPath = path;
+        stopPreview();
+        // modules are directories when browsing samples
+        bool directory = selected >= 0 && selected < directories.size();
+        if (!path.empty() && (!directory
+                || file::typeForPath(path) == file::FileType::Module)) {
+            app->preview.load(path);
+        } else {
+            app->preview.cancel();
+        }
+    }
+
+    if (auto sample = app->preview.take()) {
+        Event event;
+        event.sample = sample;
+        event.pitch = MIDDLE_C;
+        event.velocity = 1;
+        app->jamEvent(play::JamEvent {event, PREVIEW_TOUCH_ID},
+                      SDL_GetTicks());
+    }
+}
+
+void Browser::stopPreview()
+{
+    Event event;
+    event.special = Event::Special::FadeOut;
+    app->jamEvent(play::JamEvent {event, PREVIEW_TOUCH_ID}, SDL_GetTicks());
+}
+
+string Browser::displayName(const file::Path &path) const
+{
+    if (filter.empty())
+        return path.filename().string();
+    // results are from anywhere
+    return (path.parent_path().filename() / path.filename()).string();
+}
+
 void Browser::draw(Rect rect)
 {
+    if (scanning)
+        scanning = !app->dirScanner.update(directories, files);
+    else if (!filter.empty() && app->library.version() != searchVersion)
+        search(); // crawler found more
+    updatePreview();
+
     app->scissorRect(rect);
 
     glm::vec2 textPos = rect(TL);
-    textPos = drawText(path.string(), rect(TL), C_ACCENT_LIGHT)(BL);
+    string title = filter.empty() ? path.string() : ("Search: " + filter);
+    textPos = drawText(title, rect(TL), C_ACCENT_LIGHT)(BL);
 
     int i = 0;
     for (auto &directory : directories) {
-        textPos = drawText(directory.filename().string(), textPos,
+        textPos = drawText(displayName(directory), textPos,
                            i == selected ? C_ACCENT_LIGHT : C_DIRECTORY)(BL);
         i++;
     }
     for (auto &file : files) {
-        textPos = drawText(file.filename().string(), textPos,
+        textPos = drawText(displayName(file), textPos,
                            i == selected ? C_ACCENT_LIGHT : C_WHITE)(BL);
         i++;
     }
+    if (scanning || (!filter.empty() && app->library.crawling()))
+        drawText("...", textPos, C_DIRECTORY);
+    else if (app->preview.loading())
+        drawText("Loading preview...", textPos, C_DIRECTORY);
 }
 
 void Browser::keyDown(const SDL_KeyboardEvent &e)
@@ -81,13 +167,39 @@ void Browser::keyDown(const SDL_KeyboardEvent &e)
         }
         break;
     case SDLK_BACKSPACE:
-        open(path.parent_path());
+        if (filter.empty()) {
+            open(path.parent_path());
+        } else {
+            // whole UTF-8 character
+            while (!filter.empty() && (filter.back() & 0xC0) == 0x80)
+                filter.pop_back();
+            if (!filter.empty())
+                filter.pop_back();
+            if (filter.empty()) {
+                open(path);
+            } else {
+                search();
+                selected = 0;
+            }
+        }
         break;
     case SDLK_ESCAPE:
+        if (!filter.empty()) {
+            open(path);
+            return;
+        }
         callback(file::Path()); // may destroy browser
         return;
     }
 }
 
+void Browser::textInput(const SDL_TextInputEvent &e)
+{
+    // text from the keyboard layout / IME, unlike key codes
+    filter += e.text;
+    search();
+    selected = 0;
+}
+
 
 } // namespace
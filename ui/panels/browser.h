@@ -20,9 +20,16 @@ public:
 
     void draw(Rect rect);
     void keyDown(const SDL_KeyboardEvent &e);
+    void textInput(const SDL_TextInputEvent &e); // type to search
 
 private:
     void open(file::Path path);
+    void search(); // filter
+    string displayName(const file::Path &path) const;
+    file::Path selectedPath() const; // empty if nothing is selected
+    // audition the selection when it changes
+    void updatePreview();
+    void stopPreview();
 
     App * const app;
     const file::FileType type;
@@ -31,8 +38,13 @@ private:
     file::Path path;
     vector<file::Path> directories;
     vector<file::Path> files;
+    bool scanning {false}; // entries are still being added
+    // if not empty, entries are from searching the library instead of path
+    string filter; // UTF-8
+    uint64_t searchVersion {0}; // of the library index
 
     int selected {0};
+    file::Path previewPath;
 };
 
 } // namespace
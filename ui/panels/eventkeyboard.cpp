@@ -267,6 +267,19 @@ void EventKeyboard::keyUp(const SDL_KeyboardEvent &e)
     }
 }
 
+void EventKeyboard::recordJam(bool playing, const Event &event,
+                              const Cursor &playCursor)
+{
+    const Cursor *at = playing ? &playCursor : nullptr;
+    if (event.special == Event::Special::FadeOut) {
+        if (playing)
+            writeEvent(true, event, Event::ALL, false, at);
+        return;
+    }
+    select(event);
+    writeEvent(playing, selected, Event::PITCH, false, at);
+}
+
 void EventKeyboard::reset()
 {
     selected.pitch = MIDDLE_C;
@@ -301,9 +314,10 @@ int EventKeyboard::sampleIndex()
 }
 
 void EventKeyboard::writeEvent(bool playing, const Event &event,
-                               Event::Mask mask, bool continuous)
+                               Event::Mask mask, bool continuous,
+                               const Cursor *at)
 {
-    app->eventsEdit.writeEvent(playing, event, mask, continuous);
+    app->eventsEdit.writeEvent(playing, event, mask, continuous, at);
 }
 
 int EventKeyboard::pitchKeymap(SDL_Scancode key)
@@ -1,6 +1,7 @@
 #pragma once
 #include <common.h>
 
+#include <cursor.h>
 #include <event.h>
 #include <ui/ui.h>
 #include <SDL2/SDL_events.h>
@@ -18,6 +19,9 @@ public:
     void drawSampleList(Rect rect);
     void keyDown(const SDL_KeyboardEvent &e);
     void keyUp(const SDL_KeyboardEvent &e);
+    // record an event which was already played (eg. from MIDI).
+    // if playing, it is written at playCursor instead of the edit cursor
+    void recordJam(bool playing, const Event &event, const Cursor &playCursor);
 
     void reset();
     void select(const Event &event);
@@ -30,7 +34,7 @@ private:
     int sampleKeymap(SDL_Scancode key);
     // for convenience, redirect to EventsEdit
     void writeEvent(bool playing, const Event &event, Event::Mask mask,
-                    bool continuous=false);
+                    bool continuous=false, const Cursor *at=nullptr);
 
     App * const app;
 
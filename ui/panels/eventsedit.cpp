@@ -62,6 +62,8 @@ void EventsEdit::drawEvents(Rect rect)
                 movedEditCur = false;
                 playCur = editCur.cursor;
                 app->player.setCursor(playCur);
+                app->flushRenderAhead();
+                app->prefetcher.cursorMoved();
             } else {
                 editCur.cursor = playCur;
             }
@@ -255,6 +257,8 @@ void EventsEdit::keyDown(const SDL_KeyboardEvent &e)
                 snapToGrid();
             } else if (!song.sections.empty()) {
                 player.setCursor(editCur.cursor);
+                app->flushRenderAhead();
+                app->prefetcher.cursorMoved();
             }
         }
         break;
@@ -262,6 +266,7 @@ void EventsEdit::keyDown(const SDL_KeyboardEvent &e)
         if (!e.repeat) {
             std::unique_lock playerLock(player.mu);
             player.stop();
+            app->flushRenderAhead();
         }
         break;
     /* Navigation */
@@ -543,16 +548,24 @@ void EventsEdit::resetCursor(bool newSong)
     }
 }
 
+Cursor EventsEdit::cursor() const
+{
+    return editCur.cursor;
+}
+
 void EventsEdit::writeEvent(bool playing, const Event &event, Event::Mask mask,
-                            bool continuous)
+                            bool continuous, const Cursor *at)
 {
+    TrackCursor writeCur = editCur;
+    if (at)
+        writeCur.cursor = *at;
     SDL_Keymod mod = SDL_GetModState();
     if (mod & KMOD_ALT) {
         app->undoer.doOp(edit::ops::MergeEvent(
-            editCur, event, mask), continuous);
+            writeCur, event, mask), continuous);
     } else if (mod & (KMOD_CAPS | KMOD_SHIFT)) {
         app->undoer.doOp(edit::ops::WriteCell(
-            editCur, playing ? 1 : cellSize, event), continuous);
+            writeCur, playing ? 1 : cellSize, event), continuous);
         // TODO if playing, clear events
     }
     // TODO combine into single undo operation while playing
@@ -24,8 +24,10 @@ public:
     void mouseWheel(const SDL_MouseWheelEvent &e);
 
     void resetCursor(bool newSong);
+    Cursor cursor() const;
+    // at the edit cursor, or at another time in the same track
     void writeEvent(bool playing, const Event &event, Event::Mask mask,
-                    bool continuous);
+                    bool continuous, const Cursor *at=nullptr);
 
 private:
     // cached properties of song objects used while rendering
@@ -7,6 +7,11 @@ struct Settings
 {
     string lastOpenPath;
     vector<string> bookmarks;
+    // render song on a separate thread this far ahead of the audio callback
+    bool renderAhead {false};
+    int renderAheadMs {20};
+    bool limiter {false}; // soft limit output instead of hard clipping
+    bool dither {true}; // TPDF dither if the device takes 16 bit output
 };
 
 } // namespace
@@ -3,6 +3,6 @@
 
 namespace chromatracker {
 
-const uint16_t VERSION = 0;
+const uint16_t VERSION = 4;
 
 } // namespace